@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+// fixed capacity set of small integers (client indices), the phase loops scan it
+// a 64-bit word at a time instead of testing a flag in every client, e.g.
+// for(int i = bits.findNext(0); i != -1; i = bits.findNext(i + 1))
+class BitSet
+{
+public:
+    BitSet() = default;
+    ~BitSet() {free(words_);}
+    BitSet(const BitSet&) = delete;
+    BitSet& operator=(const BitSet&) = delete;
+
+    // all the bits are cleared
+    void init(int capacity)
+    {
+        free(words_);
+        numWords_ = (capacity + 63) / 64;
+        words_ = (unsigned long long*)calloc(numWords_ ? numWords_ : 1, sizeof(*words_));
+        assert(words_);
+    }
+
+    int capacity() const {return numWords_ * 64;}
+
+    bool test(int i) const {return words_[i / 64] >> (i % 64) & 1;}
+    void set(int i) {words_[i / 64] |= 1ull << (i % 64);}
+    void reset(int i) {words_[i / 64] &= ~(1ull << (i % 64));}
+
+    void assign(int i, bool value)
+    {
+        if(value)
+            set(i);
+        else
+            reset(i);
+    }
+
+    // for the swap-with-last removal of the indexed items
+    void move(int to, int from)
+    {
+        assign(to, test(from));
+        reset(from);
+    }
+
+    void clear() {memset(words_, 0, numWords_ * sizeof(*words_));}
+
+    // returns the first index >= from in the set, -1 if none
+    int findNext(int from) const {return findNextEither(*this, *this, from);}
+
+    // returns the first index >= from in a or in b (of the same capacity), -1 if none
+    friend int findNextEither(const BitSet& a, const BitSet& b, int from)
+    {
+        int w = from / 64;
+        if(w >= a.numWords_)
+            return -1;
+
+        unsigned long long word = (a.words_[w] | b.words_[w]) & (~0ull << (from % 64));
+
+        while(!word)
+        {
+            if(++w == a.numWords_)
+                return -1;
+
+            word = a.words_[w] | b.words_[w];
+        }
+
+        return w * 64 + __builtin_ctzll(word);
+    }
+
+private:
+    unsigned long long* words_ = nullptr;
+    int numWords_ = 0;
+};
@@ -0,0 +1,280 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "Array.hpp"
+
+// node (server process) <-> broker protocol, the nodes of a cluster exchange room
+// broadcasts and the player name registry through the broker
+//
+// stream of [BrokerMsg][BrokerMsg::size bytes], the key is a room name (Sub, Unsub, Pub)
+// or a player name (Claim, Release)
+// a node subscribes to the rooms it hosts and gets only their broadcasts, the name
+// claims of all the other nodes are forwarded to every node (a new node gets them
+// all when it connects)
+
+enum class BrokerCmd
+{
+    Sub,
+    Unsub,
+    Pub,    // framed messages for every player in the room
+    Claim,  // a player has the name
+    Release
+};
+
+constexpr int brokerKeySize = 20; // same as the names on the server
+
+struct BrokerMsg
+{
+    int cmd;  // BrokerCmd
+    int size; // of the data that follows
+    char key[brokerKeySize];
+};
+
+// the largest message a peer accepts, a Pub is one room broadcast of one iteration
+constexpr int brokerMaxMsgSize = 4 * 1024 * 1024;
+
+inline void addBrokerMsg(Array<char>& buf, BrokerCmd cmd, const char* key,
+                         const char* data = nullptr, int size = 0)
+{
+    BrokerMsg msg = {};
+    msg.cmd = int(cmd);
+    msg.size = size;
+    snprintf(msg.key, sizeof(msg.key), "%s", key);
+
+    const int prevSize = buf.size();
+    buf.resize(prevSize + sizeof(msg) + size);
+    memcpy(buf.data() + prevSize, &msg, sizeof(msg));
+
+    if(size)
+        memcpy(buf.data() + prevSize + sizeof(msg), data, size);
+}
+
+// addr - Unix socket path (contains '/') or [host:]port, returns false if failed
+inline bool getBrokerAddr(const char* addr, sockaddr_storage& sa, socklen_t& saSize,
+                          bool passive)
+{
+    memset(&sa, 0, sizeof(sa));
+
+    if(strchr(addr, '/'))
+    {
+        sockaddr_un& un = (sockaddr_un&)sa;
+        if(strlen(addr) >= sizeof(un.sun_path))
+        {
+            printf("broker socket path is too long: '%s'\n", addr);
+            return false;
+        }
+
+        un.sun_family = AF_UNIX;
+        strcpy(un.sun_path, addr);
+        saSize = sizeof(un);
+        return true;
+    }
+
+    char host[256] = "";
+    const char* port = addr;
+    const char* const colon = strrchr(addr, ':');
+
+    if(colon)
+    {
+        snprintf(host, sizeof(host), "%.*s", int(colon - addr), addr);
+        port = colon + 1;
+    }
+
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = passive ? AI_PASSIVE : 0;
+
+    addrinfo* list;
+    const int ec = getaddrinfo(host[0] ? host : nullptr, port, &hints, &list);
+    if(ec != 0)
+    {
+        printf("getaddrinfo() (broker) failed: %s\n", gai_strerror(ec));
+        return false;
+    }
+
+    memcpy(&sa, list->ai_addr, list->ai_addrlen);
+    saSize = list->ai_addrlen;
+    freeaddrinfo(list);
+    return true;
+}
+
+// the node side, messages are batched and written with one send() per flush()
+class BrokerLink
+{
+public:
+    BrokerLink() = default;
+    ~BrokerLink() {close();}
+    BrokerLink(const BrokerLink&) = delete;
+    BrokerLink& operator=(const BrokerLink&) = delete;
+
+    // blocking connect, returns false if failed
+    bool open(const char* addr)
+    {
+        sockaddr_storage sa;
+        socklen_t saSize;
+        if(!getBrokerAddr(addr, sa, saSize, false))
+            return false;
+
+        fd_ = socket(sa.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if(fd_ == -1)
+        {
+            perror("socket() (broker) failed");
+            return false;
+        }
+
+        if(connect(fd_, (const sockaddr*)&sa, saSize) == -1 ||
+           fcntl(fd_, F_SETFL, O_NONBLOCK) == -1)
+        {
+            perror("connect() (broker) failed");
+            close();
+            return false;
+        }
+
+        return true;
+    }
+
+    bool isOpen() const {return fd_ != -1;}
+
+    void close()
+    {
+        if(fd_ != -1)
+            ::close(fd_);
+
+        fd_ = -1;
+        sendBuf_.clear();
+        recvBuf_.clear();
+        numRead_ = 0;
+    }
+
+    void add(BrokerCmd cmd, const char* key, const char* data = nullptr, int size = 0)
+    {
+        if(fd_ != -1)
+            addBrokerMsg(sendBuf_, cmd, key, data, size);
+    }
+
+    // returns false if the connection was lost (it is closed then)
+    bool flush()
+    {
+        if(fd_ == -1 || sendBuf_.empty())
+            return fd_ != -1;
+
+        const int rc = send(fd_, sendBuf_.data(), sendBuf_.size(), MSG_NOSIGNAL);
+
+        if(rc == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        {
+            perror("send() (broker) failed");
+            close();
+            return false;
+        }
+
+        if(rc > 0)
+            sendBuf_.erase(0, rc);
+
+        return true;
+    }
+
+    // waits until everything is sent, returns false if the connection was lost or
+    // timeoutMs has passed (the connection is closed then)
+    bool flushAll(int timeoutMs)
+    {
+        while(flush() && !sendBuf_.empty())
+        {
+            pollfd pfd = {fd_, POLLOUT, 0};
+            const int rc = poll(&pfd, 1, timeoutMs);
+
+            if(rc == -1 && errno == EINTR)
+                continue;
+
+            if(rc != 1)
+            {
+                printf("flushing the broker connection timed out\n");
+                close();
+                return false;
+            }
+        }
+
+        return isOpen();
+    }
+
+    // reads everything available, returns false if the connection was lost
+    // (it is closed then)
+    bool receive()
+    {
+        if(fd_ == -1)
+            return false;
+
+        recvBuf_.erase(0, numRead_);
+        numRead_ = 0;
+
+        while(true)
+        {
+            char buf[64 * 1024];
+            const int rc = recv(fd_, buf, sizeof(buf), 0);
+
+            if(rc > 0)
+            {
+                const int prevSize = recvBuf_.size();
+                recvBuf_.resize(prevSize + rc);
+                memcpy(recvBuf_.data() + prevSize, buf, rc);
+                continue;
+            }
+
+            if(rc == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return true;
+
+            if(rc == -1 && errno == EINTR)
+                continue;
+
+            if(rc == 0)
+                printf("broker has closed the connection\n");
+            else
+                perror("recv() (broker) failed");
+
+            close();
+            return false;
+        }
+    }
+
+    // the next complete received message, data is valid until receive()
+    // returns false if there is none, an invalid message closes the connection
+    bool nextMsg(BrokerMsg& msg, const char*& data)
+    {
+        if(recvBuf_.size() - numRead_ < int(sizeof(msg)))
+            return false;
+
+        memcpy(&msg, recvBuf_.data() + numRead_, sizeof(msg));
+        msg.key[sizeof(msg.key) - 1] = '\0';
+
+        // the stream can't be resynchronized
+        if(msg.size < 0 || msg.size > brokerMaxMsgSize)
+        {
+            printf("broker has sent an invalid message\n");
+            close();
+            return false;
+        }
+
+        if(recvBuf_.size() - numRead_ < int(sizeof(msg)) + msg.size)
+            return false;
+
+        data = recvBuf_.data() + numRead_ + sizeof(msg);
+        numRead_ += sizeof(msg) + msg.size;
+        return true;
+    }
+
+private:
+    int fd_ = -1;
+    Array<char> sendBuf_;
+    Array<char> recvBuf_;
+    int numRead_ = 0; // bytes of recvBuf_ returned by nextMsg()
+};
@@ -0,0 +1,154 @@
+#pragma once
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "Array.hpp"
+
+// traffic capture, the inbound frames of every connection with timestamps
+//
+// file: [CaptureHeader] then records [CaptureRecord][frame (CaptureRecord::size bytes)]
+// the file is only appended to, a hot upgraded server continues the same capture
+// (connection ids are handed over)
+
+constexpr char captureMagic[4] = {'C', 'A', 'P', 'T'};
+constexpr int captureVersion = 1;
+
+struct CaptureHeader
+{
+    char magic[4];
+    int version;
+};
+
+enum class CaptureEvent
+{
+    Open,  // new connection
+    Frame, // one '\0' terminated message received from the connection
+    Close
+};
+
+struct CaptureRecord
+{
+    long long timeUs; // CLOCK_REALTIME, valid across processes
+    int connId;
+    int event;        // CaptureEvent
+    int size;         // of the frame that follows, 0 for Open and Close
+    int reserved;
+};
+
+inline long long getCaptureTimeUs()
+{
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+// records are buffered and written with one write() per flush()
+class CaptureWriter
+{
+public:
+    CaptureWriter() = default;
+    ~CaptureWriter() {close();}
+    CaptureWriter(const CaptureWriter&) = delete;
+    CaptureWriter& operator=(const CaptureWriter&) = delete;
+
+    // returns false if failed
+    bool open(const char* filename)
+    {
+        fd_ = ::open(filename, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if(fd_ == -1)
+        {
+            perror("open() (capture) failed");
+            return false;
+        }
+
+        struct stat st;
+        if(fstat(fd_, &st) == -1)
+        {
+            perror("fstat() (capture) failed");
+            close();
+            return false;
+        }
+
+        // new file
+        if(st.st_size == 0)
+        {
+            CaptureHeader header;
+            memcpy(header.magic, captureMagic, sizeof(header.magic));
+            header.version = captureVersion;
+            add(&header, sizeof(header));
+        }
+
+        return true;
+    }
+
+    bool isOpen() const {return fd_ != -1;}
+
+    void addEvent(CaptureEvent event, int connId, const char* frame = nullptr, int size = 0)
+    {
+        if(fd_ == -1)
+            return;
+
+        CaptureRecord record = {};
+        record.timeUs = getCaptureTimeUs();
+        record.connId = connId;
+        record.event = int(event);
+        record.size = size;
+        add(&record, sizeof(record));
+        add(frame, size);
+    }
+
+    // returns the number of written bytes, the capture stops on a write error
+    int flush()
+    {
+        if(fd_ == -1 || buf_.empty())
+            return 0;
+
+        int numWritten = 0;
+        while(numWritten < buf_.size())
+        {
+            const int rc = write(fd_, buf_.data() + numWritten, buf_.size() - numWritten);
+
+            if(rc == -1)
+            {
+                if(errno == EINTR)
+                    continue;
+
+                perror("write() (capture) failed, stopping the capture");
+                ::close(fd_);
+                fd_ = -1;
+                break;
+            }
+
+            numWritten += rc;
+        }
+
+        buf_.clear();
+        return numWritten;
+    }
+
+    void close()
+    {
+        if(fd_ == -1)
+            return;
+
+        flush();
+        ::close(fd_);
+        fd_ = -1;
+    }
+
+private:
+    int fd_ = -1;
+    Array<char> buf_;
+
+    void add(const void* data, int size)
+    {
+        const int prevSize = buf_.size();
+        buf_.resize(prevSize + size);
+        memcpy(buf_.data() + prevSize, data, size);
+    }
+};
@@ -0,0 +1,157 @@
+#pragma once
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+// helpers for AF_UNIX stream sockets (blocking except recvWithFds()), descriptors are
+// passed with SCM_RIGHTS
+
+// returns false if failed
+inline bool sendAll(int sockfd, const void* data, int size)
+{
+    const char* it = (const char*)data;
+
+    while(size)
+    {
+        const int rc = send(sockfd, it, size, MSG_NOSIGNAL);
+
+        if(rc == -1)
+        {
+            if(errno == EINTR)
+                continue;
+
+            return false;
+        }
+
+        it += rc;
+        size -= rc;
+    }
+
+    return true;
+}
+
+// returns false if failed or the connection was closed
+inline bool recvAll(int sockfd, void* data, int size)
+{
+    char* it = (char*)data;
+
+    while(size)
+    {
+        const int rc = recv(sockfd, it, size, 0);
+
+        if(rc == -1 && errno == EINTR)
+            continue;
+
+        if(rc <= 0)
+            return false;
+
+        it += rc;
+        size -= rc;
+    }
+
+    return true;
+}
+
+// fd is attached to the first byte of data, size must be > 0
+inline bool sendWithFd(int sockfd, const void* data, int size, int fd)
+{
+    char control[CMSG_SPACE(sizeof(int))] = {};
+    iovec iov = {(void*)data, size_t(size)};
+
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    cmsghdr* const cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    int rc;
+    do
+        rc = sendmsg(sockfd, &msg, MSG_NOSIGNAL);
+    while(rc == -1 && errno == EINTR);
+
+    if(rc <= 0)
+        return false;
+
+    return sendAll(sockfd, (const char*)data + rc, size - rc);
+}
+
+// received descriptor is close-on-exec, fd is -1 if none was attached
+inline bool recvWithFd(int sockfd, void* data, int size, int& fd)
+{
+    char control[CMSG_SPACE(sizeof(int))];
+    iovec iov = {data, size_t(size)};
+
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    int rc;
+    do
+        rc = recvmsg(sockfd, &msg, MSG_CMSG_CLOEXEC);
+    while(rc == -1 && errno == EINTR);
+
+    if(rc <= 0)
+        return false;
+
+    fd = -1;
+    for(cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+
+    return recvAll(sockfd, (char*)data + rc, size - rc);
+}
+
+// non-blocking stream receive that also takes the descriptors (close-on-exec) attached
+// to the received bytes, returns what recvmsg() does
+// (descriptors over the control buffer capacity are closed by the kernel)
+inline int recvWithFds(int sockfd, void* data, int size, int* fds, int maxFds, int& numFds)
+{
+    constexpr int controlFds = 16;
+    char control[CMSG_SPACE(sizeof(int) * controlFds)];
+    iovec iov = {data, size_t(size)};
+
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    numFds = 0;
+    const int rc = recvmsg(sockfd, &msg, MSG_CMSG_CLOEXEC);
+
+    if(rc <= 0)
+        return rc;
+
+    for(cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+
+        const int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for(int i = 0; i < count; ++i)
+        {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+
+            if(numFds < maxFds)
+                fds[numFds++] = fd;
+            else
+                close(fd);
+        }
+    }
+
+    return rc;
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <string.h>
+#include "Array.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FRAME_INDEX_X86
+#endif
+
+// finds all the '\0' delimited messages in a buffer in one pass, the dispatcher
+// then works with offsets and lengths instead of walking the bytes again
+// (memchr + strlen + strncmp per message)
+
+struct Frame
+{
+    int offset;
+    int size; // without '\0'
+};
+
+// all the functions index only complete messages and return the number of consumed bytes
+// (the end of the last complete message), frames is cleared first
+
+// scans [from, size), begin - offset of the current message
+inline void addFramesScalar(const char* data, int from, int size, int& begin,
+                            Array<Frame>& frames)
+{
+    for(int i = from; i < size; ++i)
+    {
+        if(data[i] == '\0')
+        {
+            frames.pushBack(Frame{begin, i - begin});
+            begin = i + 1;
+        }
+    }
+}
+
+inline int indexFramesScalar(const char* data, int size, Array<Frame>& frames)
+{
+    frames.clear();
+    int begin = 0;
+    addFramesScalar(data, 0, size, begin, frames);
+    return begin;
+}
+
+#ifdef FRAME_INDEX_X86
+
+// mask bit i set - data[base + i] is a delimiter
+inline void addFrames(unsigned mask, int base, int& begin, Array<Frame>& frames)
+{
+    while(mask)
+    {
+        const int pos = base + __builtin_ctz(mask);
+        frames.pushBack(Frame{begin, pos - begin});
+        begin = pos + 1;
+        mask &= mask - 1;
+    }
+}
+
+__attribute__((target("sse2")))
+inline int indexFramesSse2(const char* data, int size, Array<Frame>& frames)
+{
+    frames.clear();
+    const __m128i zero = _mm_setzero_si128();
+    int begin = 0;
+    int i = 0;
+
+    for(; i + 16 <= size; i += 16)
+    {
+        const __m128i v = _mm_loadu_si128((const __m128i*)(data + i));
+        addFrames(_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)), i, begin, frames);
+    }
+
+    addFramesScalar(data, i, size, begin, frames);
+    return begin;
+}
+
+__attribute__((target("avx2")))
+inline int indexFramesAvx2(const char* data, int size, Array<Frame>& frames)
+{
+    frames.clear();
+    const __m256i zero = _mm256_setzero_si256();
+    int begin = 0;
+    int i = 0;
+
+    for(; i + 32 <= size; i += 32)
+    {
+        const __m256i v = _mm256_loadu_si256((const __m256i*)(data + i));
+        addFrames(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero)), i, begin, frames);
+    }
+
+    addFramesScalar(data, i, size, begin, frames);
+    return begin;
+}
+
+#endif
+
+// picks the widest instruction set the cpu supports
+inline int indexFrames(const char* data, int size, Array<Frame>& frames)
+{
+#ifdef FRAME_INDEX_X86
+    static const bool hasAvx2 = __builtin_cpu_supports("avx2");
+    static const bool hasSse2 = __builtin_cpu_supports("sse2");
+
+    if(hasAvx2)
+        return indexFramesAvx2(data, size, frames);
+
+    if(hasSse2)
+        return indexFramesSse2(data, size, frames);
+#endif
+
+    return indexFramesScalar(data, size, frames);
+}
@@ -0,0 +1,1020 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <thread>
+#include "Array.hpp"
+#include "MsgRing.hpp"
+
+// persistence of the player profiles, the name reservations and the chat history
+//
+// an append-only log in a memory-mapped file:
+// [JournalHeader] then records [JournalRecord][payload, padded to 8 bytes], zeroes follow
+// the last record (the file is extended ahead of the writer)
+//
+// the I/O loop appends a record with a memcpy() into the mapping, never a syscall,
+// a background thread makes the records durable with one msync() for everything appended
+// since the previous one (group commit, every syncIntervalMs), extends the file and
+// compacts the log when it has grown over twice the live state: the state is written to
+// a new file as one record per profile and room history, the records appended meanwhile
+// are carried over when the I/O loop switches to it (poll()), then it's renamed over
+// the old file, the new file gets its magic only once switched, so open() can tell a
+// compaction that hasn't finished (removed) from a switched log that wasn't renamed
+//
+// at startup the log is replayed into a JournalState, it ends at the first torn or
+// corrupt record
+
+constexpr char journalMagic[4] = {'J', 'R', 'N', 'L'};
+constexpr int journalVersion = 1;
+constexpr int journalNameSize = 20; // as Client::name and Room::name
+
+struct JournalHeader
+{
+    char magic[4];
+    int version;
+};
+
+struct JournalType
+{
+    enum
+    {
+        _end, // zeroes after the last record
+        Profile,
+        Reservation,
+        Chat,
+        _count
+    };
+};
+
+struct JournalRecord
+{
+    unsigned checksum; // FNV-1a of type, size and the payload
+    int type;
+    int size;          // of the payload, without the padding
+    int reserved;
+};
+
+struct ProfileStats
+{
+    long long firstSeen; // unix seconds
+    long long lastSeen;
+    long long logins;
+    long long chatMsgs;
+};
+
+// payloads
+struct ProfileRecord
+{
+    char name[journalNameSize];
+    int reserved;
+    ProfileStats stats;
+};
+
+// the name is kept for the session with the token (0 - released) until the time
+struct ReservationRecord
+{
+    char name[journalNameSize];
+    int reserved;
+    unsigned long long token;
+    long long until; // unix seconds
+};
+
+// the broadcast messages of the room follow
+struct ChatRecord
+{
+    char room[journalNameSize];
+    int reserved;
+};
+
+inline long long getJournalRecordSize(int payloadSize)
+{
+    return (sizeof(JournalRecord) + payloadSize + 7) & ~7LL;
+}
+
+inline unsigned getJournalChecksum(unsigned h, const void* data, int size)
+{
+    const unsigned char* const bytes = (const unsigned char*)data;
+    for(int i = 0; i < size; ++i)
+        h = (h ^ bytes[i]) * 16777619u;
+
+    return h;
+}
+
+// the payload in two parts (e.g. a ChatRecord and the messages), dst has
+// getJournalRecordSize() bytes
+inline void writeJournalRecord(char* dst, int type, const void* a, int aSize,
+                               const void* b = nullptr, int bSize = 0)
+{
+    JournalRecord record = {};
+    record.type = type;
+    record.size = aSize + bSize;
+
+    unsigned h = getJournalChecksum(2166136261u, &record.type, sizeof(int) * 2);
+    h = getJournalChecksum(h, a, aSize);
+    record.checksum = getJournalChecksum(h, b, bSize);
+
+    memcpy(dst, &record, sizeof(record));
+    memcpy(dst + sizeof(record), a, aSize);
+    if(bSize)
+        memcpy(dst + sizeof(record) + aSize, b, bSize);
+
+    const long long end = sizeof(record) + aSize + bSize;
+    memset(dst + end, 0, getJournalRecordSize(aSize + bSize) - end);
+}
+
+inline void addJournalRecord(Array<char>& out, int type, const void* a, int aSize,
+                             const void* b = nullptr, int bSize = 0)
+{
+    const int prevSize = out.size();
+    out.resize(prevSize + getJournalRecordSize(aSize + bSize));
+    writeJournalRecord(out.data() + prevSize, type, a, aSize, b, bSize);
+}
+
+struct PlayerProfile
+{
+    char name[journalNameSize];
+    ProfileStats stats;
+    unsigned long long token; // the reservation, see ReservationRecord
+    long long reservedUntil;
+};
+
+// the chat history of a room that has been used (the room might not exist now)
+struct JournalRoom
+{
+    char name[journalNameSize];
+    long long lastUsed; // record counter, the least recently used room is evicted
+    MsgRing history;
+};
+
+// what the log describes, the profiles are looked up by the name and by the token of
+// their reservation in hash tables (open addressing, linear probing), profiles are never
+// removed
+class JournalState
+{
+public:
+    JournalState() = default;
+    ~JournalState() {delete[] rooms_;}
+    JournalState(const JournalState&) = delete;
+    JournalState& operator=(const JournalState&) = delete;
+
+    // everything is cleared, histories of at most maxRooms rooms are kept
+    void init(int historySize, int maxRooms)
+    {
+        delete[] rooms_;
+        rooms_ = new JournalRoom[maxRooms];
+        maxRooms_ = maxRooms;
+        numRooms_ = 0;
+        historySize_ = historySize;
+        numApplied_ = 0;
+        profiles_.clear();
+        index_.resize(1024);
+        memset(index_.data(), 0, index_.size() * sizeof(int));
+        tokenIndex_.resize(1024);
+        memset(tokenIndex_.data(), 0, tokenIndex_.size() * sizeof(int));
+        numTokenEntries_ = 0;
+    }
+
+    int getHistorySize() const {return historySize_;}
+    int getMaxRooms() const {return maxRooms_;}
+
+    int getNumProfiles() const {return profiles_.size();}
+    const PlayerProfile& getProfile(int i) const {return profiles_[i];}
+
+    // nullptr if none
+    PlayerProfile* findProfile(const char* name)
+    {
+        const int slot = findSlot(name);
+        return index_[slot] ? &profiles_[index_[slot] - 1] : nullptr;
+    }
+
+    // created if there is none, the pointer is valid until the next profile is created
+    PlayerProfile& getProfile(const char* name)
+    {
+        int slot = findSlot(name);
+
+        if(!index_[slot])
+        {
+            PlayerProfile profile = {};
+            snprintf(profile.name, sizeof(profile.name), "%s", name);
+            profiles_.pushBack(profile);
+            index_[slot] = profiles_.size();
+
+            if(profiles_.size() * 2 > index_.size())
+                rehash();
+        }
+
+        slot = findSlot(name);
+        return profiles_[index_[slot] - 1];
+    }
+
+    // reserved for another session
+    bool isReserved(const char* name, unsigned long long token, long long now)
+    {
+        const PlayerProfile* const profile = findProfile(name);
+        return profile && profile->token && profile->token != token &&
+               profile->reservedUntil > now;
+    }
+
+    // the profile with an active reservation for the token, nullptr if none
+    PlayerProfile* findReservation(unsigned long long token, long long now)
+    {
+        if(!token)
+            return nullptr;
+
+        const int mask = tokenIndex_.size() - 1;
+        for(int slot = hashToken(token) & mask; tokenIndex_[slot]; slot = (slot + 1) & mask)
+        {
+            PlayerProfile& profile = profiles_[tokenIndex_[slot] - 1];
+            if(profile.token == token && profile.reservedUntil > now)
+                return &profile;
+        }
+
+        return nullptr;
+    }
+
+    // nullptr if none
+    const MsgRing* findHistory(const char* room) const
+    {
+        for(int r = 0; r < numRooms_; ++r)
+        {
+            if(strcmp(rooms_[r].name, room) == 0)
+                return &rooms_[r].history;
+        }
+
+        return nullptr;
+    }
+
+    void setStats(const char* name, const ProfileStats& stats) {getProfile(name).stats = stats;}
+
+    void reserve(const char* name, unsigned long long token, long long until)
+    {
+        PlayerProfile& profile = getProfile(name);
+        const bool newToken = token && token != profile.token;
+        profile.token = token;
+        profile.reservedUntil = until;
+
+        // the entry of the previous token stays until the table is rebuilt
+        if(newToken)
+            addTokenEntry(&profile - profiles_.data());
+    }
+
+    // msgs - complete messages
+    void addChat(const char* room, const char* msgs, int size)
+    {
+        ++numApplied_;
+        int r = 0;
+        while(r < numRooms_ && strcmp(rooms_[r].name, room) != 0)
+            ++r;
+
+        if(r == numRooms_)
+        {
+            if(numRooms_ < maxRooms_)
+                ++numRooms_;
+            else
+            {
+                r = 0;
+                for(int k = 1; k < numRooms_; ++k)
+                {
+                    if(rooms_[k].lastUsed < rooms_[r].lastUsed)
+                        r = k;
+                }
+            }
+
+            snprintf(rooms_[r].name, sizeof(rooms_[r].name), "%s", room);
+            rooms_[r].history.init(historySize_);
+        }
+
+        rooms_[r].lastUsed = numApplied_;
+        rooms_[r].history.push(msgs, size);
+    }
+
+    // returns false if the record is malformed
+    bool apply(int type, const char* payload, int size)
+    {
+        switch(type)
+        {
+            case JournalType::Profile:
+            {
+                ProfileRecord record;
+                if(size != sizeof(record))
+                    return false;
+
+                memcpy(&record, payload, sizeof(record));
+                record.name[journalNameSize - 1] = '\0';
+                setStats(record.name, record.stats);
+                return true;
+            }
+
+            case JournalType::Reservation:
+            {
+                ReservationRecord record;
+                if(size != sizeof(record))
+                    return false;
+
+                memcpy(&record, payload, sizeof(record));
+                record.name[journalNameSize - 1] = '\0';
+                reserve(record.name, record.token, record.until);
+                return true;
+            }
+
+            case JournalType::Chat:
+            {
+                ChatRecord record;
+                if(size <= int(sizeof(record)) || payload[size - 1] != '\0')
+                    return false;
+
+                memcpy(&record, payload, sizeof(record));
+                record.room[journalNameSize - 1] = '\0';
+                addChat(record.room, payload + sizeof(record), size - sizeof(record));
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    // the state as the records of a compacted log, without the reservations expired
+    // before now
+    void writeSnapshot(Array<char>& out, long long now) const
+    {
+        for(const PlayerProfile& profile: profiles_)
+        {
+            ProfileRecord pr = {};
+            memcpy(pr.name, profile.name, sizeof(pr.name));
+            pr.stats = profile.stats;
+            addJournalRecord(out, JournalType::Profile, &pr, sizeof(pr));
+
+            if(!profile.token || profile.reservedUntil <= now)
+                continue;
+
+            ReservationRecord rr = {};
+            memcpy(rr.name, profile.name, sizeof(rr.name));
+            rr.token = profile.token;
+            rr.until = profile.reservedUntil;
+            addJournalRecord(out, JournalType::Reservation, &rr, sizeof(rr));
+        }
+
+        // a message can wrap around the end of the ring
+        Array<char> msgs;
+        for(int r = 0; r < numRooms_; ++r)
+        {
+            iovec iov[2];
+            const int numSpans = rooms_[r].history.getSpans(iov);
+            if(!numSpans)
+                continue;
+
+            msgs.resize(rooms_[r].history.size());
+            memcpy(msgs.data(), iov[0].iov_base, iov[0].iov_len);
+            if(numSpans == 2)
+                memcpy(msgs.data() + iov[0].iov_len, iov[1].iov_base, iov[1].iov_len);
+
+            ChatRecord cr = {};
+            memcpy(cr.room, rooms_[r].name, sizeof(cr.room));
+            addJournalRecord(out, JournalType::Chat, &cr, sizeof(cr), msgs.data(), msgs.size());
+        }
+    }
+
+    // bytes of writeSnapshot()
+    long long getSnapshotSize() const
+    {
+        long long size = 0;
+        for(const PlayerProfile& profile: profiles_)
+        {
+            size += getJournalRecordSize(sizeof(ProfileRecord));
+            if(profile.token)
+                size += getJournalRecordSize(sizeof(ReservationRecord));
+        }
+
+        for(int r = 0; r < numRooms_; ++r)
+            size += getJournalRecordSize(sizeof(ChatRecord) + rooms_[r].history.size());
+
+        return size;
+    }
+
+private:
+    Array<PlayerProfile> profiles_;
+    Array<int> index_; // profile index + 1, 0 - empty, the size is a power of 2
+    // the same by the token, an entry whose profile has another token now is stale
+    Array<int> tokenIndex_;
+    int numTokenEntries_ = 0;
+    JournalRoom* rooms_ = nullptr;
+    int maxRooms_ = 0;
+    int numRooms_ = 0;
+    int historySize_ = 0;
+    long long numApplied_ = 0;
+
+    static unsigned hashName(const char* name)
+    {
+        unsigned h = 2166136261u;
+        for(int i = 0; name[i] && i < journalNameSize - 1; ++i)
+            h = (h ^ (unsigned char)name[i]) * 16777619u;
+
+        return h;
+    }
+
+    // of the name or the empty one where it would be
+    int findSlot(const char* name) const
+    {
+        const int mask = index_.size() - 1;
+        int slot = hashName(name) & mask;
+
+        while(index_[slot] && strncmp(profiles_[index_[slot] - 1].name, name,
+                                      journalNameSize - 1) != 0)
+            slot = (slot + 1) & mask;
+
+        return slot;
+    }
+
+    static unsigned hashToken(unsigned long long token)
+    {
+        return (token * 0x9e3779b97f4a7c15ull) >> 32;
+    }
+
+    void addTokenEntry(int profileIdx)
+    {
+        const int mask = tokenIndex_.size() - 1;
+        int slot = hashToken(profiles_[profileIdx].token) & mask;
+
+        while(tokenIndex_[slot])
+            slot = (slot + 1) & mask;
+
+        tokenIndex_[slot] = profileIdx + 1;
+        numTokenEntries_ += 1;
+
+        if(numTokenEntries_ * 2 > tokenIndex_.size())
+            rebuildTokenIndex();
+    }
+
+    // without the stale entries, at most a quarter full
+    void rebuildTokenIndex()
+    {
+        int numTokens = 0;
+        for(const PlayerProfile& profile: profiles_)
+            numTokens += profile.token != 0;
+
+        int size = 1024;
+        while(size < numTokens * 4)
+            size *= 2;
+
+        tokenIndex_.resize(size);
+        memset(tokenIndex_.data(), 0, tokenIndex_.size() * sizeof(int));
+        numTokenEntries_ = 0;
+
+        for(int i = 0; i < profiles_.size(); ++i)
+        {
+            if(!profiles_[i].token)
+                continue;
+
+            int slot = hashToken(profiles_[i].token) & (size - 1);
+            while(tokenIndex_[slot])
+                slot = (slot + 1) & (size - 1);
+
+            tokenIndex_[slot] = i + 1;
+            numTokenEntries_ += 1;
+        }
+    }
+
+    void rehash()
+    {
+        index_.resize(index_.size() * 2);
+        memset(index_.data(), 0, index_.size() * sizeof(int));
+
+        for(int i = 0; i < profiles_.size(); ++i)
+            index_[findSlot(profiles_[i].name)] = i + 1;
+    }
+};
+
+// written by the writer thread, read by the metrics
+struct JournalStats
+{
+    std::atomic<long long> syncs{0};
+    std::atomic<long long> syncedBytes{0};
+    std::atomic<long long> syncedRecords{0};
+    std::atomic<long long> syncSumUs{0};
+    std::atomic<long long> syncMaxUs{0};
+    std::atomic<long long> durableBytes{0};   // offset in the current file
+    std::atomic<long long> compactions{0};
+    std::atomic<long long> compactMaxUs{0};
+    std::atomic<long long> compactedBytes{0}; // the size of the log before the last one
+};
+
+class Journal
+{
+public:
+    // group commit period, the file grows by growSize, mapSize is the limit of the log
+    int syncIntervalMs = 5;
+    long long growSize = 16 * 1024 * 1024;
+    long long mapSize = 1024LL * 1024 * 1024;
+    // compaction when the log is over compactMinSize and twice the live state
+    long long compactMinSize = 16 * 1024 * 1024;
+    float compactIntervalSec = 60.f;
+
+    // I/O thread
+    long long numRecords = 0;
+    long long numBytes = 0;
+    long long numDropped = 0;   // the file couldn't grow in time or is full
+    long long numRecovered = 0; // records replayed by open()
+    long long recoveredBytes = 0;
+    JournalStats stats;
+
+    Journal() = default;
+    ~Journal() {close();}
+    Journal(const Journal&) = delete;
+    Journal& operator=(const Journal&) = delete;
+
+    bool isOpen() const {return fd_ != -1;}
+
+    // replays the log (created if there is none) into state, which is cleared (it keeps
+    // the sizes of its init()), then starts the writer, returns false if failed
+    bool open(const char* path, JournalState& state)
+    {
+        snprintf(path_, sizeof(path_), "%s", path);
+        snprintf(tmpPath_, sizeof(tmpPath_), "%s.tmp", path);
+
+        // a compaction that hasn't finished is removed, the log has everything, a switched
+        // one is the log
+        if(!isSwitchedLog(tmpPath_))
+            unlink(tmpPath_);
+        else if(rename(tmpPath_, path) == -1)
+        {
+            perror("rename() (journal) failed");
+            return false;
+        }
+
+        fd_ = ::open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if(fd_ == -1)
+        {
+            perror("open() (journal) failed");
+            return false;
+        }
+
+        struct stat st;
+        if(fstat(fd_, &st) == -1)
+        {
+            perror("fstat() (journal) failed");
+            close();
+            return false;
+        }
+
+        long long size = st.st_size;
+
+        if(size == 0)
+        {
+            JournalHeader header;
+            memcpy(header.magic, journalMagic, sizeof(header.magic));
+            header.version = journalVersion;
+
+            if(pwrite(fd_, &header, sizeof(header), 0) != sizeof(header))
+            {
+                perror("pwrite() (journal) failed");
+                close();
+                return false;
+            }
+
+            size = sizeof(header);
+        }
+
+        if(size > mapSize)
+        {
+            printf("journal '%s' is over the map size\n", path);
+            close();
+            return false;
+        }
+
+        map_ = (char*)mmap(nullptr, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+        if(map_ == MAP_FAILED)
+        {
+            map_ = nullptr;
+            perror("mmap() (journal) failed");
+            close();
+            return false;
+        }
+
+        JournalHeader header;
+        memcpy(&header, map_, sizeof(header));
+
+        if(size < int(sizeof(header)) || memcmp(header.magic, journalMagic, 4) != 0 ||
+           header.version != journalVersion)
+        {
+            printf("'%s' is not a journal of this version\n", path);
+            close();
+            return false;
+        }
+
+        state.init(state.getHistorySize(), state.getMaxRooms());
+        writerState_.init(state.getHistorySize(), state.getMaxRooms());
+        numRecovered = 0;
+        const long long end = replay(sizeof(header), size, &state, numRecovered);
+        recoveredBytes = end;
+
+        // a torn record or stale data after the end would be read back after new records,
+        // the rest of the file is zeroed
+        capacity_.store(getCapacity(end));
+
+        if(ftruncate(fd_, end) == -1 || ftruncate(fd_, capacity_.load()) == -1)
+        {
+            perror("ftruncate() (journal) failed");
+            close();
+            return false;
+        }
+
+        tail_ = end;
+        published_.store(end);
+        stats.durableBytes.store(end);
+        switch_.store(0);
+        renameFailed_ = false;
+        stop_.store(false);
+        finished_.store(false);
+        lastCompaction_ = getMonotonicSec();
+        thread_ = std::thread(&Journal::run, this);
+        return true;
+    }
+
+    // the writer makes everything durable before it stops
+    void close()
+    {
+        if(thread_.joinable())
+        {
+            stop_.store(true, std::memory_order_release);
+
+            // a compaction might be waiting for the switch
+            while(!finished_.load(std::memory_order_acquire))
+            {
+                poll();
+                usleep(1000);
+            }
+
+            thread_.join();
+        }
+
+        if(map_)
+            munmap(map_, mapSize);
+
+        if(fd_ != -1)
+            ::close(fd_);
+
+        map_ = nullptr;
+        fd_ = -1;
+    }
+
+    // I/O thread, returns false if dropped
+    bool add(int type, const void* a, int aSize, const void* b = nullptr, int bSize = 0)
+    {
+        const long long size = getJournalRecordSize(aSize + bSize);
+
+        if(!isOpen() || tail_ + size > capacity_.load(std::memory_order_acquire))
+        {
+            numDropped += 1;
+            return false;
+        }
+
+        writeJournalRecord(map_ + tail_, type, a, aSize, b, bSize);
+        tail_ += size;
+        published_.store(tail_, std::memory_order_release);
+        numRecords += 1;
+        numBytes += size;
+        return true;
+    }
+
+    // I/O thread, once per loop iteration, switches to a compacted log
+    void poll()
+    {
+        if(switch_.load(std::memory_order_acquire) != 1)
+            return;
+
+        // the records appended since the snapshot
+        const long long numCarried = tail_ - switchFrom_;
+        memcpy(nextMap_ + nextTail_, map_ + switchFrom_, numCarried);
+
+        const int fd = fd_;
+        char* const map = map_;
+        fd_ = nextFd_;
+        map_ = nextMap_;
+        nextFd_ = fd;
+        nextMap_ = map;
+
+        tail_ = nextTail_ + numCarried;
+        stats.durableBytes.store(nextTail_, std::memory_order_relaxed);
+        capacity_.store(nextCapacity_, std::memory_order_release);
+        published_.store(tail_, std::memory_order_release);
+        switch_.store(2, std::memory_order_release);
+    }
+
+    // the next sync compacts the log
+    void requestCompaction() {compactRequested_.store(true, std::memory_order_release);}
+
+    // bytes appended (in the current file) that are not durable yet
+    long long getUnsyncedBytes() const
+    {
+        return tail_ - stats.durableBytes.load(std::memory_order_relaxed);
+    }
+
+    long long getSize() const {return tail_;}
+
+private:
+    char path_[256];
+    char tmpPath_[260];
+    int fd_ = -1;
+    char* map_ = nullptr;
+    long long tail_ = 0; // I/O thread
+    std::atomic<long long> published_{0};
+    std::atomic<long long> capacity_{0};
+
+    // compaction, 1 - the next file is ready (writer -> I/O thread),
+    // 2 - switched, the previous file is in next* (I/O thread -> writer)
+    std::atomic<int> switch_{0};
+    int nextFd_ = -1;
+    char* nextMap_ = nullptr;
+    long long nextTail_ = 0;
+    long long nextCapacity_ = 0;
+    long long switchFrom_ = 0;
+    std::atomic<bool> compactRequested_{false};
+    bool renameFailed_ = false; // writer thread, the log stays in tmpPath_, no compactions
+
+    std::thread thread_;
+    std::atomic<bool> stop_{false};
+    std::atomic<bool> finished_{false};
+    JournalState writerState_;
+    double lastCompaction_ = 0.0;
+
+    static double getMonotonicSec()
+    {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+    }
+
+    long long getCapacity(long long size) const
+    {
+        const long long capacity = (size / growSize + 1) * growSize;
+        return capacity < mapSize ? capacity : mapSize;
+    }
+
+    // returns the end of the log
+    long long replay(long long pos, long long end, JournalState* state, long long& numApplied)
+    {
+        while(end - pos >= int(sizeof(JournalRecord)))
+        {
+            JournalRecord record;
+            memcpy(&record, map_ + pos, sizeof(record));
+
+            if(record.type <= JournalType::_end || record.type >= JournalType::_count ||
+               record.size < 0 || record.size > end - pos - int(sizeof(record)))
+                break;
+
+            const char* const payload = map_ + pos + sizeof(record);
+            const unsigned h = getJournalChecksum(2166136261u, &record.type, sizeof(int) * 2);
+
+            if(getJournalChecksum(h, payload, record.size) != record.checksum ||
+               !state->apply(record.type, payload, record.size))
+                break;
+
+            pos += getJournalRecordSize(record.size);
+            ++numApplied;
+        }
+
+        return pos < end ? pos : end;
+    }
+
+    void updateMax(std::atomic<long long>& max, long long value)
+    {
+        if(value > max.load(std::memory_order_relaxed))
+            max.store(value, std::memory_order_relaxed);
+    }
+
+    // writer thread
+    void run()
+    {
+        long long synced = published_.load(std::memory_order_acquire);
+        const long long pageSize = sysconf(_SC_PAGESIZE);
+
+        // the writer has its own copy of the state for the compaction, replayed here
+        // while the I/O thread starts
+        long long numReplayed = 0;
+        long long parsed = replay(sizeof(JournalHeader), synced, &writerState_, numReplayed);
+
+        while(true)
+        {
+            const bool stopping = stop_.load(std::memory_order_acquire);
+            const int sw = switch_.load(std::memory_order_acquire);
+
+            if(sw == 2)
+            {
+                finishSwitch();
+                synced = nextTail_;
+                parsed = nextTail_;
+            }
+            else if(sw == 1)
+            {
+                usleep(1000);
+                continue;
+            }
+
+            const long long end = published_.load(std::memory_order_acquire);
+
+            // ahead of the I/O thread, before the sync that might take a while
+            const long long capacity = capacity_.load(std::memory_order_relaxed);
+            if(capacity - end < growSize / 2 && capacity < mapSize)
+            {
+                const long long newCapacity = getCapacity(end + growSize / 2);
+
+                if(ftruncate(fd_, newCapacity) == -1)
+                    perror("ftruncate() (journal) failed");
+                else
+                    capacity_.store(newCapacity, std::memory_order_release);
+            }
+
+            // group commit
+            if(end > synced)
+            {
+                const double startTime = getMonotonicSec();
+                const long long from = synced & ~(pageSize - 1);
+
+                if(msync(map_ + from, end - from, MS_SYNC) == -1)
+                    perror("msync() (journal) failed");
+
+                const long long us = (getMonotonicSec() - startTime) * 1000000.0;
+                long long numSynced = 0;
+                parsed = replay(parsed, end, &writerState_, numSynced);
+
+                stats.syncs.fetch_add(1, std::memory_order_relaxed);
+                stats.syncedBytes.fetch_add(end - synced, std::memory_order_relaxed);
+                stats.syncedRecords.fetch_add(numSynced, std::memory_order_relaxed);
+                stats.syncSumUs.fetch_add(us, std::memory_order_relaxed);
+                updateMax(stats.syncMaxUs, us);
+                stats.durableBytes.store(end, std::memory_order_relaxed);
+                synced = end;
+            }
+
+            if(stopping)
+                break;
+
+            const double time = getMonotonicSec();
+            const bool requested = compactRequested_.exchange(false);
+
+            if(!renameFailed_ && (requested || (end >= compactMinSize &&
+                                                end > writerState_.getSnapshotSize() * 2 &&
+                                                time - lastCompaction_ >= compactIntervalSec)))
+            {
+                lastCompaction_ = time;
+                startCompaction(parsed);
+                continue;
+            }
+
+            usleep(syncIntervalMs * 1000);
+        }
+
+        finished_.store(true, std::memory_order_release);
+    }
+
+    // writer thread, the state up to from (in the current file) goes to a new file
+    void startCompaction(long long from)
+    {
+        const double startTime = getMonotonicSec();
+        Array<char> buf;
+        // no magic until the switch
+        JournalHeader header;
+        memset(header.magic, 0, sizeof(header.magic));
+        header.version = journalVersion;
+        addText(buf, &header, sizeof(header));
+        writerState_.writeSnapshot(buf, time(nullptr));
+
+        // room for the records appended until the switch and the next ones
+        const long long capacity = getCapacity(buf.size() + capacity_.load() - from +
+                                               growSize / 2);
+        const int fd = ::open(tmpPath_, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        bool ok = fd != -1;
+
+        for(long long pos = 0; ok && pos < buf.size();)
+        {
+            const int rc = write(fd, buf.data() + pos, buf.size() - pos);
+            ok = rc > 0 || (rc == -1 && errno == EINTR);
+            pos += rc > 0 ? rc : 0;
+        }
+
+        ok = ok && capacity >= buf.size() + capacity_.load() - from &&
+             ftruncate(fd, capacity) == 0 && fsync(fd) == 0;
+
+        char* const map = ok ? (char*)mmap(nullptr, mapSize, PROT_READ | PROT_WRITE,
+                                           MAP_SHARED, fd, 0) : (char*)MAP_FAILED;
+
+        if(map == MAP_FAILED)
+        {
+            perror("journal compaction failed");
+            if(fd != -1)
+                ::close(fd);
+
+            unlink(tmpPath_);
+            return;
+        }
+
+        nextFd_ = fd;
+        nextMap_ = map;
+        nextTail_ = buf.size();
+        nextCapacity_ = capacity;
+        switchFrom_ = from;
+        stats.compactedBytes.store(published_.load(), std::memory_order_relaxed);
+        updateMax(stats.compactMaxUs, (getMonotonicSec() - startTime) * 1000000.0);
+        switch_.store(1, std::memory_order_release);
+    }
+
+    // writer thread, the I/O thread uses the new file, the old one is replaced
+    void finishSwitch()
+    {
+        munmap(nextMap_, mapSize);
+        ::close(nextFd_);
+        nextMap_ = nullptr;
+        nextFd_ = -1;
+
+        // the new file has records only it has from now on, open() recovers it by the magic,
+        // a later compaction would truncate it if the rename fails
+        memcpy(map_, journalMagic, sizeof(journalMagic));
+
+        if(msync(map_, sizeof(JournalHeader), MS_SYNC) == -1 || rename(tmpPath_, path_) == -1)
+        {
+            perror("journal switch failed, compaction is disabled");
+            renameFailed_ = true;
+        }
+
+        // the rename is durable with the directory
+        char dir[256];
+        snprintf(dir, sizeof(dir), "%s", path_);
+        char* const slash = strrchr(dir, '/');
+        if(slash)
+            *(slash == dir ? slash + 1 : slash) = '\0';
+        else
+            snprintf(dir, sizeof(dir), ".");
+
+        const int dirfd = ::open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if(dirfd != -1)
+        {
+            fsync(dirfd);
+            ::close(dirfd);
+        }
+
+        stats.compactions.fetch_add(1, std::memory_order_relaxed);
+        switch_.store(0, std::memory_order_release);
+    }
+
+    static bool isSwitchedLog(const char* path)
+    {
+        const int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+        if(fd == -1)
+            return false;
+
+        JournalHeader header;
+        const bool ok = pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+                        memcmp(header.magic, journalMagic, 4) == 0 &&
+                        header.version == journalVersion;
+        ::close(fd);
+        return ok;
+    }
+
+    static void addText(Array<char>& out, const void* data, int size)
+    {
+        const int prevSize = out.size();
+        out.resize(prevSize + size);
+        memcpy(out.data() + prevSize, data, size);
+    }
+};
+
+// the record goes to the log and the state of the I/O thread
+
+inline void journalProfile(Journal& journal, JournalState& state, const char* name,
+                           const ProfileStats& stats)
+{
+    ProfileRecord record = {};
+    snprintf(record.name, sizeof(record.name), "%s", name);
+    record.stats = stats;
+    state.setStats(record.name, stats);
+    journal.add(JournalType::Profile, &record, sizeof(record));
+}
+
+inline void journalReservation(Journal& journal, JournalState& state, const char* name,
+                               unsigned long long token, long long until)
+{
+    ReservationRecord record = {};
+    snprintf(record.name, sizeof(record.name), "%s", name);
+    record.token = token;
+    record.until = until;
+    state.reserve(record.name, token, until);
+    journal.add(JournalType::Reservation, &record, sizeof(record));
+}
+
+// msgs - complete messages
+inline void journalChat(Journal& journal, JournalState& state, const char* room,
+                        const char* msgs, int size)
+{
+    ChatRecord record = {};
+    snprintf(record.room, sizeof(record.room), "%s", room);
+    state.addChat(record.room, msgs, size);
+    journal.add(JournalType::Chat, &record, sizeof(record), msgs, size);
+}
@@ -0,0 +1,294 @@
+#pragma once
+
+#include <string.h>
+#include <assert.h>
+#include "Array.hpp"
+
+// small LZ77 codec (LZ4-like sequences) with a preset dictionary
+// every block is compressed independently, matches can reach into the dictionary
+//
+// wire block: [payload size: u16][raw size: u16][payload]
+// payload size == raw size means the block is stored uncompressed
+//
+// sequence: [token: literal count (4 bits) | match length - 4 (4 bits)]
+//           [literal count ext bytes][literals][offset: u16][match length ext bytes]
+// the last sequence has only literals
+
+// bump when the dictionary or the format changes (negotiated with COMP)
+constexpr int lzVersion = 1;
+constexpr int lzMaxBlockSize = 16384;
+constexpr int lzBlockHeaderSize = 4;
+
+// trained on the chat traffic, most frequent strings are at the end
+// (closest to the data, smallest offsets)
+static const char lzDict[] =
+    "NAME \0"
+    "' has left\0"
+    "PING \0"
+    "PONG \0"
+    "CHAT I send a random message every 10s!\0"
+    "' has joined the game!\0"
+    "CHAT '\0"
+    "PING \0PONG \0"
+    ": I send a random message every 10s!\0"
+    "CHAT ";
+
+constexpr int lzDictSize = sizeof(lzDict) - 1;
+
+inline unsigned lzRead32(const char* p)
+{
+    unsigned v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline int lzHash(unsigned v)
+{
+    return (v * 2654435761u) >> (32 - 12);
+}
+
+inline void lzPutLength(Array<char>& dst, int len)
+{
+    while(len >= 255)
+    {
+        dst.pushBack(char(255));
+        len -= 255;
+    }
+    dst.pushBack(char(len));
+}
+
+class LzEncoder
+{
+public:
+    LzEncoder()
+    {
+        window_.reserve(lzDictSize + lzMaxBlockSize);
+        window_.resize(lzDictSize);
+        memcpy(window_.data(), lzDict, lzDictSize);
+
+        for(int& pos: dictTable_)
+            pos = -1;
+
+        for(int i = 0; i + 4 <= lzDictSize; ++i)
+            dictTable_[lzHash(lzRead32(lzDict + i))] = i;
+    }
+
+    // appends wire blocks to dst, returns the number of bytes appended
+    int encode(const char* src, int size, Array<char>& dst)
+    {
+        const int prevSize = dst.size();
+
+        while(size)
+        {
+            const int blockSize = size < lzMaxBlockSize ? size : lzMaxBlockSize;
+            encodeBlock(src, blockSize, dst);
+            src += blockSize;
+            size -= blockSize;
+        }
+
+        return dst.size() - prevSize;
+    }
+
+private:
+    Array<char> window_;
+    int table_[4096];
+    int dictTable_[4096];
+
+    void encodeBlock(const char* src, int size, Array<char>& dst)
+    {
+        const int headerPos = dst.size();
+        dst.resize(headerPos + lzBlockHeaderSize);
+
+        window_.resize(lzDictSize + size);
+        memcpy(window_.data() + lzDictSize, src, size);
+        memcpy(table_, dictTable_, sizeof(table_));
+
+        const char* const w = window_.data();
+        const int end = window_.size();
+        int anchor = lzDictSize;
+        int pos = lzDictSize;
+
+        while(pos + 4 <= end)
+        {
+            const unsigned seq = lzRead32(w + pos);
+            int& slot = table_[lzHash(seq)];
+            const int cand = slot;
+            slot = pos;
+
+            if(cand < 0 || pos - cand > 0xffff || lzRead32(w + cand) != seq)
+            {
+                ++pos;
+                continue;
+            }
+
+            int len = 4;
+            while(pos + len < end && w[cand + len] == w[pos + len])
+                ++len;
+
+            putSequence(dst, w + anchor, pos - anchor, pos - cand, len);
+            pos += len;
+            anchor = pos;
+        }
+
+        putSequence(dst, w + anchor, end - anchor, 0, 0);
+
+        int payloadSize = dst.size() - headerPos - lzBlockHeaderSize;
+
+        // incompressible, store
+        if(payloadSize >= size)
+        {
+            dst.resize(headerPos + lzBlockHeaderSize + size);
+            memcpy(dst.data() + headerPos + lzBlockHeaderSize, src, size);
+            payloadSize = size;
+        }
+
+        unsigned char* const header = (unsigned char*)dst.data() + headerPos;
+        header[0] = payloadSize & 0xff;
+        header[1] = payloadSize >> 8;
+        header[2] = size & 0xff;
+        header[3] = size >> 8;
+    }
+
+    // matchLen == 0 for the last sequence
+    static void putSequence(Array<char>& dst, const char* lit, int litLen, int offset,
+                            int matchLen)
+    {
+        const int litCode = litLen < 15 ? litLen : 15;
+        const int matchCode = matchLen ? (matchLen - 4 < 15 ? matchLen - 4 : 15) : 0;
+        dst.pushBack(char((litCode << 4) | matchCode));
+
+        if(litCode == 15)
+            lzPutLength(dst, litLen - 15);
+
+        const int prevSize = dst.size();
+        dst.resize(prevSize + litLen);
+        memcpy(dst.data() + prevSize, lit, litLen);
+
+        if(!matchLen)
+            return;
+
+        dst.pushBack(char(offset & 0xff));
+        dst.pushBack(char(offset >> 8));
+
+        if(matchCode == 15)
+            lzPutLength(dst, matchLen - 4 - 15);
+    }
+};
+
+class LzDecoder
+{
+public:
+    LzDecoder()
+    {
+        window_.reserve(lzDictSize + lzMaxBlockSize);
+    }
+
+    // decodes all complete blocks from src and appends the raw data to dst
+    // returns the number of consumed bytes, -1 if the data is corrupted
+    int decode(const char* src, int size, Array<char>& dst)
+    {
+        int consumed = 0;
+
+        while(size - consumed >= lzBlockHeaderSize)
+        {
+            const unsigned char* const header = (const unsigned char*)src + consumed;
+            const int payloadSize = header[0] | (header[1] << 8);
+            const int rawSize = header[2] | (header[3] << 8);
+
+            if(rawSize > lzMaxBlockSize || payloadSize > rawSize)
+                return -1;
+
+            if(size - consumed - lzBlockHeaderSize < payloadSize)
+                break;
+
+            const char* const payload = src + consumed + lzBlockHeaderSize;
+            const int prevSize = dst.size();
+
+            if(payloadSize == rawSize)
+            {
+                dst.resize(prevSize + rawSize);
+                memcpy(dst.data() + prevSize, payload, rawSize);
+            }
+            else
+            {
+                if(!decodeBlock(payload, payloadSize) || window_.size() - lzDictSize != rawSize)
+                    return -1;
+
+                dst.resize(prevSize + rawSize);
+                memcpy(dst.data() + prevSize, window_.data() + lzDictSize, rawSize);
+            }
+
+            consumed += lzBlockHeaderSize + payloadSize;
+        }
+
+        return consumed;
+    }
+
+private:
+    Array<char> window_;
+
+    static bool getLength(const unsigned char*& ip, const unsigned char* end, int& len)
+    {
+        while(true)
+        {
+            if(ip == end)
+                return false;
+
+            const int v = *ip++;
+            len += v;
+
+            if(v != 255)
+                return true;
+        }
+    }
+
+    bool decodeBlock(const char* src, int size)
+    {
+        window_.resize(lzDictSize);
+        memcpy(window_.data(), lzDict, lzDictSize);
+
+        const unsigned char* ip = (const unsigned char*)src;
+        const unsigned char* const end = ip + size;
+
+        while(ip < end)
+        {
+            const int token = *ip++;
+            int litLen = token >> 4;
+
+            if(litLen == 15 && !getLength(ip, end, litLen))
+                return false;
+
+            if(end - ip < litLen || window_.size() + litLen > lzDictSize + lzMaxBlockSize)
+                return false;
+
+            const int prevSize = window_.size();
+            window_.resize(prevSize + litLen);
+            memcpy(window_.data() + prevSize, ip, litLen);
+            ip += litLen;
+
+            if(ip == end)
+                break;
+
+            if(end - ip < 2)
+                return false;
+
+            const int offset = ip[0] | (ip[1] << 8);
+            ip += 2;
+            int matchLen = (token & 15) + 4;
+
+            if((token & 15) == 15 && !getLength(ip, end, matchLen))
+                return false;
+
+            if(offset == 0 || offset > window_.size() ||
+               window_.size() + matchLen > lzDictSize + lzMaxBlockSize)
+                return false;
+
+            // byte by byte, the match can overlap with itself
+            int from = window_.size() - offset;
+            for(int i = 0; i < matchLen; ++i)
+                window_.pushBack(window_[from++]);
+        }
+
+        return true;
+    }
+};
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/uio.h>
+
+// fixed capacity ring of '\0' terminated messages (pre-framed, ready to send),
+// the oldest messages are evicted, the content is at most two contiguous spans
+class MsgRing
+{
+public:
+    MsgRing() = default;
+    ~MsgRing() {free(data_);}
+    MsgRing(const MsgRing&) = delete;
+    MsgRing& operator=(const MsgRing&) = delete;
+
+    void init(int capacity)
+    {
+        free(data_);
+        data_ = (char*)malloc(capacity);
+        assert(data_);
+        capacity_ = capacity;
+        clear();
+    }
+
+    void clear()
+    {
+        begin_ = 0;
+        size_ = 0;
+        numMsgs_ = 0;
+    }
+
+    // msgs - one or more complete messages
+    void push(const char* msgs, int size)
+    {
+        if(!capacity_)
+            return;
+
+        // only the newest messages fit
+        while(size > capacity_)
+        {
+            const int len = strlen(msgs) + 1;
+            msgs += len;
+            size -= len;
+        }
+
+        while(size_ + size > capacity_)
+            popFront();
+
+        int numMsgs = 0;
+        for(int i = 0; i < size; ++i)
+            numMsgs += msgs[i] == '\0';
+
+        const int end = (begin_ + size_) % capacity_;
+        const int numFirst = size < capacity_ - end ? size : capacity_ - end;
+        memcpy(data_ + end, msgs, numFirst);
+        memcpy(data_, msgs + numFirst, size - numFirst);
+        size_ += size;
+        numMsgs_ += numMsgs;
+    }
+
+    // returns the number of spans (0 - 2), oldest messages first
+    int getSpans(iovec* iov) const
+    {
+        if(!size_)
+            return 0;
+
+        const int numFirst = size_ < capacity_ - begin_ ? size_ : capacity_ - begin_;
+        iov[0] = {data_ + begin_, size_t(numFirst)};
+
+        if(numFirst == size_)
+            return 1;
+
+        iov[1] = {data_, size_t(size_ - numFirst)};
+        return 2;
+    }
+
+    int size()     const {return size_;}
+    int numMsgs()  const {return numMsgs_;}
+    int capacity() const {return capacity_;}
+
+private:
+    char* data_ = nullptr;
+    int capacity_ = 0;
+    int begin_ = 0;
+    int size_ = 0;
+    int numMsgs_ = 0;
+
+    void popFront()
+    {
+        int len = 0;
+        while(data_[(begin_ + len) % capacity_] != '\0')
+            ++len;
+
+        ++len;
+        begin_ = (begin_ + len) % capacity_;
+        size_ -= len;
+        --numMsgs_;
+    }
+};
@@ -0,0 +1,219 @@
+#pragma once
+
+#include <stdlib.h>
+#include <string.h>
+#include "Array.hpp"
+#include "Protocol.hpp"
+
+// UDP framing shared by the client and the server
+// the messages queued for a peer during one iteration go out in as few datagrams of
+// at most maxDatagramSize bytes as possible, a datagram holds only whole messages
+// a message larger than a datagram is split into FRAG messages, one per datagram:
+// "FRAG <id> <index> <count> <bytes of the message without '\0'>"
+// the receiver puts it back together, a lost fragment loses the message
+
+constexpr int maxFragHeaderSize = 32; // "FRAG 4294967295 15 16 " + '\0' fits
+constexpr int fragDataSize = maxDatagramSize - maxFragHeaderSize;
+constexpr int maxFragments = 16;
+constexpr int maxUdpMsgSize = maxFragments * fragDataSize;
+
+// IPv4 + UDP headers, for the per message cost
+constexpr int udpHeaderSize = 28;
+
+class Packetizer
+{
+public:
+    // msgs - '\0' terminated messages, the datagrams are valid until the next pack()
+    void pack(const char* msgs, int size)
+    {
+        buf_.clear();
+        ends_.clear();
+        int begin = 0; // of the current datagram
+
+        for(int pos = 0; pos < size;)
+        {
+            const char* const msg = msgs + pos;
+            const int len = strlen(msg) + 1;
+            pos += len;
+
+            if(len <= maxDatagramSize)
+            {
+                if(buf_.size() - begin + len > maxDatagramSize)
+                {
+                    ends_.pushBack(buf_.size());
+                    begin = buf_.size();
+                }
+
+                const int prevSize = buf_.size();
+                buf_.resize(prevSize + len);
+                memcpy(buf_.data() + prevSize, msg, len);
+                numMsgs += 1;
+                continue;
+            }
+
+            const int count = (len - 1 + fragDataSize - 1) / fragDataSize;
+            if(count > maxFragments)
+            {
+                numDropped += 1;
+                continue;
+            }
+
+            if(buf_.size() > begin)
+                ends_.pushBack(buf_.size());
+
+            for(int f = 0; f < count; ++f)
+            {
+                const int offset = f * fragDataSize;
+                const int fragSize = len - 1 - offset < fragDataSize ? len - 1 - offset :
+                                                                         fragDataSize;
+
+                addMsg(buf_, Cmd::Frag, IntField{nextId_}, lit(" "), IntField{f}, lit(" "),
+                       IntField{count}, lit(" "), StrField{msg + offset, fragSize});
+                ends_.pushBack(buf_.size());
+            }
+
+            begin = buf_.size();
+            numMsgs += 1;
+            numFrags += count;
+
+            if(++nextId_ == 0)
+                nextId_ = 1;
+        }
+
+        if(buf_.size() > begin)
+            ends_.pushBack(buf_.size());
+    }
+
+    int getNumDatagrams() const {return ends_.size();}
+
+    const char* getDatagram(int i, int& size) const
+    {
+        const int begin = i ? ends_[i - 1] : 0;
+        size = ends_[i] - begin;
+        return buf_.data() + begin;
+    }
+
+    // since the start
+    long long numMsgs = 0;
+    long long numFrags = 0;
+    long long numDropped = 0; // larger than maxUdpMsgSize
+
+private:
+    Array<char> buf_;
+    Array<int> ends_;
+    unsigned nextId_ = 1;
+};
+
+// the fragments of the latest fragmented message of a peer (a fragment of a newer one
+// drops it)
+class FragAssembler
+{
+public:
+    enum Result
+    {
+        Pending,
+        Complete,
+        Invalid
+    };
+
+    void clear() {state_.id = 0;}
+
+    void swap(FragAssembler& other)
+    {
+        const State state = state_;
+        state_ = other.state_;
+        other.state_ = state;
+        data_.swap(other.data_);
+    }
+
+    // payload - of a FRAG message, the reassembled message is appended to out
+    Result add(const char* payload, Array<char>& out)
+    {
+        char* end;
+        const unsigned long long id = strtoull(payload, &end, 10);
+        const long index = strtol(end, &end, 10);
+        const long count = strtol(end, &end, 10);
+
+        if(id == 0 || *end != ' ' || count < 2 || count > maxFragments || index < 0 ||
+           index >= count)
+            return Invalid;
+
+        const char* const data = end + 1;
+        const int size = strlen(data);
+
+        if(size == 0 || size > fragDataSize || (index < count - 1 && size != fragDataSize))
+            return Invalid;
+
+        if(id != state_.id)
+        {
+            state_.id = id;
+            state_.count = count;
+            state_.received = 0;
+            data_.resize(count * fragDataSize);
+        }
+        else if(count != state_.count)
+            return Invalid;
+
+        memcpy(data_.data() + index * fragDataSize, data, size);
+        state_.received |= 1u << index;
+
+        if(index == count - 1)
+            state_.lastSize = size;
+
+        if(state_.received != (1u << count) - 1)
+            return Pending;
+
+        const int msgSize = (count - 1) * fragDataSize + state_.lastSize;
+        const int prevSize = out.size();
+        out.resize(prevSize + msgSize + 1);
+        memcpy(out.data() + prevSize, data_.data(), msgSize);
+        out.back() = '\0';
+        state_.id = 0;
+        return Complete;
+    }
+
+private:
+    struct State
+    {
+        unsigned long long id = 0; // 0 - none
+        int count = 0;
+        unsigned received = 0;     // fragment bit mask
+        int lastSize = 0;
+    };
+
+    State state_;
+    Array<char> data_;
+};
+
+struct FragStats
+{
+    long long frags = 0;
+    long long reassembled = 0;
+    long long invalid = 0;
+};
+
+// appends the messages of a received datagram (ends with '\0') to buf, a FRAG message
+// is replaced by the message it completes
+inline void addDatagramMsgs(const char* datagram, int size, FragAssembler& assembler,
+                            Array<char>& buf, FragStats& stats)
+{
+    for(int pos = 0; pos < size;)
+    {
+        const char* const msg = datagram + pos;
+        const int len = strlen(msg) + 1;
+        pos += len;
+
+        if(strncmp(msg, "FRAG ", msgHeaderSize) == 0)
+        {
+            stats.frags += 1;
+            const FragAssembler::Result result = assembler.add(msg + msgHeaderSize, buf);
+            stats.reassembled += result == FragAssembler::Complete;
+            stats.invalid += result == FragAssembler::Invalid;
+            continue;
+        }
+
+        const int prevSize = buf.size();
+        buf.resize(prevSize + len);
+        memcpy(buf.data() + prevSize, msg, len);
+    }
+}
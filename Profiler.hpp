@@ -0,0 +1,205 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include "Array.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define PROFILER_RDTSC
+#endif
+
+// ring of the latest timed spans of one thread, exported in the Chrome trace event
+// format (chrome://tracing, ui.perfetto.dev)
+// the timestamps are TSC ticks on x86 (calibrated against CLOCK_MONOTONIC in init()),
+// CLOCK_MONOTONIC nanoseconds elsewhere
+//
+// PROFILE_SCOPE(profiler, name) - span until the end of the block
+// PROFILE_PHASE(profiler, name) - span until the next PROFILE_PHASE() or
+//                                 PROFILE_END_PHASE(), for the steps of a loop
+// name must outlive the profiler (string literals)
+// compile with -DNO_PROFILER to remove the instrumentation, the profiler stays empty
+
+struct ProfSpan
+{
+    const char* name;
+    unsigned long long begin;
+    unsigned long long end;
+};
+
+inline unsigned long long getMonotonicNs()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+class Profiler
+{
+public:
+    Profiler() = default;
+    ~Profiler() {free(spans_);}
+    Profiler(const Profiler&) = delete;
+    Profiler& operator=(const Profiler&) = delete;
+
+    // capacity in spans, 0 - disabled
+    void init(int capacity)
+    {
+        free(spans_);
+        spans_ = nullptr;
+        capacity_ = 0;
+        numSpans_ = 0;
+        phaseName_ = nullptr;
+
+#ifndef NO_PROFILER
+        if(capacity <= 0)
+            return;
+
+        spans_ = (ProfSpan*)malloc(sizeof(ProfSpan) * capacity);
+        assert(spans_);
+        capacity_ = capacity;
+
+        // 10 ms is enough for a few ppm
+        baseNs_ = getMonotonicNs();
+        baseTicks_ = now();
+        while(getMonotonicNs() - baseNs_ < 10000000ULL)
+            ;
+
+        nsPerTick_ = double(getMonotonicNs() - baseNs_) / (now() - baseTicks_);
+#else
+        (void)capacity;
+#endif
+    }
+
+    bool isEnabled() const {return capacity_ != 0;}
+
+    unsigned long long now() const
+    {
+#ifdef PROFILER_RDTSC
+        return __rdtsc();
+#else
+        return getMonotonicNs();
+#endif
+    }
+
+    void add(const char* name, unsigned long long begin, unsigned long long end)
+    {
+        if(!capacity_)
+            return;
+
+        ProfSpan& span = spans_[numSpans_ % capacity_];
+        span.name = name;
+        span.begin = begin;
+        span.end = end;
+        ++numSpans_;
+    }
+
+    void phase(const char* name)
+    {
+        if(!capacity_)
+            return;
+
+        const unsigned long long t = now();
+        if(phaseName_)
+            add(phaseName_, phaseBegin_, t);
+
+        phaseName_ = name;
+        phaseBegin_ = t;
+    }
+
+    void endPhase()
+    {
+        if(phaseName_)
+            add(phaseName_, phaseBegin_, now());
+
+        phaseName_ = nullptr;
+    }
+
+    // spans added since init(), the ring keeps the last capacity of them
+    long long getNumSpans() const {return numSpans_;}
+
+    // the spans in the ring as a JSON object, complete events ("ph":"X") sorted by the
+    // end time, a trace viewer nests them by the timestamps
+    void writeTrace(Array<char>& out, int pid) const
+    {
+        addText(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+
+        const long long first = numSpans_ > capacity_ ? numSpans_ - capacity_ : 0;
+
+        for(long long s = first; s < numSpans_; ++s)
+        {
+            const ProfSpan& span = spans_[s % capacity_];
+            char event[256];
+            snprintf(event, sizeof(event),
+                     "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                     "\"pid\":%d,\"tid\":1}", s == first ? "" : ",", span.name,
+                     getUs(span.begin), getUs(span.end) - getUs(span.begin), pid);
+            addText(out, event);
+        }
+
+        addText(out, "\n]}\n");
+    }
+
+private:
+    ProfSpan* spans_ = nullptr;
+    int capacity_ = 0;
+    long long numSpans_ = 0;
+    const char* phaseName_ = nullptr;
+    unsigned long long phaseBegin_ = 0;
+
+    // ticks -> CLOCK_MONOTONIC
+    unsigned long long baseNs_ = 0;
+    unsigned long long baseTicks_ = 0;
+    double nsPerTick_ = 1.0;
+
+    double getUs(unsigned long long ticks) const
+    {
+#ifdef PROFILER_RDTSC
+        return (baseNs_ + (long long)(ticks - baseTicks_) * nsPerTick_) / 1000.0;
+#else
+        return ticks / 1000.0;
+#endif
+    }
+
+    static void addText(Array<char>& out, const char* text)
+    {
+        const int len = strlen(text);
+        const int prevSize = out.size();
+        out.resize(prevSize + len);
+        memcpy(out.data() + prevSize, text, len);
+    }
+};
+
+class ProfileScope
+{
+public:
+    ProfileScope(Profiler& profiler, const char* name):
+        profiler_(profiler), name_(name), begin_(profiler.now()) {}
+
+    ~ProfileScope() {profiler_.add(name_, begin_, profiler_.now());}
+
+    ProfileScope(const ProfileScope&) = delete;
+    ProfileScope& operator=(const ProfileScope&) = delete;
+
+private:
+    Profiler& profiler_;
+    const char* name_;
+    unsigned long long begin_;
+};
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+
+#ifndef NO_PROFILER
+#define PROFILE_SCOPE(profiler, name) \
+    ProfileScope PROFILE_CONCAT(profileScope, __LINE__)(profiler, name)
+#define PROFILE_PHASE(profiler, name) (profiler).phase(name)
+#define PROFILE_END_PHASE(profiler) (profiler).endPhase()
+#else
+#define PROFILE_SCOPE(profiler, name) ((void)0)
+#define PROFILE_PHASE(profiler, name) ((void)0)
+#define PROFILE_END_PHASE(profiler) ((void)0)
+#endif
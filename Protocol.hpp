@@ -0,0 +1,326 @@
+#pragma once
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "Array.hpp"
+#include "FrameIndex.hpp"
+
+// protocol shared by the client and the server
+// message: "CMD payload\0", every command has cmdSize characters
+
+constexpr int cmdSize = 4;
+constexpr int msgHeaderSize = cmdSize + 1; // ' '
+
+struct Cmd
+{
+    enum
+    {
+        _nil, // unknown command
+        Ping,
+        Pong,
+        Name,
+        Chat,
+        Comp,
+        Token,
+        Resume,
+        Ack,
+        Room,
+        Bind,
+        Pass,
+        Busy,
+        Frag,
+        Tile,
+        View,
+        Chunk,
+        TileDiff,
+        _count
+    };
+};
+
+constexpr char cmdStrs[][cmdSize + 1] =
+{
+    "",
+    "PING",
+    "PONG",
+    "NAME",
+    "CHAT",
+    "COMP",
+    "TOKN",
+    "RESM",
+    "ACKN",
+    "ROOM",
+    "BIND",
+    "PASS",
+    "BUSY",
+    "FRAG",
+    "TILE",
+    "VIEW",
+    "CHNK",
+    "TDIF"
+};
+
+static_assert(sizeof(cmdStrs) / sizeof(cmdStrs[0]) == Cmd::_count, "cmdStrs is out of date");
+
+constexpr const char* getCmdStr(int cmd) {return cmdStrs[cmd];}
+
+// UDP carries the latency sensitive, loss tolerant commands of a player bound with
+// "BIND <session token>", a datagram is one or more complete messages or one FRAG
+// of a larger message (Packetizer.hpp), the server listens on the same port number
+constexpr int maxDatagramSize = 1200;
+
+constexpr bool isUdpCmd(int cmd)
+{
+    return cmd == Cmd::Ping || cmd == Cmd::Pong || cmd == Cmd::Bind;
+}
+
+// reconnect policy of the clients: exponential backoff with full jitter, the delay is
+// uniform in [0, min(cap, base * 2^attempt)] so the players of a restarted server don't
+// come back in waves
+// a server over its admission rate answers "BUSY <retry after ms>" and closes the
+// connection, the hint replaces the backoff (plus the jitter of the first attempt)
+constexpr float reconnectBaseSec = 0.5f;
+constexpr float reconnectCapSec = 30.f;
+
+// random - uniform in [0, 1)
+inline float getReconnectDelaySec(int attempt, float random)
+{
+    float maxSec = reconnectBaseSec;
+    for(int i = 0; i < attempt && maxSec < reconnectCapSec; ++i)
+        maxSec *= 2.f;
+
+    return (maxSec < reconnectCapSec ? maxSec : reconnectCapSec) * random;
+}
+
+// payload fields
+// the message size is summed from the fields before anything is written, so every
+// message is one resize() and a few memcpy()s, for literals and fixed size fields
+// the size is a compile-time constant
+
+struct StrField
+{
+    const char* data;
+    int size;
+};
+
+struct IntField
+{
+    long long value;
+};
+
+// 16 lowercase hex digits
+struct HexField
+{
+    unsigned long long value;
+};
+
+template<int N>
+constexpr StrField lit(const char (&str)[N]) {return {str, N - 1};}
+
+inline StrField str(const char* s) {return {s, int(strlen(s))};}
+
+// at most maxSize characters
+inline StrField str(const char* s, int maxSize)
+{
+    const int size = strlen(s);
+    return {s, size < maxSize ? size : maxSize};
+}
+
+constexpr int getFieldSize(const StrField& f) {return f.size;}
+constexpr int getFieldSize(const HexField&) {return 16;}
+
+inline int getFieldSize(const IntField& f)
+{
+    unsigned long long v = f.value < 0 ? -(unsigned long long)f.value : f.value;
+    int size = f.value < 0 ? 2 : 1;
+
+    while(v >= 10)
+    {
+        v /= 10;
+        ++size;
+    }
+
+    return size;
+}
+
+inline void writeField(char*& it, const StrField& f)
+{
+    memcpy(it, f.data, f.size);
+    it += f.size;
+}
+
+inline void writeField(char*& it, const IntField& f)
+{
+    const int size = getFieldSize(f);
+    unsigned long long v = f.value < 0 ? -(unsigned long long)f.value : f.value;
+
+    if(f.value < 0)
+        it[0] = '-';
+
+    for(int i = size - 1; i >= (f.value < 0); --i)
+    {
+        it[i] = '0' + v % 10;
+        v /= 10;
+    }
+
+    it += size;
+}
+
+inline void writeField(char*& it, const HexField& f)
+{
+    for(int i = 0; i < 16; ++i)
+        it[i] = "0123456789abcdef"[(f.value >> (60 - i * 4)) & 15];
+
+    it += 16;
+}
+
+constexpr int getFieldsSize() {return 0;}
+
+template<typename T, typename... Ts>
+int getFieldsSize(const T& field, const Ts&... fields)
+{
+    return getFieldSize(field) + getFieldsSize(fields...);
+}
+
+inline void writeFields(char*&) {}
+
+template<typename T, typename... Ts>
+void writeFields(char*& it, const T& field, const Ts&... fields)
+{
+    writeField(it, field);
+    writeFields(it, fields...);
+}
+
+// e.g. addMsg(buf, Cmd::Chat, str(name), lit(": "), str(text))
+template<typename... Fields>
+void addMsg(Array<char>& buffer, int cmd, const Fields&... fields)
+{
+    const int size = msgHeaderSize + getFieldsSize(fields...) + 1; // '\0'
+    const int prevSize = buffer.size();
+    buffer.resize(prevSize + size);
+
+    char* it = buffer.data() + prevSize;
+    memcpy(it, cmdStrs[cmd], cmdSize);
+    it[cmdSize] = ' ';
+    it += msgHeaderSize;
+    writeFields(it, fields...);
+    *it = '\0';
+}
+
+// points into the receive buffer, valid until the buffer changes
+struct MsgView
+{
+    int cmd;             // Cmd::_nil if unknown (payload is then the whole message)
+    const char* payload; // '\0' terminated
+    int payloadSize;
+};
+
+inline MsgView parseMsg(const char* data, const Frame& frame)
+{
+    const char* const begin = data + frame.offset;
+    MsgView msg = {Cmd::_nil, begin, frame.size};
+
+    if(frame.size < cmdSize || (frame.size > cmdSize && begin[cmdSize] != ' '))
+        return msg;
+
+    for(int c = 1; c < Cmd::_count; ++c)
+    {
+        // a 32-bit compare
+        if(memcmp(begin, cmdStrs[c], cmdSize) == 0)
+        {
+            const int headerSize = frame.size > cmdSize ? msgHeaderSize : cmdSize;
+            msg.cmd = c;
+            msg.payload = begin + headerSize;
+            msg.payloadSize = frame.size - headerSize;
+            break;
+        }
+    }
+
+    return msg;
+}
+
+// returns the number of parsed integers (space separated), at most count
+inline int readInts(const char* payload, long long* values, int count)
+{
+    int numRead = 0;
+
+    while(numRead < count)
+    {
+        char* end;
+        const long long value = strtoll(payload, &end, 10);
+
+        if(end == payload)
+            break;
+
+        values[numRead++] = value;
+        payload = end;
+    }
+
+    return numRead;
+}
+
+// link estimates from the PING / PONG timestamps (NTP-style)
+// PING t0, PONG t0 t1 t2 - t0: PING sent, t1: PING received, t2: PONG sent
+// (wall clock microseconds of the side that wrote them)
+
+inline long long getWallTimeUs()
+{
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+struct LinkStats
+{
+    float rttUs = 0.f;    // smoothed
+    float rttVarUs = 0.f; // smoothed deviation of rtt (jitter)
+    float offsetUs = 0.f; // peer clock - our clock, smoothed
+    int numSamples = 0;
+};
+
+// t1 - when the PING was received
+inline void addPongMsg(Array<char>& buffer, const MsgView& ping, long long t1)
+{
+    long long t0;
+    if(readInts(ping.payload, &t0, 1) != 1)
+    {
+        addMsg(buffer, Cmd::Pong);
+        return;
+    }
+
+    addMsg(buffer, Cmd::Pong, IntField{t0}, lit(" "), IntField{t1}, lit(" "),
+           IntField{getWallTimeUs()});
+}
+
+// t3 - when the PONG was received, returns false if the PONG has no timestamps
+inline bool addLinkSample(LinkStats& link, const MsgView& pong, long long t3)
+{
+    long long t[3];
+    if(readInts(pong.payload, t, 3) != 3)
+        return false;
+
+    // the time the peer held the PING doesn't count
+    const float rtt = (t3 - t[0]) - (t[2] - t[1]);
+    const float offset = ((t[1] - t[0]) + (t[2] - t3)) / 2.f;
+
+    if(rtt < 0.f)
+        return false;
+
+    // RFC 6298 gains
+    if(link.numSamples == 0)
+    {
+        link.rttUs = rtt;
+        link.rttVarUs = rtt / 2.f;
+        link.offsetUs = offset;
+    }
+    else
+    {
+        const float dev = rtt > link.rttUs ? rtt - link.rttUs : link.rttUs - rtt;
+        link.rttVarUs += (dev - link.rttVarUs) / 4.f;
+        link.rttUs += (rtt - link.rttUs) / 8.f;
+        link.offsetUs += (offset - link.offsetUs) / 8.f;
+    }
+
+    ++link.numSamples;
+    return true;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <atomic>
+
+// lock-free single producer single consumer ring of trivially copyable items
+// items are pushed and popped in batches, one atomic store publishes the whole batch
+template<typename T>
+class SpscQueue
+{
+public:
+    SpscQueue() = default;
+    ~SpscQueue() {free(data_);}
+    SpscQueue(const SpscQueue&) = delete;
+    SpscQueue& operator=(const SpscQueue&) = delete;
+
+    // capacity is rounded up to a power of 2, call before the threads start
+    void init(int capacity)
+    {
+        int size = 1;
+        while(size < capacity)
+            size *= 2;
+
+        free(data_);
+        data_ = (T*)malloc(sizeof(T) * size);
+        assert(data_);
+        mask_ = size - 1;
+        head_.store(0);
+        tail_.store(0);
+    }
+
+    // producer, returns the number of pushed items (the queue can be full)
+    int push(const T* items, int count)
+    {
+        const unsigned tail = tail_.load(std::memory_order_relaxed);
+        const unsigned head = head_.load(std::memory_order_acquire);
+        const int numFree = mask_ + 1 - int(tail - head);
+
+        if(count > numFree)
+            count = numFree;
+
+        for(int i = 0; i < count; ++i)
+            memcpy(&data_[(tail + i) & mask_], &items[i], sizeof(T));
+
+        tail_.store(tail + count, std::memory_order_release);
+        return count;
+    }
+
+    // consumer, returns the number of popped items
+    int pop(T* items, int maxCount)
+    {
+        const unsigned head = head_.load(std::memory_order_relaxed);
+        const unsigned tail = tail_.load(std::memory_order_acquire);
+        int count = int(tail - head);
+
+        if(count > maxCount)
+            count = maxCount;
+
+        for(int i = 0; i < count; ++i)
+            memcpy(&items[i], &data_[(head + i) & mask_], sizeof(T));
+
+        head_.store(head + count, std::memory_order_release);
+        return count;
+    }
+
+private:
+    T* data_ = nullptr;
+    int mask_ = 0;
+    // on separate cache lines, the producer writes tail_ and the consumer head_
+    alignas(64) std::atomic<unsigned> head_{0};
+    alignas(64) std::atomic<unsigned> tail_{0};
+};
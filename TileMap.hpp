@@ -0,0 +1,254 @@
+#pragma once
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "Array.hpp"
+#include "Protocol.hpp"
+
+// the world, a map of tiles in chunks of chunkSize x chunkSize
+// the tiles of a chunk are contiguous (row-major) and the chunks are in row-major order,
+// a tile is one multiply and a few shifts away and serializing a chunk reads 1 KB in
+// one pass instead of chunkSize rows scattered over a flat map
+//
+// the edits of a tick are applied as a batch, a changed tile sets its bit in the dirty
+// bitmap of its chunk, then every dirty chunk is serialized once (for all the players
+// that see it) with the next version of the chunk
+//
+// wire format, a tile type goes as one character: '0' + type
+// "CHNK <cx> <cy> <version> <chunkArea tiles>"
+// "TDIF <cx> <cy> <version> <'0' + y><'0' + x><tile>..." - the changed tiles, applies to
+//                                                          version - 1
+// a player gets the CHNKs of the chunks that come into its view after "VIEW <x> <y>"
+// (tile coordinates, the chunks within the view radius of the one with the tile)
+// and the updates of the chunks in its view, "VIEW" of the same position sends all of them
+// again (after a version gap)
+
+constexpr int chunkShift = 5;
+constexpr int chunkSize = 1 << chunkShift;
+constexpr int chunkArea = chunkSize * chunkSize;
+constexpr int chunkDirtyWords = chunkArea / 64;
+constexpr int maxTileType = 63;
+constexpr int tileDiffEntrySize = 3;
+
+// "CHNK 2147483647 2147483647 4294967295 " + tiles + '\0'
+constexpr int maxChunkMsgSize = msgHeaderSize + 33 + chunkArea + 1;
+
+struct TileType
+{
+    enum
+    {
+        Air,
+        Rock
+    };
+};
+
+struct TileEdit
+{
+    int x;
+    int y;
+    int tile;
+};
+
+class TileMap
+{
+public:
+    // a random cave, versions start at 1
+    void init(int widthChunks, int heightChunks, unsigned seed)
+    {
+        widthChunks_ = widthChunks;
+        heightChunks_ = heightChunks;
+        const int numChunks = widthChunks * heightChunks;
+
+        tiles_.resize(numChunks * chunkArea);
+        dirtyBits_.resize(numChunks * chunkDirtyWords);
+        memset(dirtyBits_.data(), 0, dirtyBits_.size() * sizeof(dirtyBits_[0]));
+        numDirty_.resize(numChunks);
+        memset(numDirty_.data(), 0, numDirty_.size() * sizeof(numDirty_[0]));
+        versions_.resize(numChunks);
+        dirtyChunks_.clear();
+
+        for(int c = 0; c < numChunks; ++c)
+        {
+            versions_[c] = 1;
+            const int x0 = c % widthChunks * chunkSize;
+            const int y0 = c / widthChunks * chunkSize;
+            unsigned char* const tiles = tiles_.data() + c * chunkArea;
+
+            for(int t = 0; t < chunkArea; ++t)
+            {
+                unsigned h = (x0 + (t & (chunkSize - 1))) * 0x8da6b343u ^
+                             (y0 + (t >> chunkShift)) * 0xd8163841u ^ seed * 0xcb1ab31fu;
+                h ^= h >> 13;
+                h *= 0x5bd1e995u;
+                h ^= h >> 15;
+                tiles[t] = h % 100 < 45 ? TileType::Rock : TileType::Air;
+            }
+        }
+    }
+
+    int getWidthChunks() const {return widthChunks_;}
+    int getHeightChunks() const {return heightChunks_;}
+    int getNumChunks() const {return widthChunks_ * heightChunks_;}
+
+    bool contains(int x, int y) const
+    {
+        return x >= 0 && y >= 0 && x < widthChunks_ * chunkSize && y < heightChunks_ * chunkSize;
+    }
+
+    int getChunk(int x, int y) const
+    {
+        return (y >> chunkShift) * widthChunks_ + (x >> chunkShift);
+    }
+
+    static int getTileOffset(int x, int y)
+    {
+        return (y & (chunkSize - 1)) << chunkShift | (x & (chunkSize - 1));
+    }
+
+    int get(int x, int y) const {return tiles_[getChunk(x, y) * chunkArea + getTileOffset(x, y)];}
+
+    const unsigned char* getChunkTiles(int chunk) const {return tiles_.data() + chunk * chunkArea;}
+    unsigned getVersion(int chunk) const {return versions_[chunk];}
+
+    // all the chunks, for the hot upgrade (the map must not be dirty)
+    unsigned char* getTiles() {return tiles_.data();}
+    unsigned* getVersions() {return versions_.data();}
+
+    // returns false if out of the map
+    bool set(int x, int y, int tile)
+    {
+        if(!contains(x, y) || tile < 0 || tile > maxTileType)
+            return false;
+
+        const int chunk = getChunk(x, y);
+        const int offset = getTileOffset(x, y);
+        unsigned char& t = tiles_[chunk * chunkArea + offset];
+
+        if(t == tile)
+            return true;
+
+        t = tile;
+        unsigned long long& word = dirtyBits_[chunk * chunkDirtyWords + offset / 64];
+        const unsigned long long bit = 1ull << (offset % 64);
+
+        if(word & bit)
+            return true;
+
+        word |= bit;
+
+        if(numDirty_[chunk]++ == 0)
+            dirtyChunks_.pushBack(chunk);
+
+        return true;
+    }
+
+    // returns the number of the edits out of the map
+    int apply(const TileEdit* edits, int numEdits)
+    {
+        int numInvalid = 0;
+        for(int i = 0; i < numEdits; ++i)
+            numInvalid += !set(edits[i].x, edits[i].y, edits[i].tile);
+
+        return numInvalid;
+    }
+
+    // chunks with changes since the last clearDirty(), in the order of the first change
+    int getNumDirtyChunks() const {return dirtyChunks_.size();}
+    int getDirtyChunk(int i) const {return dirtyChunks_[i];}
+
+    void writeChunk(int chunk, Array<char>& out) const
+    {
+        writeChunk(chunk, versions_[chunk], out);
+    }
+
+    // the changes of a dirty chunk with the version it gets in clearDirty(), TDIF or CHNK
+    // if that's shorter
+    void writeUpdate(int chunk, Array<char>& out) const
+    {
+        const unsigned version = versions_[chunk] + 1;
+
+        if(numDirty_[chunk] * tileDiffEntrySize >= chunkArea)
+        {
+            writeChunk(chunk, version, out);
+            return;
+        }
+
+        addMsg(out, Cmd::TileDiff, IntField{chunk % widthChunks_}, lit(" "),
+               IntField{chunk / widthChunks_}, lit(" "), IntField{version}, lit(" "));
+
+        // over the '\0'
+        int pos = out.size() - 1;
+        out.resize(pos + numDirty_[chunk] * tileDiffEntrySize + 1);
+        const unsigned long long* const words = dirtyBits_.data() + chunk * chunkDirtyWords;
+        const unsigned char* const tiles = getChunkTiles(chunk);
+
+        for(int w = 0; w < chunkDirtyWords; ++w)
+        {
+            for(unsigned long long word = words[w]; word; word &= word - 1)
+            {
+                const int offset = w * 64 + __builtin_ctzll(word);
+                out[pos] = '0' + (offset >> chunkShift);
+                out[pos + 1] = '0' + (offset & (chunkSize - 1));
+                out[pos + 2] = '0' + tiles[offset];
+                pos += tileDiffEntrySize;
+            }
+        }
+
+        out[pos] = '\0';
+    }
+
+    void clearDirty()
+    {
+        for(int chunk: dirtyChunks_)
+        {
+            versions_[chunk] += 1;
+            numDirty_[chunk] = 0;
+            memset(dirtyBits_.data() + chunk * chunkDirtyWords, 0,
+                   chunkDirtyWords * sizeof(dirtyBits_[0]));
+        }
+
+        dirtyChunks_.clear();
+    }
+
+private:
+    int widthChunks_ = 0;
+    int heightChunks_ = 0;
+    Array<unsigned char> tiles_;
+    Array<unsigned long long> dirtyBits_; // chunkDirtyWords per chunk
+    Array<int> numDirty_;                 // set bits per chunk
+    Array<unsigned> versions_;
+    Array<int> dirtyChunks_;
+
+    void writeChunk(int chunk, unsigned version, Array<char>& out) const
+    {
+        addMsg(out, Cmd::Chunk, IntField{chunk % widthChunks_}, lit(" "),
+               IntField{chunk / widthChunks_}, lit(" "), IntField{version}, lit(" "),
+               StrField{(const char*)getChunkTiles(chunk), chunkArea});
+
+        char* const tiles = out.data() + out.size() - 1 - chunkArea;
+        for(int t = 0; t < chunkArea; ++t)
+            tiles[t] += '0';
+    }
+};
+
+// payload of CHNK / TDIF, returns false if malformed, tiles - the rest of the payload
+inline bool parseChunkMsg(const char* payload, int& cx, int& cy, unsigned& version,
+                          const char*& tiles)
+{
+    char* end;
+    cx = strtol(payload, &end, 10);
+    if(*end != ' ')
+        return false;
+
+    cy = strtol(end, &end, 10);
+    if(*end != ' ')
+        return false;
+
+    version = strtoul(end, &end, 10);
+    if(*end != ' ')
+        return false;
+
+    tiles = end + 1;
+    return true;
+}
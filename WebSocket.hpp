@@ -0,0 +1,451 @@
+#pragma once
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include "Array.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define WEBSOCKET_X86
+#endif
+
+// RFC 6455 for the browser players, the upgrade is a GET with "Upgrade: websocket"
+// the binary frames of the server carry the protocol stream (complete messages, a frame
+// can have more of them), the frames of the browser one or more messages each (text or
+// binary), a data message without the final '\0' gets one
+// the browser masks its frames, the server doesn't
+
+enum class WsOpcode
+{
+    Continuation = 0x0,
+    Text = 0x1,
+    Binary = 0x2,
+    Close = 0x8,
+    Ping = 0x9,
+    Pong = 0xa
+};
+
+// the largest frame a browser can send, more than the receive buffer anyway
+constexpr int wsMaxFrameSize = 64 * 1024;
+constexpr int wsMaxControlSize = 125;
+
+// SHA-1 of the handshake, for nothing else
+
+inline unsigned rotl32(unsigned v, int n) {return v << n | v >> (32 - n);}
+
+inline void sha1Block(unsigned state[5], const unsigned char* block)
+{
+    unsigned w[80];
+    for(int i = 0; i < 16; ++i)
+    {
+        w[i] = unsigned(block[i * 4]) << 24 | block[i * 4 + 1] << 16 | block[i * 4 + 2] << 8 |
+               block[i * 4 + 3];
+    }
+
+    for(int i = 16; i < 80; ++i)
+        w[i] = rotl32(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+    unsigned a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+
+    for(int i = 0; i < 80; ++i)
+    {
+        unsigned f, k;
+        if(i < 20)
+        {
+            f = (b & c) | (~b & d);
+            k = 0x5a827999;
+        }
+        else if(i < 40)
+        {
+            f = b ^ c ^ d;
+            k = 0x6ed9eba1;
+        }
+        else if(i < 60)
+        {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8f1bbcdc;
+        }
+        else
+        {
+            f = b ^ c ^ d;
+            k = 0xca62c1d6;
+        }
+
+        const unsigned t = rotl32(a, 5) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = rotl32(b, 30);
+        b = a;
+        a = t;
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+}
+
+inline void sha1(const char* data, int size, unsigned char digest[20])
+{
+    unsigned state[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0};
+    unsigned char block[64];
+    int pos = 0;
+
+    for(; size - pos >= 64; pos += 64)
+        sha1Block(state, (const unsigned char*)data + pos);
+
+    // the rest, 0x80 and the size in bits, one or two blocks
+    const int rest = size - pos;
+    memset(block, 0, sizeof(block));
+    memcpy(block, data + pos, rest);
+    block[rest] = 0x80;
+
+    if(rest >= 56)
+    {
+        sha1Block(state, block);
+        memset(block, 0, sizeof(block));
+    }
+
+    const unsigned long long numBits = (unsigned long long)size * 8;
+    for(int i = 0; i < 8; ++i)
+        block[63 - i] = numBits >> (i * 8);
+
+    sha1Block(state, block);
+
+    for(int i = 0; i < 20; ++i)
+        digest[i] = state[i / 4] >> (24 - i % 4 * 8);
+}
+
+// out gets 4 * ((size + 2) / 3) characters and '\0'
+inline void encodeBase64(const unsigned char* data, int size, char* out)
+{
+    const char* const chars = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    for(int i = 0; i < size; i += 3)
+    {
+        const unsigned v = data[i] << 16 | (i + 1 < size ? data[i + 1] << 8 : 0) |
+                           (i + 2 < size ? data[i + 2] : 0);
+        *out++ = chars[v >> 18 & 63];
+        *out++ = chars[v >> 12 & 63];
+        *out++ = i + 1 < size ? chars[v >> 6 & 63] : '=';
+        *out++ = i + 2 < size ? chars[v & 63] : '=';
+    }
+
+    *out = '\0';
+}
+
+// returns the value of the header (case insensitive name), nullptr if not found
+// valueSize - up to the end of the line
+inline const char* findHttpHeader(const char* request, int size, const char* name,
+                                  int& valueSize)
+{
+    const int nameSize = strlen(name);
+    const char* const end = request + size;
+    const char* line = request;
+
+    while(true)
+    {
+        const char* const lineEnd = (const char*)memchr(line, '\n', end - line);
+        if(!lineEnd)
+            return nullptr;
+
+        if(lineEnd - line > nameSize && strncasecmp(line, name, nameSize) == 0 &&
+           line[nameSize] == ':')
+        {
+            const char* value = line + nameSize + 1;
+            while(*value == ' ')
+                ++value;
+
+            valueSize = lineEnd - value;
+            if(valueSize && value[valueSize - 1] == '\r')
+                --valueSize;
+
+            return value;
+        }
+
+        line = lineEnd + 1;
+    }
+}
+
+// request - complete (up to "\r\n\r\n"), returns false if it isn't a WebSocket upgrade
+inline bool isWsUpgrade(const char* request, int size, char (&key)[32])
+{
+    int upgradeSize;
+    const char* const upgrade = findHttpHeader(request, size, "Upgrade", upgradeSize);
+    int keySize;
+    const char* const keyValue = findHttpHeader(request, size, "Sec-WebSocket-Key", keySize);
+
+    if(!upgrade || upgradeSize != 9 || strncasecmp(upgrade, "websocket", 9) != 0 ||
+       !keyValue || keySize == 0 || keySize >= int(sizeof(key)))
+        return false;
+
+    memcpy(key, keyValue, keySize);
+    key[keySize] = '\0';
+    return true;
+}
+
+inline void addWsAcceptReply(Array<char>& buf, const char* key)
+{
+    char input[64];
+    const int inputSize = snprintf(input, sizeof(input), "%s%s", key,
+                                   "258EAFA5-E914-47DA-95CA-C5AB0DC85B11");
+    unsigned char digest[20];
+    sha1(input, inputSize, digest);
+    char accept[32];
+    encodeBase64(digest, sizeof(digest), accept);
+
+    char reply[256];
+    const int size = snprintf(reply, sizeof(reply), "HTTP/1.1 101 Switching Protocols\r\n"
+                                                    "Upgrade: websocket\r\n"
+                                                    "Connection: Upgrade\r\n"
+                                                    "Sec-WebSocket-Accept: %s\r\n\r\n", accept);
+    const int prevSize = buf.size();
+    buf.resize(prevSize + size);
+    memcpy(buf.data() + prevSize, reply, size);
+}
+
+// frames
+
+inline int getWsHeaderSize(long long payloadSize, bool masked)
+{
+    return (payloadSize < 126 ? 2 : payloadSize < 65536 ? 4 : 10) + (masked ? 4 : 0);
+}
+
+// returns the size of the server (unmasked) frame that begins at frame
+inline long long getWsFrameSize(const char* frame)
+{
+    const unsigned char* const h = (const unsigned char*)frame;
+    const int len = h[1] & 0x7f;
+
+    if(len < 126)
+        return 2 + len;
+
+    if(len == 126)
+        return 4 + (h[2] << 8 | h[3]);
+
+    long long size = 0;
+    for(int i = 0; i < 8; ++i)
+        size = size << 8 | h[2 + i];
+
+    return 10 + size;
+}
+
+// writes getWsHeaderSize() bytes, maskKey - in the byte order of the wire
+inline void writeWsHeader(char* it, WsOpcode opcode, long long payloadSize,
+                          bool masked = false, unsigned maskKey = 0)
+{
+    unsigned char* h = (unsigned char*)it;
+    h[0] = 0x80 | int(opcode); // FIN
+    const int maskBit = masked ? 0x80 : 0;
+
+    if(payloadSize < 126)
+    {
+        h[1] = maskBit | payloadSize;
+        h += 2;
+    }
+    else if(payloadSize < 65536)
+    {
+        h[1] = maskBit | 126;
+        h[2] = payloadSize >> 8;
+        h[3] = payloadSize;
+        h += 4;
+    }
+    else
+    {
+        h[1] = maskBit | 127;
+        for(int i = 0; i < 8; ++i)
+            h[2 + i] = payloadSize >> (56 - i * 8);
+        h += 10;
+    }
+
+    if(masked)
+        memcpy(h, &maskKey, 4);
+}
+
+// dst and src can overlap if dst <= src (in-place decoding), every frame begins with
+// the first byte of the key
+inline void unmaskScalar(char* dst, const char* src, int size, unsigned maskKey, int from = 0)
+{
+    const unsigned char* const key = (const unsigned char*)&maskKey;
+    for(int i = from; i < size; ++i)
+        dst[i] = src[i] ^ key[i % 4];
+}
+
+#ifdef WEBSOCKET_X86
+
+__attribute__((target("sse2")))
+inline void unmaskSse2(char* dst, const char* src, int size, unsigned maskKey)
+{
+    const __m128i key = _mm_set1_epi32(maskKey);
+    int i = 0;
+
+    for(; i + 16 <= size; i += 16)
+    {
+        const __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_xor_si128(v, key));
+    }
+
+    unmaskScalar(dst, src, size, maskKey, i);
+}
+
+__attribute__((target("avx2")))
+inline void unmaskAvx2(char* dst, const char* src, int size, unsigned maskKey)
+{
+    const __m256i key = _mm256_set1_epi32(maskKey);
+    int i = 0;
+
+    for(; i + 32 <= size; i += 32)
+    {
+        const __m256i v = _mm256_loadu_si256((const __m256i*)(src + i));
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_xor_si256(v, key));
+    }
+
+    unmaskScalar(dst, src, size, maskKey, i);
+}
+
+#endif
+
+// picks the widest instruction set the cpu supports (masking is the same operation)
+inline void unmask(char* dst, const char* src, int size, unsigned maskKey)
+{
+#ifdef WEBSOCKET_X86
+    static const bool hasAvx2 = __builtin_cpu_supports("avx2");
+    static const bool hasSse2 = __builtin_cpu_supports("sse2");
+
+    if(hasAvx2)
+        return unmaskAvx2(dst, src, size, maskKey);
+
+    if(hasSse2)
+        return unmaskSse2(dst, src, size, maskKey);
+#endif
+
+    unmaskScalar(dst, src, size, maskKey);
+}
+
+inline void addWsFrame(Array<char>& buf, WsOpcode opcode, const char* data, int size)
+{
+    const int headerSize = getWsHeaderSize(size, false);
+    const int prevSize = buf.size();
+    buf.resize(prevSize + headerSize + size);
+    writeWsHeader(buf.data() + prevSize, opcode, size);
+    memcpy(buf.data() + prevSize + headerSize, data, size);
+}
+
+// the browser side (loadgen)
+inline void addMaskedWsFrame(Array<char>& buf, WsOpcode opcode, const char* data, int size,
+                             unsigned maskKey)
+{
+    const int headerSize = getWsHeaderSize(size, true);
+    const int prevSize = buf.size();
+    buf.resize(prevSize + headerSize + size);
+    writeWsHeader(buf.data() + prevSize, opcode, size, true, maskKey);
+    unmask(buf.data() + prevSize + headerSize, data, size, maskKey);
+}
+
+struct WsStats
+{
+    long long frames = 0;
+    long long controlFrames = 0;
+    long long bytes = 0; // unmasked
+};
+
+// decodes the complete frames of a browser in place, buf[0, numDecoded) is the decoded
+// protocol stream, buf[numDecoded, size) the frames, the payloads of the data frames
+// are appended to the decoded stream
+// PING gets a PONG and CLOSE a CLOSE in replies, closed is set then (the rest is dropped)
+// returns the new size of the data (the incomplete frames follow the decoded stream),
+// -1 on a protocol error (an unmasked or a too large frame, a length that isn't minimal,
+// unknown opcode)
+inline int decodeWsFrames(char* buf, int& numDecoded, int size, Array<char>& replies,
+                          bool& closed, WsStats& stats)
+{
+    int pos = numDecoded;
+
+    while(!closed && size - pos >= 2)
+    {
+        const unsigned char* const h = (const unsigned char*)buf + pos;
+        const bool fin = h[0] & 0x80;
+        const int opcode = h[0] & 0x0f;
+        const int len = h[1] & 0x7f;
+
+        if((h[0] & 0x70) || !(h[1] & 0x80))
+            return -1;
+
+        int headerSize = len < 126 ? 6 : len == 126 ? 8 : 14;
+        if(size - pos < headerSize)
+            break;
+
+        // the extended lengths are minimal, the 64-bit one has the top bit clear
+        long long payloadSize = len;
+        if(len == 126)
+        {
+            payloadSize = h[2] << 8 | h[3];
+            if(payloadSize < 126)
+                return -1;
+        }
+        else if(len == 127)
+        {
+            if(h[2] & 0x80)
+                return -1;
+
+            payloadSize = 0;
+            for(int i = 0; i < 8; ++i)
+                payloadSize = payloadSize << 8 | h[2 + i];
+
+            if(payloadSize <= 0xffff)
+                return -1;
+        }
+
+        if(payloadSize < 0 || payloadSize > wsMaxFrameSize)
+            return -1;
+
+        if(size - pos < headerSize + payloadSize)
+            break;
+
+        unsigned maskKey;
+        memcpy(&maskKey, h + headerSize - 4, 4);
+        const char* const payload = buf + pos + headerSize;
+        pos += headerSize + payloadSize;
+        stats.frames += 1;
+        stats.bytes += payloadSize;
+
+        if(opcode >= int(WsOpcode::Close))
+        {
+            if(!fin || payloadSize > wsMaxControlSize)
+                return -1;
+
+            char data[wsMaxControlSize];
+            unmask(data, payload, payloadSize, maskKey);
+            stats.controlFrames += 1;
+
+            if(opcode == int(WsOpcode::Close))
+            {
+                // the status code is echoed
+                addWsFrame(replies, WsOpcode::Close, data, payloadSize < 2 ? payloadSize : 2);
+                closed = true;
+            }
+            else if(opcode == int(WsOpcode::Ping))
+                addWsFrame(replies, WsOpcode::Pong, data, payloadSize);
+            else if(opcode != int(WsOpcode::Pong))
+                return -1;
+
+            continue;
+        }
+
+        if(opcode > int(WsOpcode::Binary))
+            return -1;
+
+        // the decoded stream is shorter than the frames (at least the 6 header bytes),
+        // it can't overtake them
+        unmask(buf + numDecoded, payload, payloadSize, maskKey);
+        numDecoded += payloadSize;
+
+        if(fin && numDecoded && buf[numDecoded - 1] != '\0')
+            buf[numDecoded++] = '\0';
+    }
+
+    memmove(buf + numDecoded, buf + pos, size - pos);
+    return numDecoded + size - pos;
+}
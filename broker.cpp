@@ -0,0 +1,426 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "Array.hpp"
+#include "Broker.hpp"
+
+// message broker for a cluster of servers (nodes) on one or more hosts
+// room broadcasts go only to the other nodes subscribed to the room, name claims
+// go to every other node
+// every node gets its messages of one iteration with one send()
+//
+// local setup: broker, then e.g.
+// server -broker /tmp/cavetiles-broker.sock
+// server -broker /tmp/cavetiles-broker.sock -port 3001
+// and clients with -port 3000 / 3001 in the same room
+
+struct RoomName
+{
+    char name[brokerKeySize];
+};
+
+struct Node
+{
+    int id; // unique for the lifetime of the broker
+    int sockfd;
+    bool remove;
+    Array<char> recvBuf;
+    Array<char> sendBuf;
+    Array<int> rooms; // subscriptions, indices into the room names
+};
+
+// a name can be claimed by more nodes at once (e.g. the two processes of a hot upgrade),
+// the others see the claim of the first and the release of the last one
+struct NameClaim
+{
+    char name[brokerKeySize];
+    int nodeId;
+};
+
+struct Metrics
+{
+    long long nodesAccepted = 0;
+    long long msgsRecv = 0;
+    long long pubsForwarded = 0; // per receiving node
+    long long claimsForwarded = 0;
+    long long bytesSent = 0;
+};
+
+// returns the listening socket descriptor, -1 if failed
+int createListener(const char* addr)
+{
+    sockaddr_storage sa;
+    socklen_t saSize;
+    if(!getBrokerAddr(addr, sa, saSize, true))
+        return -1;
+
+    const int sockfd = socket(sa.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(sockfd == -1)
+    {
+        perror("socket() failed");
+        return -1;
+    }
+
+    if(sa.ss_family == AF_UNIX)
+        unlink(((const sockaddr_un&)sa).sun_path);
+    else
+    {
+        const int option = 1;
+        setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &option, sizeof(option));
+    }
+
+    if(bind(sockfd, (const sockaddr*)&sa, saSize) == -1 || listen(sockfd, 64) == -1)
+    {
+        perror("bind() / listen() failed");
+        close(sockfd);
+        return -1;
+    }
+
+    return sockfd;
+}
+
+// returns the index, adds the name if not found
+int getRoomIdx(Array<RoomName>& roomNames, const char* name)
+{
+    for(int i = 0; i < roomNames.size(); ++i)
+    {
+        if(strcmp(roomNames[i].name, name) == 0)
+            return i;
+    }
+
+    RoomName room;
+    snprintf(room.name, sizeof(room.name), "%s", name);
+    roomNames.pushBack(room);
+    return roomNames.size() - 1;
+}
+
+bool isSubscribed(const Node& node, int room)
+{
+    for(int r: node.rooms)
+    {
+        if(r == room)
+            return true;
+    }
+    return false;
+}
+
+int countClaims(const Array<NameClaim>& claims, const char* name)
+{
+    int count = 0;
+    for(const NameClaim& claim: claims)
+        count += strcmp(claim.name, name) == 0;
+
+    return count;
+}
+
+// forwards the claim (or the release) of a name to all the nodes except the sender
+void forwardClaim(Array<Node*>& nodes, const Node& sender, BrokerCmd cmd, const char* name,
+                  Metrics& metrics)
+{
+    for(Node* node: nodes)
+    {
+        if(node != &sender)
+        {
+            addBrokerMsg(node->sendBuf, cmd, name);
+            metrics.claimsForwarded += 1;
+        }
+    }
+}
+
+// removes one claim of the node, returns false if it had none
+bool removeClaim(Array<NameClaim>& claims, int nodeId, const char* name)
+{
+    for(int i = 0; i < claims.size(); ++i)
+    {
+        if(claims[i].nodeId == nodeId && strcmp(claims[i].name, name) == 0)
+        {
+            claims[i] = claims.back();
+            claims.popBack();
+            return true;
+        }
+    }
+    return false;
+}
+
+void route(Array<Node*>& nodes, Node& sender, const BrokerMsg& msg, const char* data,
+           Array<RoomName>& roomNames, Array<NameClaim>& claims, Metrics& metrics)
+{
+    metrics.msgsRecv += 1;
+
+    switch(BrokerCmd(msg.cmd))
+    {
+        case BrokerCmd::Sub:
+        {
+            const int room = getRoomIdx(roomNames, msg.key);
+            if(!isSubscribed(sender, room))
+                sender.rooms.pushBack(room);
+            break;
+        }
+
+        case BrokerCmd::Unsub:
+        {
+            const int room = getRoomIdx(roomNames, msg.key);
+            for(int i = 0; i < sender.rooms.size(); ++i)
+            {
+                if(sender.rooms[i] == room)
+                {
+                    sender.rooms[i] = sender.rooms.back();
+                    sender.rooms.popBack();
+                    break;
+                }
+            }
+            break;
+        }
+
+        case BrokerCmd::Pub:
+        {
+            const int room = getRoomIdx(roomNames, msg.key);
+            for(Node* node: nodes)
+            {
+                if(node != &sender && isSubscribed(*node, room))
+                {
+                    addBrokerMsg(node->sendBuf, BrokerCmd::Pub, msg.key, data, msg.size);
+                    metrics.pubsForwarded += 1;
+                }
+            }
+            break;
+        }
+
+        case BrokerCmd::Claim:
+        {
+            NameClaim claim;
+            snprintf(claim.name, sizeof(claim.name), "%s", msg.key);
+            claim.nodeId = sender.id;
+            claims.pushBack(claim);
+
+            if(countClaims(claims, msg.key) == 1)
+                forwardClaim(nodes, sender, BrokerCmd::Claim, msg.key, metrics);
+            break;
+        }
+
+        case BrokerCmd::Release:
+            if(removeClaim(claims, sender.id, msg.key) && countClaims(claims, msg.key) == 0)
+                forwardClaim(nodes, sender, BrokerCmd::Release, msg.key, metrics);
+            break;
+    }
+}
+
+static volatile int gExitLoop = false;
+void sigHandler(int) {gExitLoop = true;}
+
+int main(int argc, const char* const * const argv)
+{
+    const char* addr = "/tmp/cavetiles-broker.sock";
+    // a node that doesn't read is disconnected
+    int maxSendBuf = 64 * 1024 * 1024;
+
+    for(int i = 1; i < argc; ++i)
+    {
+        if(strcmp(argv[i], "-listen") == 0 && i + 1 < argc)
+            addr = argv[++i];
+        else if(strcmp(argv[i], "-send-max") == 0 && i + 1 < argc)
+            maxSendBuf = atoi(argv[++i]);
+        else
+        {
+            printf("usage: broker [-listen <socket path | [host:]port>] [-send-max <bytes>]\n"
+                   "default: -listen %s\n", addr);
+            return 0;
+        }
+    }
+
+    signal(SIGINT, sigHandler);
+    signal(SIGTERM, sigHandler);
+
+    const int listenfd = createListener(addr);
+    if(listenfd == -1)
+        return 0;
+
+    printf("listening on %s\n", addr);
+
+    Array<Node*> nodes;
+    Array<RoomName> roomNames;
+    Array<NameClaim> claims;
+    Array<pollfd> pollfds;
+    Metrics metrics;
+    int nextNodeId = 1;
+
+    while(gExitLoop == false)
+    {
+        pollfds.clear();
+        pollfds.pushBack({listenfd, POLLIN, 0});
+
+        for(const Node* node: nodes)
+        {
+            const short events = POLLIN | (node->sendBuf.size() ? POLLOUT : 0);
+            pollfds.pushBack({node->sockfd, events, 0});
+        }
+
+        if(poll(pollfds.data(), pollfds.size(), 1000) == -1)
+        {
+            if(errno != EINTR)
+            {
+                perror("poll() failed");
+                break;
+            }
+            continue;
+        }
+
+        // accept
+        while(true)
+        {
+            const int sockfd = accept4(listenfd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if(sockfd == -1)
+                break;
+
+            Node* const node = new Node();
+            node->id = nextNodeId++;
+            node->sockfd = sockfd;
+            node->remove = false;
+
+            // the names of the cluster, once each
+            for(int i = 0; i < claims.size(); ++i)
+            {
+                int k = 0;
+                while(strcmp(claims[k].name, claims[i].name) != 0)
+                    ++k;
+
+                if(k == i)
+                    addBrokerMsg(node->sendBuf, BrokerCmd::Claim, claims[i].name);
+            }
+
+            nodes.pushBack(node);
+            metrics.nodesAccepted += 1;
+            printf("node %d has connected (%d nodes)\n", node->id, nodes.size());
+        }
+
+        // receive and route, a node can't see its own messages out of order
+        for(int n = 0; n < nodes.size(); ++n)
+        {
+            Node& node = *nodes[n];
+
+            while(true)
+            {
+                char buf[64 * 1024];
+                const int rc = recv(node.sockfd, buf, sizeof(buf), 0);
+
+                if(rc > 0)
+                {
+                    const int prevSize = node.recvBuf.size();
+                    node.recvBuf.resize(prevSize + rc);
+                    memcpy(node.recvBuf.data() + prevSize, buf, rc);
+                    continue;
+                }
+
+                if(rc == -1 && errno == EINTR)
+                    continue;
+
+                if(rc == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+                    node.remove = true;
+
+                break;
+            }
+
+            int pos = 0;
+            while(node.recvBuf.size() - pos >= int(sizeof(BrokerMsg)))
+            {
+                BrokerMsg msg;
+                memcpy(&msg, node.recvBuf.data() + pos, sizeof(msg));
+                msg.key[sizeof(msg.key) - 1] = '\0';
+
+                if(msg.size < 0 || msg.size > brokerMaxMsgSize)
+                {
+                    printf("node %d has sent an invalid message\n", node.id);
+                    node.remove = true;
+                    break;
+                }
+
+                if(node.recvBuf.size() - pos < int(sizeof(msg)) + msg.size)
+                    break;
+
+                route(nodes, node, msg, node.recvBuf.data() + pos + sizeof(msg), roomNames,
+                      claims, metrics);
+                pos += sizeof(msg) + msg.size;
+            }
+
+            node.recvBuf.erase(0, pos);
+        }
+
+        // send
+        for(Node* node: nodes)
+        {
+            if(node->remove || node->sendBuf.empty())
+                continue;
+
+            const int rc = send(node->sockfd, node->sendBuf.data(), node->sendBuf.size(),
+                                MSG_NOSIGNAL);
+
+            if(rc == -1)
+            {
+                if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                    node->remove = true;
+            }
+            else
+            {
+                node->sendBuf.erase(0, rc);
+                metrics.bytesSent += rc;
+            }
+
+            if(node->sendBuf.size() > maxSendBuf)
+            {
+                printf("node %d doesn't keep up, removing\n", node->id);
+                node->remove = true;
+            }
+        }
+
+        // remove, the names of the node are released
+        for(int n = 0; n < nodes.size(); ++n)
+        {
+            Node* const node = nodes[n];
+            if(!node->remove)
+                continue;
+
+            for(int i = 0; i < claims.size(); ++i)
+            {
+                if(claims[i].nodeId != node->id)
+                    continue;
+
+                char name[brokerKeySize];
+                memcpy(name, claims[i].name, sizeof(name));
+                claims[i] = claims.back();
+                claims.popBack();
+                --i;
+
+                if(countClaims(claims, name) == 0)
+                    forwardClaim(nodes, *node, BrokerCmd::Release, name, metrics);
+            }
+
+            close(node->sockfd);
+            nodes[n] = nodes.back();
+            nodes.popBack();
+            --n;
+            printf("node %d has disconnected (%d nodes)\n", node->id, nodes.size());
+            delete node;
+        }
+    }
+
+    for(Node* node: nodes)
+    {
+        close(node->sockfd);
+        delete node;
+    }
+
+    close(listenfd);
+
+    if(strchr(addr, '/'))
+        unlink(addr);
+
+    printf("nodes: %lld, messages: %lld, forwarded broadcasts: %lld, forwarded claims: %lld,"
+           " sent %lld bytes\n", metrics.nodesAccepted, metrics.msgsRecv,
+           metrics.pubsForwarded, metrics.claimsForwarded, metrics.bytesSent);
+    return 0;
+}
@@ -10,7 +10,12 @@
 #include <fcntl.h>
 #include <time.h>
 #include <netinet/tcp.h>
+#include <sys/un.h>
 #include "Array.hpp"
+#include "Lz.hpp"
+#include "Protocol.hpp"
+#include "Packetizer.hpp"
+#include "TileMap.hpp"
 
 double getTimeSec()
 {
@@ -27,38 +32,71 @@ const void* get_in_addr(const sockaddr* const sa)
     return &( ( (sockaddr_in6*)sa )->sin6_addr );
 }
 
-struct Cmd
+// roomName - optional, the server puts new players into the lobby
+void addNameMsg(Array<char>& buffer, const char* playerName, const char* roomName)
 {
-    enum
+    const int maxNameSize = 19; // the server keeps 20 bytes with '\0'
+
+    if(int(strlen(playerName)) > maxNameSize)
     {
-        _nil,
-        Ping,
-        Pong,
-        Name,
-        Chat,
-        _count
-    };
+        printf("WARNING: max player name size is %d, truncating\n",
+                maxNameSize);
+    }
+
+    addMsg(buffer, Cmd::Name, str(playerName, maxNameSize));
+
+    if(roomName)
+        addMsg(buffer, Cmd::Room, str(roomName, maxNameSize));
+}
+
+// the client doesn't keep the tiles, only the versions of the chunks it has got
+struct ChunkVersion
+{
+    int cx;
+    int cy;
+    unsigned version;
 };
 
-const char* getCmdStr(int cmd)
+// returns the index in versions, -1 if not there
+int findChunk(const Array<ChunkVersion>& versions, int cx, int cy)
 {
-    switch(cmd)
+    for(int i = 0; i < versions.size(); ++i)
     {
-        case Cmd::Ping: return "PING";
-        case Cmd::Pong: return "PONG";
-        case Cmd::Name: return "NAME";
-        case Cmd::Chat: return "CHAT";
+        if(versions[i].cx == cx && versions[i].cy == cy)
+            return i;
     }
-    assert(false);
+
+    return -1;
 }
 
-void addMsg(Array<char>& buffer, int cmd, const char* payload = "")
+// UDP socket connected to the server peer of the TCP socket (same address and port),
+// returns -1 if failed
+int connectUdp(int tcpfd)
 {
-    const char* cmdStr = getCmdStr(cmd);
-    int len = strlen(cmdStr) + strlen(payload) + 2; // ' ' + '\0'
-    int prevSize = buffer.size();
-    buffer.resize(prevSize + len);
-    assert(snprintf(buffer.data() + prevSize, len, "%s %s", cmdStr, payload) == len - 1);
+    sockaddr_storage addr;
+    socklen_t addrSize = sizeof(addr);
+
+    if(getpeername(tcpfd, (sockaddr*)&addr, &addrSize) == -1)
+    {
+        perror("getpeername() failed");
+        return -1;
+    }
+
+    const int sockfd = socket(addr.ss_family, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if(sockfd == -1)
+    {
+        perror("socket() (UDP) failed");
+        return -1;
+    }
+
+    if(connect(sockfd, (const sockaddr*)&addr, addrSize) == -1)
+    {
+        perror("connect() (UDP) failed");
+        close(sockfd);
+        return -1;
+    }
+
+    return sockfd;
 }
 
 static volatile int gExitLoop = false;
@@ -66,7 +104,7 @@ void sigHandler(int) {gExitLoop = true;}
 
 // returns socket descriptior, -1 if failed
 // if succeeded you have to free the socket yourself
-int connect()
+int connect(const char* port)
 {
     addrinfo hints = {};
     hints.ai_family = AF_UNSPEC;
@@ -75,7 +113,7 @@ int connect()
     addrinfo* list;
     {
         // this blocks
-        const int ec = getaddrinfo("localhost", "3000", &hints, &list);
+        const int ec = getaddrinfo("localhost", port, &hints, &list);
         if(ec != 0)
         {
             printf("getaddrinfo() failed: %s\n", gai_strerror(ec));
@@ -135,30 +173,156 @@ int connect()
     return sockfd;
 }
 
+// same as connect() but to the AF_UNIX socket of a server on this host
+int connectUnix(const char* path)
+{
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+
+    if(strlen(path) >= sizeof(addr.sun_path))
+    {
+        printf("unix socket path is too long: '%s'\n", path);
+        return -1;
+    }
+
+    strcpy(addr.sun_path, path);
+
+    const int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(sockfd == -1)
+    {
+        perror("socket() failed");
+        return -1;
+    }
+
+    if(connect(sockfd, (const sockaddr*)&addr, sizeof(addr)) == -1)
+    {
+        close(sockfd);
+        perror("connect() failed");
+        return -1;
+    }
+
+    if(fcntl(sockfd, F_SETFL, O_NONBLOCK) == -1)
+    {
+        close(sockfd);
+        perror("fcntl() failed");
+        return -1;
+    }
+
+    printf("connected to %s\n", path);
+    return sockfd;
+}
+
+// returns the delay of the next connection attempt, see getReconnectDelaySec()
+float getNextReconnectDelay(int& numReconnects, float& retryAfterSec)
+{
+    const float random = rand() / (RAND_MAX + 1.f);
+    float delay;
+
+    if(retryAfterSec > 0.f)
+    {
+        delay = retryAfterSec + getReconnectDelaySec(0, random);
+        printf("server is busy, retrying in %.1f s\n", delay);
+    }
+    else
+        delay = getReconnectDelaySec(numReconnects, random);
+
+    retryAfterSec = 0.f;
+    ++numReconnects;
+    return delay;
+}
+
 int main(int argc, const char* const * const argv)
 {
-    if(argc != 2)
+    bool useCompression = false;
+    bool printStats = false;
+    bool useUdp = false;
+    const char* port = "3000";
+    const char* unixPath = nullptr;
+    const char* roomName = nullptr;
+    // the tile the view is centered on, -1 - no tile map
+    int digX = -1;
+    int digY = -1;
+    bool argsOk = argc >= 2;
+
+    for(int i = 2; argsOk && i < argc; ++i)
     {
-        printf("usage: client <name>\n");
+        if(strcmp(argv[i], "-compress") == 0)
+            useCompression = true;
+        else if(strcmp(argv[i], "-stats") == 0)
+            printStats = true;
+        else if(strcmp(argv[i], "-udp") == 0)
+            useUdp = true;
+        else if(strcmp(argv[i], "-port") == 0 && i + 1 < argc)
+            port = argv[++i];
+        else if(strcmp(argv[i], "-unix") == 0 && i + 1 < argc)
+            unixPath = argv[++i];
+        else if(strcmp(argv[i], "-room") == 0 && i + 1 < argc)
+            roomName = argv[++i];
+        else if(strcmp(argv[i], "-dig") == 0 && i + 2 < argc)
+        {
+            digX = atoi(argv[++i]);
+            digY = atoi(argv[++i]);
+            argsOk = digX >= 0 && digY >= 0;
+        }
+        else
+            argsOk = false;
+    }
+
+    if(!argsOk)
+    {
+        printf("usage: client <name> [-compress] [-room <name>] [-stats] [-udp] [-port <port>]\n"
+               "       [-unix <path>] [-dig <x> <y>]\n"
+               "-dig - view the tile map around the tile, dig a tile near it every 10 s\n");
         return 0;
     }
 
     signal(SIGINT, sigHandler);
 
-    // remove code duplication between client.cpp and server.cpp
+    // the players of a restarted server must not pick the same delays
+    srand(time(nullptr) ^ getpid());
+
     // change the delimiter to \r\n ?
 
     Array<char> sendBuf, recvBuf;
     int recvBufNumUsed = 0;
+    Array<Frame> frames;
     sendBuf.reserve(500);
     recvBuf.resize(500);
+    // compressed data from the server, decoded into recvBuf
+    Array<char> wireBuf;
+    int wireBufNumUsed = 0;
+    wireBuf.resize(500);
+    LzDecoder decoder;
+    bool compress = false;
+    // session token from the server, used instead of NAME after a reconnect,
+    // numReceived counts the session (CHAT) messages
+    char token[32] = "";
+    long long numReceived = 0;
     bool serverAlive;
+    LinkStats link; // of the current connection
     double currentTime = getTimeSec();
     const float timerAliveMax = 5.f;
-    const float timerReconnectMax = 5.f;
-    float timerAlive, timerSend, timerReconnect = timerReconnectMax;
+    float timerAlive, timerSend, timerReconnect = 0.f;
+    // see getReconnectDelaySec(), the attempts are counted until the server takes
+    // the NAME or the RESM
+    float reconnectDelay = 0.f;
+    int numReconnects = 0;
+    float retryAfterSec = 0.f; // BUSY hint of the server
     bool hasToReconnect = true;
     int sockfd = -1;
+    // PING / PONG go over UDP after the server confirms BIND
+    int udpfd = -1;
+    bool udpBound = false;
+    Array<char> udpSendBuf;
+    Array<char> udpRecvBuf; // messages of one datagram
+    char datagram[maxDatagramSize];
+    Packetizer packetizer;
+    FragAssembler assembler;
+    FragStats fragStats;
+    Array<ChunkVersion> chunkVersions;
+    long long numChunks = 0;
+    long long numChunkDiffs = 0;
+    long long numChunkGaps = 0;
 
     while(gExitLoop == false)
     {
@@ -174,37 +338,55 @@ int main(int argc, const char* const * const argv)
 
         if(hasToReconnect)
         {
-            if(timerReconnect >= timerReconnectMax)
+            // the connection was lost, the next attempt after a delay
+            if(sockfd != -1)
             {
+                close(sockfd);
+                sockfd = -1;
                 timerReconnect = 0.f;
+                reconnectDelay = getNextReconnectDelay(numReconnects, retryAfterSec);
+            }
 
-                if(sockfd != -1)
-                    close(sockfd);
-
-                sockfd = connect();
+            if(udpfd != -1)
+            {
+                close(udpfd);
+                udpfd = -1;
+            }
 
-                if(sockfd != -1)
+            if(timerReconnect >= reconnectDelay)
+            {
+                timerReconnect = 0.f;
+                sockfd = unixPath ? connectUnix(unixPath) : connect(port);
+                // a local connection doesn't need UDP
+                udpfd = useUdp && !unixPath && sockfd != -1 ? connectUdp(sockfd) : -1;
+                udpBound = false;
+                udpSendBuf.clear();
+                assembler.clear();
+
+                if(sockfd == -1)
+                    reconnectDelay = getNextReconnectDelay(numReconnects, retryAfterSec);
+                else
                 {
                     serverAlive = true;
+                    link = LinkStats();
                     timerAlive = timerAliveMax;
                     timerSend = 5.f;
                     hasToReconnect = false;
                     sendBuf.clear();
+                    recvBufNumUsed = 0;
+                    wireBufNumUsed = 0;
+                    compress = false;
 
-                    // send the player name
+                    if(useCompression)
                     {
-                        char name[20];
-                        int maxNameSize = sizeof(name) - 1;
-
-                        if(int(strlen(argv[1])) > maxNameSize)
-                        {
-                            printf("WARNING: max player name size is %d, truncating\n",
-                                    maxNameSize);
-                        }
-
-                        snprintf(name, sizeof(name), "%s", argv[1]);
-                        addMsg(sendBuf, Cmd::Name, name);
+                        addMsg(sendBuf, Cmd::Comp, IntField{lzVersion});
                     }
+
+                    // resume the session or send the player name
+                    if(token[0])
+                        addMsg(sendBuf, Cmd::Resume, str(token), lit(" "), IntField{numReceived});
+                    else
+                        addNameMsg(sendBuf, argv[1], roomName);
                 }
             }
         }
@@ -219,7 +401,13 @@ int main(int argc, const char* const * const argv)
                 if(serverAlive)
                 {
                     serverAlive = false;
-                    addMsg(sendBuf, Cmd::Ping);
+                    addMsg(sendBuf, Cmd::Ping, IntField{getWallTimeUs()});
+
+                    if(token[0])
+                        addMsg(sendBuf, Cmd::Ack, IntField{numReceived});
+
+                    if(udpfd != -1 && !udpBound && token[0])
+                        addMsg(udpSendBuf, Cmd::Bind, str(token));
                 }
                 else
                 {
@@ -231,17 +419,28 @@ int main(int argc, const char* const * const argv)
             if(timerSend > 10.f)
             {
                 timerSend = 0.f;
-                addMsg(sendBuf, Cmd::Chat, "I send a random message every 10s!");
+                addMsg(sendBuf, Cmd::Chat, lit("I send a random message every 10s!"));
+
+                if(digX != -1 && token[0])
+                {
+                    const int x = digX + rand() % chunkSize - chunkSize / 2;
+                    const int y = digY + rand() % chunkSize - chunkSize / 2;
+                    addMsg(sendBuf, Cmd::Tile, IntField{x}, lit(" "), IntField{y}, lit(" "),
+                           IntField{TileType::Air});
+                }
             }
         }
 
         // receive
         if(!hasToReconnect)
         {
+            Array<char>& buf = compress ? wireBuf : recvBuf;
+            int& bufNumUsed = compress ? wireBufNumUsed : recvBufNumUsed;
+
             while(true)
             {
-                const int numFree = recvBuf.size() - recvBufNumUsed;
-                const int rc = recv(sockfd, recvBuf.data() + recvBufNumUsed, numFree, 0);
+                const int numFree = buf.size() - bufNumUsed;
+                const int rc = recv(sockfd, buf.data() + bufNumUsed, numFree, 0);
 
                 if(rc == -1)
                 {
@@ -260,13 +459,14 @@ int main(int argc, const char* const * const argv)
                 }
                 else
                 {
-                    recvBufNumUsed += rc;
+                    bufNumUsed += rc;
 
-                    if(recvBufNumUsed < recvBuf.size())
+                    if(bufNumUsed < buf.size())
                         break;
 
-                    recvBuf.resize(recvBuf.size() * 2);
-                    if(recvBuf.size() > 10000)
+                    // the chat history of a room comes at once
+                    buf.resize(buf.size() * 2);
+                    if(buf.size() > 1024 * 1024)
                     {
                         printf("recvBuf big size issue, exiting\n");
                         gExitLoop = true;
@@ -276,42 +476,100 @@ int main(int argc, const char* const * const argv)
             }
         }
 
-        // process received data
+        // decompress
+        if(compress && wireBufNumUsed)
         {
-            const char* end = recvBuf.data();
-            const char* begin;
+            // decoder appends, recvBuf size is its capacity
+            recvBuf.resize(recvBufNumUsed);
+            const int numDecoded = decoder.decode(wireBuf.data(), wireBufNumUsed, recvBuf);
+            recvBufNumUsed = recvBuf.size();
 
-            while(true)
+            if(recvBuf.size() < 500)
+                recvBuf.resize(500);
+
+            if(numDecoded == -1)
             {
-                begin = end;
-                {
-                    const char* tmp = (const char*)memchr((const void*)end, '\0',
-                                       recvBuf.data() + recvBufNumUsed - end);
+                printf("corrupted compressed data, will try to reconnect\n");
+                hasToReconnect = true;
+            }
+            else
+            {
+                memmove(wireBuf.data(), wireBuf.data() + numDecoded,
+                        wireBufNumUsed - numDecoded);
+                wireBufNumUsed -= numDecoded;
+            }
+        }
 
-                    if(tmp == nullptr) break;
-                    end = tmp;
+        // datagrams, only the UDP commands
+        while(udpfd != -1 && !hasToReconnect)
+        {
+            const int rc = recv(udpfd, datagram, sizeof(datagram), 0);
+
+            if(rc == -1)
+            {
+                // e.g. ECONNREFUSED, the server has UDP disabled
+                if(errno != EAGAIN && errno != EWOULDBLOCK)
+                {
+                    perror("recv() (UDP) failed, using only TCP");
+                    close(udpfd);
+                    udpfd = -1;
                 }
+                break;
+            }
 
-                ++end;
+            if(!rc || datagram[rc - 1] != '\0')
+                continue;
 
-                //printf("received msg: '%s'\n", begin);
+            udpRecvBuf.clear();
+            addDatagramMsgs(datagram, rc, assembler, udpRecvBuf, fragStats);
+            indexFrames(udpRecvBuf.data(), udpRecvBuf.size(), frames);
 
-                int cmd = 0;
-                for(int i = 1; i < Cmd::_count; ++i)
+            for(const Frame& frame: frames)
+            {
+                const MsgView msg = parseMsg(udpRecvBuf.data(), frame);
+
+                switch(msg.cmd)
                 {
-                    const char* const cmdStr = getCmdStr(i);
-                    const int cmdLen = strlen(cmdStr);
+                    case Cmd::Bind:
+                        if(!udpBound)
+                            printf("UDP is bound\n");
 
-                    if(cmdLen > int(strlen(begin)))
-                        continue;
+                        udpBound = true;
+                        break;
 
-                    if(strncmp(begin, cmdStr, cmdLen) == 0)
-                    {
-                        cmd = i;
-                        begin += cmdLen + 1; // ' '
+                    case Cmd::Ping:
+                        addPongMsg(udpSendBuf, msg, getWallTimeUs());
+                        break;
+
+                    case Cmd::Pong:
+                        if(addLinkSample(link, msg, getWallTimeUs()) && printStats)
+                        {
+                            printf("rtt %.2f ms, jitter %.2f ms, clock offset %.2f ms (UDP)\n",
+                                   link.rttUs / 1000.f, link.rttVarUs / 1000.f,
+                                   link.offsetUs / 1000.f);
+                        }
                         break;
-                    }
                 }
+            }
+        }
+
+        // process received data
+        {
+            const char* end = recvBuf.data();
+            const char* begin;
+
+            indexFrames(recvBuf.data(), recvBufNumUsed, frames);
+
+            for(const Frame& frame: frames)
+            {
+                begin = recvBuf.data() + frame.offset;
+                end = begin + frame.size + 1;
+
+                //printf("received msg: '%s'\n", begin);
+
+                const MsgView msg = parseMsg(recvBuf.data(), frame);
+                const int cmd = msg.cmd;
+                begin = msg.payload;
 
                 switch(cmd)
                 {
@@ -320,11 +578,18 @@ int main(int argc, const char* const * const argv)
                         break;
 
                     case Cmd::Ping:
-                        addMsg(sendBuf, Cmd::Pong);
+                        addPongMsg(sendBuf, msg, getWallTimeUs());
                         break;
 
                     case Cmd::Pong:
                         serverAlive = true;
+
+                        if(addLinkSample(link, msg, getWallTimeUs()) && printStats)
+                        {
+                            printf("rtt %.2f ms, jitter %.2f ms, clock offset %.2f ms\n",
+                                   link.rttUs / 1000.f, link.rttVarUs / 1000.f,
+                                   link.offsetUs / 1000.f);
+                        }
                         break;
 
                     case Cmd::Name:
@@ -334,8 +599,130 @@ int main(int argc, const char* const * const argv)
 
                     case Cmd::Chat:
                         printf("%s\n", begin);
+                        ++numReceived;
+                        break;
+
+                    case Cmd::Room:
+                        if(begin[0])
+                            printf("you are in the room '%s'\n", begin);
+                        else
+                            printf("can't join the room, staying in the current one\n");
+                        break;
+
+                    case Cmd::Busy:
+                        retryAfterSec = atoi(begin) / 1000.f;
+                        break;
+
+                    case Cmd::Token:
+                        snprintf(token, sizeof(token), "%s", begin);
+                        numReceived = 0;
+                        numReconnects = 0;
+                        udpBound = false;
+
+                        if(udpfd != -1)
+                            addMsg(udpSendBuf, Cmd::Bind, str(token));
+
+                        if(digX != -1)
+                        {
+                            chunkVersions.clear();
+                            addMsg(sendBuf, Cmd::View, IntField{digX}, lit(" "), IntField{digY});
+                        }
+                        break;
+
+                    case Cmd::Resume:
+                        if(begin[0])
+                        {
+                            printf("session resumed\n");
+                            numReconnects = 0;
+
+                            if(udpfd != -1)
+                                addMsg(udpSendBuf, Cmd::Bind, str(token));
+
+                            // the view isn't a part of the session
+                            if(digX != -1)
+                            {
+                                chunkVersions.clear();
+                                addMsg(sendBuf, Cmd::View, IntField{digX}, lit(" "),
+                                       IntField{digY});
+                            }
+                        }
+                        else
+                        {
+                            token[0] = '\0';
+                            addNameMsg(sendBuf, argv[1], roomName);
+                        }
+                        break;
+
+                    case Cmd::Chunk:
+                    case Cmd::TileDiff:
+                    {
+                        int cx, cy;
+                        unsigned version;
+                        const char* tiles;
+                        if(!parseChunkMsg(begin, cx, cy, version, tiles))
+                            break;
+
+                        int c = findChunk(chunkVersions, cx, cy);
+
+                        if(cmd == Cmd::Chunk)
+                        {
+                            if(c == -1)
+                            {
+                                c = chunkVersions.size();
+                                chunkVersions.pushBack(ChunkVersion{cx, cy, 0});
+                            }
+
+                            chunkVersions[c].version = version;
+                            ++numChunks;
+                            break;
+                        }
+
+                        // the CHNK will follow or the update is already in it
+                        if(c == -1 || version <= chunkVersions[c].version)
+                            break;
+
+                        ++numChunkDiffs;
+
+                        // e.g. the server dropped an update, all the chunks again
+                        if(version != chunkVersions[c].version + 1)
+                        {
+                            printf("chunk %d %d missed an update, requesting the view\n", cx,
+                                   cy);
+                            ++numChunkGaps;
+                            addMsg(sendBuf, Cmd::View, IntField{digX}, lit(" "),
+                                   IntField{digY});
+                        }
+
+                        chunkVersions[c].version = version;
+                        break;
+                    }
+
+                    case Cmd::Comp:
+                    {
+                        if(atoi(begin) != lzVersion)
+                        {
+                            printf("server refused compression\n");
+                            break;
+                        }
+
+                        // the rest of the stream is compressed
+                        compress = true;
+                        const int numRest = recvBuf.data() + recvBufNumUsed - end;
+
+                        // recv() needs free space
+                        if(wireBuf.size() <= numRest)
+                            wireBuf.resize(numRest + 500);
+
+                        memcpy(wireBuf.data(), end, numRest);
+                        wireBufNumUsed = numRest;
+                        recvBufNumUsed -= numRest;
                         break;
+                    }
                 }
+
+                // the rest was indexed before it turned out to be compressed
+                if(cmd == Cmd::Comp && compress)
+                    break;
             }
 
             const int numToFree = end - recvBuf.data();
@@ -356,6 +743,26 @@ int main(int argc, const char* const * const argv)
             else
                 sendBuf.erase(0, rc);
         }
+
+        // packed into as few datagrams as possible
+        if(!hasToReconnect && udpfd != -1 && udpSendBuf.size())
+        {
+            packetizer.pack(udpSendBuf.data(), udpSendBuf.size());
+
+            for(int d = 0; d < packetizer.getNumDatagrams(); ++d)
+            {
+                int size;
+                const char* const data = packetizer.getDatagram(d, size);
+
+                if(send(udpfd, data, size, 0) == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+                {
+                    perror("send() (UDP) failed");
+                    break;
+                }
+            }
+
+            udpSendBuf.clear();
+        }
         
         // sleep for 10 ms
         usleep(10000);
@@ -364,6 +771,22 @@ int main(int argc, const char* const * const argv)
     if(sockfd != -1)
         close(sockfd);
 
+    if(udpfd != -1)
+        close(udpfd);
+
+    if(printStats && (packetizer.numMsgs || fragStats.frags))
+    {
+        printf("UDP: %lld messages sent (%lld fragments), %lld fragments received "
+               "(%lld messages reassembled)\n", packetizer.numMsgs, packetizer.numFrags,
+               fragStats.frags, fragStats.reassembled);
+    }
+
+    if(printStats && digX != -1)
+    {
+        printf("tile map: %lld chunks, %lld updates, %lld version gaps\n", numChunks,
+               numChunkDiffs, numChunkGaps);
+    }
+
     printf("end of the main function\n");
     return 0;
 }
@@ -0,0 +1,2120 @@
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include "Array.hpp"
+#include "Capture.hpp"
+#include "Journal.hpp"
+#include "Protocol.hpp"
+#include "WebSocket.hpp"
+
+// load generator for the server
+// storm:   opens all connections at once and measures how fast the server accepts them
+//          (a connection counts as accepted when the server answers its PING)
+// players: keeps connected players chatting and answering PINGs for some time, reports
+//          disconnects (e.g. to check a hot upgrade of the server)
+// replay:  sends the frames of a capture (server -capture) with the original timing
+//          (scaled by -speed) or as fast as possible, reports throughput and PING latency
+// frames:  benchmarks the frame indexer against the memchr loop (no server needed)
+// recovery: all the players connect at once as after a server restart and retry with the
+//          client policy (backoff with jitter, BUSY hints) or the old fixed 5 s, reports
+//          the time until every player is back
+// transport: loopback TCP against AF_UNIX, round trip latency and throughput
+//          (no server needed, the peer is a forked process)
+// journal: append throughput of the journal (Journal.hpp) with the group commit, then the
+//          startup time (replay) of the log, the compaction and the startup after it
+//          (no server needed)
+// websocket: feeds valid and malformed browser frames to the frame decoder of the server,
+//          fails if a malformed one isn't rejected (no server needed)
+// slo:     chat delivery latency (sender -> server fanout -> every player in the room)
+//          for each player count and message rate, a fresh local server per step,
+//          fails if a percentile is over its threshold or a message is lost
+
+double getTimeSec()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+struct Options
+{
+    const char* host = "localhost";
+    const char* port = "3000";
+    int numClients = 1000;
+    float timeoutSec = 30.f;
+    float durationSec = 30.f;
+    float chatIntervalSec = 10.f;
+    const char* captureFile = nullptr;
+    float speed = 1.f; // 0 - as fast as possible
+    int numRooms = 1;  // players are spread over the rooms (1 - the lobby)
+    bool fixedRetry = false;
+    // slo
+    const char* serverPath = "./server"; // "-" - the running server at -host -port
+    const char* sloClients = "10,100,500";
+    const char* sloRates = "10,100"; // CHAT messages per second in the room
+    // a CHAT waits for a simulation tick (60 Hz) and a server loop iteration (10 ms)
+    float p50MaxMs = 40.f;
+    float p99MaxMs = 80.f;
+};
+
+enum class ConnState
+{
+    Connecting,
+    WaitPong,
+    Playing,
+    Done,
+    Failed,
+    Handshake, // NAME sent, waiting for TOKN or BUSY (slo: for the own join message)
+    Waiting    // for the next connection attempt
+};
+
+struct Conn
+{
+    int sockfd;
+    ConnState state;
+    double startTime;
+    double chatTime;
+    double retryTime;
+    int numRetries;
+};
+
+int compareFloat(const void* l, const void* r)
+{
+    const float a = *(const float*)l;
+    const float b = *(const float*)r;
+    return (a > b) - (a < b);
+}
+
+// samples get sorted
+float getPercentile(Array<float>& samples, float p)
+{
+    if(samples.empty())
+        return 0.f;
+
+    qsort(samples.data(), samples.size(), sizeof(float), compareFloat);
+    int idx = samples.size() * p;
+    if(idx >= samples.size())
+        idx = samples.size() - 1;
+
+    return samples[idx];
+}
+
+void printUsage()
+{
+    printf("usage: loadgen <mode> [options]\n"
+           "modes:\n"
+           "  storm               open all connections at once, report accepts per second\n"
+           "  players             keep the players chatting for -duration, report disconnects\n"
+           "  recovery            reconnect storm, report the time until all the players"
+                                   " are back\n"
+           "  replay              replay the -file capture, report throughput and latency\n"
+           "  frames              benchmark message framing of a receive buffer\n"
+           "  transport           benchmark loopback TCP against AF_UNIX stream sockets\n"
+           "  journal             benchmark the journal appends, replay and compaction\n"
+           "  websocket           check the WebSocket frame decoder against malformed frames\n"
+           "  slo                 chat delivery latency percentiles against the thresholds\n"
+           "options:\n"
+           "  -host <host>        default: localhost\n"
+           "  -port <port>        default: 3000\n"
+           "  -clients <n>        default: 1000\n"
+           "  -timeout <sec>      default: 30\n"
+           "  -duration <sec>     default: 30\n"
+           "  -chat <sec>         chat message interval per player, default: 10\n"
+           "  -file <capture>     capture written by the server (-capture), journal: the log"
+                                   " (overwritten)\n"
+           "  -speed <x>          replay speed, 0 - as fast as possible, default: 1\n"
+           "  -rooms <n>          players, recovery: players are spread over the rooms,"
+                                   " default: 1\n"
+           "  -retry <policy>     recovery: backoff (jitter and BUSY hints, the client) or"
+                                   " fixed (5 s)\n"
+           "  -server <path>      slo: server binary started for each step, - for the"
+                                   " running one, default: ./server\n"
+           "  -slo-clients <list> slo: player counts, default: 10,100,500\n"
+           "  -slo-rates <list>   slo: CHAT messages per second in the room, default: 10,100\n"
+           "  -p50 <ms>           slo: max median delivery latency, default: 40\n"
+           "  -p99 <ms>           slo: max 99th percentile delivery latency, default: 80\n"
+           "use -host 127.0.0.1 for more than ~28k clients (more source addresses)\n");
+}
+
+// returns false on invalid arguments
+bool parseArgs(int argc, const char* const * const argv, Options& options)
+{
+    for(int i = 2; i < argc; ++i)
+    {
+        const char* const arg = argv[i];
+        const char* const value = i + 1 < argc ? argv[i + 1] : nullptr;
+
+        if(strcmp(arg, "-host") == 0 && value)
+            options.host = value;
+        else if(strcmp(arg, "-port") == 0 && value)
+            options.port = value;
+        else if(strcmp(arg, "-clients") == 0 && value)
+            options.numClients = atoi(value);
+        else if(strcmp(arg, "-timeout") == 0 && value)
+            options.timeoutSec = atof(value);
+        else if(strcmp(arg, "-duration") == 0 && value)
+            options.durationSec = atof(value);
+        else if(strcmp(arg, "-chat") == 0 && value)
+            options.chatIntervalSec = atof(value);
+        else if(strcmp(arg, "-file") == 0 && value)
+            options.captureFile = value;
+        else if(strcmp(arg, "-speed") == 0 && value)
+            options.speed = atof(value);
+        else if(strcmp(arg, "-rooms") == 0 && value)
+            options.numRooms = atoi(value);
+        else if(strcmp(arg, "-retry") == 0 && value && (strcmp(value, "fixed") == 0 ||
+                                                        strcmp(value, "backoff") == 0))
+            options.fixedRetry = strcmp(value, "fixed") == 0;
+        else if(strcmp(arg, "-server") == 0 && value)
+            options.serverPath = value;
+        else if(strcmp(arg, "-slo-clients") == 0 && value)
+            options.sloClients = value;
+        else if(strcmp(arg, "-slo-rates") == 0 && value)
+            options.sloRates = value;
+        else if(strcmp(arg, "-p50") == 0 && value)
+            options.p50MaxMs = atof(value);
+        else if(strcmp(arg, "-p99") == 0 && value)
+            options.p99MaxMs = atof(value);
+        else
+        {
+            printf("invalid option: '%s'\n", arg);
+            return false;
+        }
+
+        ++i;
+    }
+
+    return options.numClients > 0 && options.speed >= 0.f && options.numRooms > 0;
+}
+
+// returns false if failed, if succeeded you have to free the list yourself
+bool resolve(const Options& options, addrinfo*& list)
+{
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    // this blocks
+    const int ec = getaddrinfo(options.host, options.port, &hints, &list);
+    if(ec != 0)
+    {
+        printf("getaddrinfo() failed: %s\n", gai_strerror(ec));
+        return false;
+    }
+
+    return true;
+}
+
+// returns socket descriptor, -1 if failed
+// sourceIdx >= 0 - on the IPv4 loopback the connection gets one of 250 source addresses,
+// one address has only ~28k ephemeral ports per server port
+int startConnect(const addrinfo& addr, int sourceIdx = -1)
+{
+    const int sockfd = socket(addr.ai_family, addr.ai_socktype | SOCK_NONBLOCK,
+                              addr.ai_protocol);
+    if(sockfd == -1)
+    {
+        perror("socket() failed");
+        return -1;
+    }
+
+    if(sourceIdx >= 0 && addr.ai_family == AF_INET &&
+       ntohl(((const sockaddr_in*)addr.ai_addr)->sin_addr.s_addr) >> 24 == 127)
+    {
+        sockaddr_in source = {};
+        source.sin_family = AF_INET;
+        source.sin_addr.s_addr = htonl((127 << 24) | (1 << 8) | (1 + sourceIdx % 250));
+
+        // the port is picked by connect() for the whole 4-tuple
+        const int option = 1;
+        setsockopt(sockfd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &option, sizeof(option));
+
+        if(bind(sockfd, (const sockaddr*)&source, sizeof(source)) == -1)
+            perror("bind() (source address) failed");
+    }
+
+    if(connect(sockfd, addr.ai_addr, addr.ai_addrlen) == -1 && errno != EINPROGRESS)
+    {
+        perror("connect() failed");
+        close(sockfd);
+        return -1;
+    }
+
+    return sockfd;
+}
+
+int runStorm(const Options& options)
+{
+    addrinfo* list;
+    if(!resolve(options, list))
+        return 1;
+
+    const int epollfd = epoll_create1(0);
+    if(epollfd == -1)
+    {
+        perror("epoll_create1() failed");
+        freeaddrinfo(list);
+        return 1;
+    }
+
+    Array<Conn> conns;
+    conns.resize(options.numClients);
+    int numDone = 0, numFailed = 0;
+    Array<float> latencies;
+    const double startTime = getTimeSec();
+    double lastDoneTime = startTime;
+
+    for(int i = 0; i < conns.size(); ++i)
+    {
+        Conn& conn = conns[i];
+        conn.startTime = getTimeSec();
+        conn.sockfd = startConnect(*list);
+        conn.state = ConnState::Connecting;
+
+        epoll_event event = {};
+        event.events = EPOLLOUT;
+        event.data.u32 = i;
+
+        if(conn.sockfd == -1 || epoll_ctl(epollfd, EPOLL_CTL_ADD, conn.sockfd, &event) == -1)
+        {
+            conn.state = ConnState::Failed;
+            ++numFailed;
+        }
+    }
+
+    freeaddrinfo(list);
+
+    while(numDone + numFailed < conns.size() && getTimeSec() - startTime < options.timeoutSec)
+    {
+        epoll_event events[256];
+        const int numEvents = epoll_wait(epollfd, events, 256, 100);
+
+        for(int e = 0; e < numEvents; ++e)
+        {
+            Conn& conn = conns[events[e].data.u32];
+
+            if(conn.state == ConnState::Connecting)
+            {
+                int error = 0;
+                socklen_t size = sizeof(error);
+                getsockopt(conn.sockfd, SOL_SOCKET, SO_ERROR, &error, &size);
+
+                const char msg[] = "PING ";
+                if(error || send(conn.sockfd, msg, sizeof(msg), MSG_NOSIGNAL) != sizeof(msg))
+                {
+                    conn.state = ConnState::Failed;
+                    ++numFailed;
+                    epoll_ctl(epollfd, EPOLL_CTL_DEL, conn.sockfd, nullptr);
+                    continue;
+                }
+
+                epoll_event event = {};
+                event.events = EPOLLIN;
+                event.data.u32 = events[e].data.u32;
+                epoll_ctl(epollfd, EPOLL_CTL_MOD, conn.sockfd, &event);
+                conn.state = ConnState::WaitPong;
+            }
+            else if(conn.state == ConnState::WaitPong)
+            {
+                char buf[256];
+                const int rc = recv(conn.sockfd, buf, sizeof(buf) - 1, 0);
+
+                if(rc <= 0)
+                {
+                    if(rc == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                        continue;
+
+                    conn.state = ConnState::Failed;
+                    ++numFailed;
+                    epoll_ctl(epollfd, EPOLL_CTL_DEL, conn.sockfd, nullptr);
+                    continue;
+                }
+
+                if(memmem(buf, rc, "PONG", 4))
+                {
+                    conn.state = ConnState::Done;
+                    ++numDone;
+                    lastDoneTime = getTimeSec();
+                    latencies.pushBack(lastDoneTime - conn.startTime);
+                    epoll_ctl(epollfd, EPOLL_CTL_DEL, conn.sockfd, nullptr);
+                }
+            }
+        }
+    }
+
+    const double time = lastDoneTime - startTime;
+    printf("clients:   %d\n", conns.size());
+    printf("accepted:  %d\n", numDone);
+    printf("failed:    %d\n", numFailed);
+    printf("timed out: %d\n", conns.size() - numDone - numFailed);
+    printf("time:      %.3f s\n", time);
+    printf("accepts/s: %.0f\n", time > 0.0 ? numDone / time : 0.0);
+    printf("connect to PONG p50: %.1f ms, p99: %.1f ms, max: %.1f ms\n",
+           getPercentile(latencies, 0.5f) * 1000.f, getPercentile(latencies, 0.99f) * 1000.f,
+           getPercentile(latencies, 1.f) * 1000.f);
+
+    for(Conn& conn: conns)
+    {
+        if(conn.sockfd != -1)
+            close(conn.sockfd);
+    }
+
+    close(epollfd);
+    return numDone == conns.size() ? 0 : 1;
+}
+
+int runPlayers(const Options& options)
+{
+    addrinfo* list;
+    if(!resolve(options, list))
+        return 1;
+
+    const int epollfd = epoll_create1(0);
+    if(epollfd == -1)
+    {
+        perror("epoll_create1() failed");
+        freeaddrinfo(list);
+        return 1;
+    }
+
+    Array<Conn> conns;
+    conns.resize(options.numClients);
+    // partial messages
+    Array<char>* const recvBufs = new Array<char>[conns.size()];
+    int numConnected = 0, numFailed = 0, numDisconnects = 0;
+    long long numChatsSent = 0, numChatsReceived = 0;
+    const double startTime = getTimeSec();
+
+    for(int i = 0; i < conns.size(); ++i)
+    {
+        Conn& conn = conns[i];
+        conn.startTime = getTimeSec();
+        // spread the chat messages over the interval
+        conn.chatTime = startTime + options.chatIntervalSec * i / conns.size();
+        conn.sockfd = startConnect(*list);
+        conn.state = ConnState::Connecting;
+
+        epoll_event event = {};
+        event.events = EPOLLOUT;
+        event.data.u32 = i;
+
+        if(conn.sockfd == -1 || epoll_ctl(epollfd, EPOLL_CTL_ADD, conn.sockfd, &event) == -1)
+        {
+            conn.state = ConnState::Failed;
+            ++numFailed;
+        }
+    }
+
+    freeaddrinfo(list);
+
+    while(getTimeSec() - startTime < options.durationSec)
+    {
+        epoll_event events[256];
+        const int numEvents = epoll_wait(epollfd, events, 256, 10);
+
+        for(int e = 0; e < numEvents; ++e)
+        {
+            const int idx = events[e].data.u32;
+            Conn& conn = conns[idx];
+
+            if(conn.state == ConnState::Connecting)
+            {
+                int error = 0;
+                socklen_t size = sizeof(error);
+                getsockopt(conn.sockfd, SOL_SOCKET, SO_ERROR, &error, &size);
+
+                char msg[64];
+                int len = snprintf(msg, sizeof(msg), "NAME lg%d", idx) + 1;
+
+                if(options.numRooms > 1)
+                    len += snprintf(msg + len, sizeof(msg) - len, "ROOM room%d",
+                                    idx % options.numRooms) + 1;
+
+                if(error || send(conn.sockfd, msg, len, MSG_NOSIGNAL) != len)
+                {
+                    conn.state = ConnState::Failed;
+                    ++numFailed;
+                    epoll_ctl(epollfd, EPOLL_CTL_DEL, conn.sockfd, nullptr);
+                    continue;
+                }
+
+                epoll_event event = {};
+                event.events = EPOLLIN;
+                event.data.u32 = idx;
+                epoll_ctl(epollfd, EPOLL_CTL_MOD, conn.sockfd, &event);
+                conn.state = ConnState::Playing;
+                ++numConnected;
+            }
+            else if(conn.state == ConnState::Playing)
+            {
+                Array<char>& buf = recvBufs[idx];
+                char data[4096];
+                const int rc = recv(conn.sockfd, data, sizeof(data), 0);
+
+                if(rc <= 0)
+                {
+                    if(rc == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                        continue;
+
+                    printf("player %d disconnected after %.3f s\n", idx,
+                           getTimeSec() - startTime);
+                    conn.state = ConnState::Failed;
+                    ++numDisconnects;
+                    epoll_ctl(epollfd, EPOLL_CTL_DEL, conn.sockfd, nullptr);
+                    continue;
+                }
+
+                const int prevSize = buf.size();
+                buf.resize(prevSize + rc);
+                memcpy(buf.data() + prevSize, data, rc);
+
+                const char* begin = buf.data();
+                const char* const end = buf.data() + buf.size();
+
+                while(const char* const msgEnd = (const char*)memchr(begin, '\0', end - begin))
+                {
+                    if(strncmp(begin, "PING", 4) == 0)
+                    {
+                        const char msg[] = "PONG ";
+                        send(conn.sockfd, msg, sizeof(msg), MSG_NOSIGNAL);
+                    }
+                    else if(strncmp(begin, "CHAT", 4) == 0)
+                        ++numChatsReceived;
+                    else if(strncmp(begin, "NAME", 4) == 0)
+                        printf("player %d: name already in use\n", idx);
+
+                    begin = msgEnd + 1;
+                }
+
+                buf.erase(0, begin - buf.data());
+            }
+        }
+
+        const double time = getTimeSec();
+
+        for(Conn& conn: conns)
+        {
+            if(conn.state != ConnState::Playing || time < conn.chatTime)
+                continue;
+
+            conn.chatTime += options.chatIntervalSec;
+            const char msg[] = "CHAT loadgen message";
+            if(send(conn.sockfd, msg, sizeof(msg), MSG_NOSIGNAL) == sizeof(msg))
+                ++numChatsSent;
+        }
+    }
+
+    printf("players:        %d\n", conns.size());
+    printf("connected:      %d\n", numConnected);
+    printf("failed:         %d\n", numFailed);
+    printf("disconnects:    %d\n", numDisconnects);
+    printf("chats sent:     %lld\n", numChatsSent);
+    printf("chats received: %lld\n", numChatsReceived);
+
+    for(Conn& conn: conns)
+    {
+        if(conn.sockfd != -1)
+            close(conn.sockfd);
+    }
+
+    delete[] recvBufs;
+    close(epollfd);
+    return numDisconnects == 0 && numFailed == 0 ? 0 : 1;
+}
+
+// closes the connection, the next attempt is scheduled by the retry policy
+void scheduleRetry(Conn& conn, const Options& options, float retryAfterSec, double time)
+{
+    if(conn.sockfd != -1)
+        close(conn.sockfd);
+
+    conn.sockfd = -1;
+    conn.state = ConnState::Waiting;
+
+    const float random = rand() / (RAND_MAX + 1.f);
+
+    // the old client
+    if(options.fixedRetry)
+        conn.retryTime = time + 5.0;
+    else if(retryAfterSec > 0.f)
+        conn.retryTime = time + retryAfterSec + getReconnectDelaySec(0, random);
+    else
+        conn.retryTime = time + getReconnectDelaySec(conn.numRetries, random);
+
+    ++conn.numRetries;
+}
+
+int runRecovery(const Options& options)
+{
+    addrinfo* list;
+    if(!resolve(options, list))
+        return 1;
+
+    const int epollfd = epoll_create1(0);
+    if(epollfd == -1)
+    {
+        perror("epoll_create1() failed");
+        freeaddrinfo(list);
+        return 1;
+    }
+
+    srand(time(nullptr) ^ getpid());
+
+    Array<Conn> conns;
+    conns.resize(options.numClients);
+    Array<char>* const recvBufs = new Array<char>[conns.size()];
+    Array<float> recoveryTimes;
+    Array<int> attemptsPerSec;
+    long long numAttempts = 0, numBusy = 0, numFailed = 0;
+    int numDisconnects = 0; // after the recovery
+    const double startTime = getTimeSec();
+    double printTime = startTime + 1.0;
+
+    // everyone at once, the server has just come back
+    for(Conn& conn: conns)
+    {
+        conn.sockfd = -1;
+        conn.state = ConnState::Waiting;
+        conn.retryTime = startTime;
+        conn.numRetries = 0;
+    }
+
+    while(recoveryTimes.size() < conns.size() && getTimeSec() - startTime < options.timeoutSec)
+    {
+        double time = getTimeSec();
+
+        for(int i = 0; i < conns.size(); ++i)
+        {
+            Conn& conn = conns[i];
+            if(conn.state != ConnState::Waiting || time < conn.retryTime)
+                continue;
+
+            const int sec = time - startTime;
+            while(attemptsPerSec.size() <= sec)
+                attemptsPerSec.pushBack(0);
+
+            ++attemptsPerSec[sec];
+            ++numAttempts;
+            conn.startTime = time;
+            conn.sockfd = startConnect(*list, i);
+            conn.state = ConnState::Connecting;
+            recvBufs[i].clear();
+
+            epoll_event event = {};
+            event.events = EPOLLOUT;
+            event.data.u32 = i;
+
+            if(conn.sockfd == -1 || epoll_ctl(epollfd, EPOLL_CTL_ADD, conn.sockfd, &event) == -1)
+            {
+                ++numFailed;
+                scheduleRetry(conn, options, 0.f, time);
+            }
+        }
+
+        epoll_event events[256];
+        const int numEvents = epoll_wait(epollfd, events, 256, 10);
+        time = getTimeSec();
+
+        for(int e = 0; e < numEvents; ++e)
+        {
+            const int idx = events[e].data.u32;
+            Conn& conn = conns[idx];
+
+            if(conn.state == ConnState::Connecting)
+            {
+                int error = 0;
+                socklen_t size = sizeof(error);
+                getsockopt(conn.sockfd, SOL_SOCKET, SO_ERROR, &error, &size);
+
+                Array<char> msgs;
+                char name[32];
+                snprintf(name, sizeof(name), "rc%d", idx);
+                addMsg(msgs, Cmd::Name, str(name));
+
+                if(options.numRooms > 1)
+                    addMsg(msgs, Cmd::Room, lit("room"), IntField{idx % options.numRooms});
+
+                if(error || send(conn.sockfd, msgs.data(), msgs.size(), MSG_NOSIGNAL) !=
+                            msgs.size())
+                {
+                    ++numFailed;
+                    scheduleRetry(conn, options, 0.f, time);
+                    continue;
+                }
+
+                epoll_event event = {};
+                event.events = EPOLLIN;
+                event.data.u32 = idx;
+                epoll_ctl(epollfd, EPOLL_CTL_MOD, conn.sockfd, &event);
+                conn.state = ConnState::Handshake;
+                continue;
+            }
+
+            if(conn.state != ConnState::Handshake && conn.state != ConnState::Playing)
+                continue;
+
+            Array<char>& buf = recvBufs[idx];
+            float retryAfterSec = 0.f;
+            bool closed = false;
+
+            while(true)
+            {
+                char data[4096];
+                const int rc = recv(conn.sockfd, data, sizeof(data), 0);
+
+                if(rc <= 0)
+                {
+                    closed = rc == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+                    break;
+                }
+
+                const int prevSize = buf.size();
+                buf.resize(prevSize + rc);
+                memcpy(buf.data() + prevSize, data, rc);
+            }
+
+            const char* begin = buf.data();
+            const char* const end = buf.data() + buf.size();
+
+            while(const char* const msgEnd = (const char*)memchr(begin, '\0', end - begin))
+            {
+                if(strncmp(begin, "PING", 4) == 0)
+                {
+                    const char msg[] = "PONG ";
+                    send(conn.sockfd, msg, sizeof(msg), MSG_NOSIGNAL);
+                }
+                else if(strncmp(begin, "BUSY", 4) == 0)
+                {
+                    retryAfterSec = atoi(begin + msgHeaderSize) / 1000.f;
+                    ++numBusy;
+                }
+                else if(strncmp(begin, "TOKN", 4) == 0 && conn.state == ConnState::Handshake)
+                {
+                    conn.state = ConnState::Playing;
+                    recoveryTimes.pushBack(time - startTime);
+                }
+                else if(strncmp(begin, "NAME", 4) == 0)
+                    printf("player %d: name already in use\n", idx);
+
+                begin = msgEnd + 1;
+            }
+
+            buf.erase(0, begin - buf.data());
+
+            if(closed)
+            {
+                if(conn.state == ConnState::Playing)
+                {
+                    // the report is about the first recovery
+                    printf("player %d disconnected after the recovery\n", idx);
+                    ++numDisconnects;
+                    close(conn.sockfd);
+                    conn.sockfd = -1;
+                    conn.state = ConnState::Failed;
+                }
+                else
+                {
+                    numFailed += retryAfterSec == 0.f;
+                    scheduleRetry(conn, options, retryAfterSec, time);
+                }
+            }
+        }
+
+        if(time >= printTime)
+        {
+            printTime += 1.0;
+            printf("%5.1f s: %d recovered, %lld attempts, %lld BUSY\n", time - startTime,
+                   recoveryTimes.size(), numAttempts, numBusy);
+        }
+    }
+
+    freeaddrinfo(list);
+
+    int peakAttempts = 0;
+    for(int n: attemptsPerSec)
+        peakAttempts = n > peakAttempts ? n : peakAttempts;
+
+    const int numRecovered = recoveryTimes.size();
+    printf("players:         %d (%s retry)\n", conns.size(),
+           options.fixedRetry ? "fixed 5 s" : "backoff");
+    printf("recovered:       %d\n", numRecovered);
+    printf("attempts:        %lld, peak %d/s\n", numAttempts, peakAttempts);
+    printf("BUSY:            %lld\n", numBusy);
+    printf("failed attempts: %lld (refused, reset, closed without BUSY)\n", numFailed);
+    printf("disconnects:     %d\n", numDisconnects);
+    printf("recovered 50%%: %.2f s, 90%%: %.2f s, 99%%: %.2f s",
+           getPercentile(recoveryTimes, 0.5f), getPercentile(recoveryTimes, 0.9f),
+           getPercentile(recoveryTimes, 0.99f));
+
+    if(numRecovered == conns.size())
+        printf(", all: %.2f s\n", getPercentile(recoveryTimes, 1.f));
+    else
+        printf(", all: not within %.0f s\n", options.timeoutSec);
+
+    for(Conn& conn: conns)
+    {
+        if(conn.sockfd != -1)
+            close(conn.sockfd);
+    }
+
+    delete[] recvBufs;
+    close(epollfd);
+    return numRecovered == conns.size() && numDisconnects == 0 ? 0 : 1;
+}
+
+struct ReplayConn
+{
+    int sockfd = -1;
+    bool connected = false;
+    bool closing = false; // closed in the capture, waits until sendBuf is flushed
+    Array<char> sendBuf;
+    Array<char> recvBuf;
+    Array<double> pingTimes; // PINGs waiting for PONG
+    int numPingsAnswered = 0;
+};
+
+// returns false if the connection has failed
+bool flushReplayConn(ReplayConn& conn, long long& numBytesSent)
+{
+    while(conn.connected && conn.sendBuf.size())
+    {
+        const int rc = send(conn.sockfd, conn.sendBuf.data(), conn.sendBuf.size(),
+                            MSG_NOSIGNAL);
+        if(rc == -1)
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+
+        conn.sendBuf.erase(0, rc);
+        numBytesSent += rc;
+    }
+
+    return true;
+}
+
+void closeReplayConn(ReplayConn& conn, int epollfd)
+{
+    epoll_ctl(epollfd, EPOLL_CTL_DEL, conn.sockfd, nullptr);
+    close(conn.sockfd);
+    conn.sockfd = -1;
+    conn.connected = false;
+}
+
+int runReplay(const Options& options)
+{
+    if(!options.captureFile)
+    {
+        printf("replay needs -file\n");
+        return 1;
+    }
+
+    const int fd = open(options.captureFile, O_RDONLY | O_CLOEXEC);
+    if(fd == -1)
+    {
+        perror("open() failed");
+        return 1;
+    }
+
+    struct stat st;
+    if(fstat(fd, &st) == -1 || st.st_size < int(sizeof(CaptureHeader)))
+    {
+        printf("'%s' is not a capture\n", options.captureFile);
+        close(fd);
+        return 1;
+    }
+
+    const long long fileSize = st.st_size;
+    // records are read in place, the kernel pages the file in ahead of us
+    const char* const data = (const char*)mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd,
+                                               0);
+    close(fd);
+
+    if(data == MAP_FAILED)
+    {
+        perror("mmap() failed");
+        return 1;
+    }
+
+    madvise((void*)data, fileSize, MADV_SEQUENTIAL);
+
+    CaptureHeader header;
+    memcpy(&header, data, sizeof(header));
+    if(memcmp(header.magic, captureMagic, sizeof(captureMagic)) != 0 ||
+       header.version != captureVersion)
+    {
+        printf("'%s' is not a capture (version %d)\n", options.captureFile, captureVersion);
+        munmap((void*)data, fileSize);
+        return 1;
+    }
+
+    addrinfo* list;
+    if(!resolve(options, list))
+    {
+        munmap((void*)data, fileSize);
+        return 1;
+    }
+
+    const int epollfd = epoll_create1(0);
+    if(epollfd == -1)
+    {
+        perror("epoll_create1() failed");
+        freeaddrinfo(list);
+        munmap((void*)data, fileSize);
+        return 1;
+    }
+
+    // capture connection id -> index in conns, -1 if not open
+    Array<int> connIdxs;
+    Array<ReplayConn*> conns;
+    int numOpen = 0, numFailed = 0, numDisconnects = 0;
+    long long numRecords = 0, numFramesSent = 0, numBytesSent = 0, numBytesRecv = 0;
+    long long numCorrupted = 0;
+    Array<float> latencies;
+    float maxLagSec = 0.f; // behind the capture timing
+    long long pos = sizeof(CaptureHeader);
+    long long firstTimeUs = -1, lastTimeUs = -1;
+    const double startTime = getTimeSec();
+    double endTime = 0.0;
+
+    while(true)
+    {
+        const double time = getTimeSec();
+
+        // feed the records that are due
+        for(int n = 0; n < 1024 && pos + int(sizeof(CaptureRecord)) <= fileSize; ++n)
+        {
+            CaptureRecord record;
+            memcpy(&record, data + pos, sizeof(record));
+
+            if(record.size < 0 || record.connId < 1 ||
+               pos + int(sizeof(record)) + record.size > fileSize)
+            {
+                ++numCorrupted;
+                pos = fileSize;
+                break;
+            }
+
+            if(firstTimeUs == -1)
+                firstTimeUs = record.timeUs;
+
+            if(options.speed > 0.f)
+            {
+                const double dueTime = startTime + (record.timeUs - firstTimeUs) / 1000000.0 /
+                                                   options.speed;
+                if(dueTime > time)
+                    break;
+
+                if(time - dueTime > maxLagSec)
+                    maxLagSec = time - dueTime;
+            }
+
+            lastTimeUs = record.timeUs;
+            const char* const frame = data + pos + sizeof(record);
+            pos += sizeof(record) + record.size;
+            ++numRecords;
+
+            while(connIdxs.size() <= record.connId)
+                connIdxs.pushBack(-1);
+
+            int& idx = connIdxs[record.connId];
+
+            if(record.event == int(CaptureEvent::Open))
+            {
+                if(idx != -1)
+                    continue;
+
+                ReplayConn* const conn = new ReplayConn;
+                conn->sockfd = startConnect(*list);
+
+                epoll_event event = {};
+                event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+                event.data.u32 = conns.size();
+
+                if(conn->sockfd == -1 ||
+                   epoll_ctl(epollfd, EPOLL_CTL_ADD, conn->sockfd, &event) == -1)
+                {
+                    if(conn->sockfd != -1)
+                        close(conn->sockfd);
+
+                    delete conn;
+                    ++numFailed;
+                    continue;
+                }
+
+                idx = conns.size();
+                conns.pushBack(conn);
+                ++numOpen;
+                continue;
+            }
+
+            if(idx == -1)
+                continue;
+
+            ReplayConn& conn = *conns[idx];
+
+            if(record.event == int(CaptureEvent::Frame))
+            {
+                const int prevSize = conn.sendBuf.size();
+                conn.sendBuf.resize(prevSize + record.size);
+                memcpy(conn.sendBuf.data() + prevSize, frame, record.size);
+                ++numFramesSent;
+
+                if(record.size >= 4 && strncmp(frame, "PING", 4) == 0)
+                    conn.pingTimes.pushBack(time);
+            }
+            else if(record.event == int(CaptureEvent::Close))
+            {
+                conn.closing = true;
+                idx = -1;
+            }
+
+            if(!flushReplayConn(conn, numBytesSent))
+            {
+                ++numFailed;
+                closeReplayConn(conn, epollfd);
+            }
+        }
+
+        epoll_event events[256];
+        const int numEvents = epoll_wait(epollfd, events, 256,
+                                         options.speed > 0.f || pos == fileSize ? 1 : 0);
+
+        for(int e = 0; e < numEvents; ++e)
+        {
+            ReplayConn& conn = *conns[events[e].data.u32];
+
+            if(conn.sockfd == -1)
+                continue;
+
+            if(!conn.connected && (events[e].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+            {
+                int error = 0;
+                socklen_t size = sizeof(error);
+                getsockopt(conn.sockfd, SOL_SOCKET, SO_ERROR, &error, &size);
+
+                if(error)
+                {
+                    ++numFailed;
+                    closeReplayConn(conn, epollfd);
+                    continue;
+                }
+
+                conn.connected = true;
+            }
+
+            while(events[e].events & EPOLLIN)
+            {
+                char buf[4096];
+                const int rc = recv(conn.sockfd, buf, sizeof(buf), 0);
+
+                if(rc == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                    break;
+
+                if(rc <= 0)
+                {
+                    if(!conn.closing)
+                        ++numDisconnects;
+
+                    closeReplayConn(conn, epollfd);
+                    break;
+                }
+
+                numBytesRecv += rc;
+                const int prevSize = conn.recvBuf.size();
+                conn.recvBuf.resize(prevSize + rc);
+                memcpy(conn.recvBuf.data() + prevSize, buf, rc);
+
+                const char* begin = conn.recvBuf.data();
+                const char* const end = begin + conn.recvBuf.size();
+
+                while(const char* const msgEnd = (const char*)memchr(begin, '\0', end - begin))
+                {
+                    // the capture has our PONGs too, but the timing can be scaled
+                    if(strncmp(begin, "PING", 4) == 0)
+                    {
+                        const char msg[] = "PONG ";
+                        const int prevSize = conn.sendBuf.size();
+                        conn.sendBuf.resize(prevSize + sizeof(msg));
+                        memcpy(conn.sendBuf.data() + prevSize, msg, sizeof(msg));
+                    }
+                    else if(strncmp(begin, "PONG", 4) == 0 &&
+                            conn.numPingsAnswered < conn.pingTimes.size())
+                    {
+                        latencies.pushBack(getTimeSec() -
+                                           conn.pingTimes[conn.numPingsAnswered]);
+                        ++conn.numPingsAnswered;
+                    }
+
+                    begin = msgEnd + 1;
+                }
+
+                conn.recvBuf.erase(0, begin - conn.recvBuf.data());
+            }
+
+            if(conn.sockfd != -1 && !flushReplayConn(conn, numBytesSent))
+            {
+                ++numFailed;
+                closeReplayConn(conn, epollfd);
+            }
+        }
+
+        // close the connections closed in the capture, count the unfinished ones
+        int numPending = 0;
+        for(ReplayConn* const conn: conns)
+        {
+            if(conn->sockfd == -1)
+                continue;
+
+            const bool done = conn->connected && conn->sendBuf.empty() &&
+                              conn->numPingsAnswered == conn->pingTimes.size();
+
+            if(conn->closing && done)
+                closeReplayConn(*conn, epollfd);
+            else if(!done)
+                ++numPending;
+        }
+
+        if(pos == fileSize)
+        {
+            if(endTime == 0.0)
+                endTime = getTimeSec();
+
+            // the last answers
+            if(!numPending || getTimeSec() - endTime > options.timeoutSec)
+                break;
+        }
+    }
+
+    const double replayTime = endTime - startTime;
+
+    printf("records:        %lld\n", numRecords);
+    printf("connections:    %d\n", numOpen);
+    printf("failed:         %d\n", numFailed);
+    printf("disconnects:    %d\n", numDisconnects);
+    printf("frames sent:    %lld\n", numFramesSent);
+    printf("bytes sent:     %lld\n", numBytesSent);
+    printf("bytes received: %lld\n", numBytesRecv);
+    printf("captured time:  %.3f s\n", (lastTimeUs - firstTimeUs) / 1000000.0);
+    printf("feed time:      %.3f s (max lag %.1f ms)\n", replayTime, maxLagSec * 1000.f);
+    printf("frames/s:       %.0f\n", replayTime > 0.0 ? numFramesSent / replayTime : 0.0);
+    printf("MB/s sent:      %.2f\n", replayTime > 0.0 ? numBytesSent / replayTime / 1e6 : 0.0);
+    printf("PING to PONG (%d) p50: %.1f ms, p99: %.1f ms, max: %.1f ms\n", latencies.size(),
+           getPercentile(latencies, 0.5f) * 1000.f, getPercentile(latencies, 0.99f) * 1000.f,
+           getPercentile(latencies, 1.f) * 1000.f);
+
+    if(numCorrupted)
+        printf("the capture is truncated or corrupted\n");
+
+    for(ReplayConn* const conn: conns)
+    {
+        if(conn->sockfd != -1)
+            close(conn->sockfd);
+
+        delete conn;
+    }
+
+    freeaddrinfo(list);
+    close(epollfd);
+    munmap((void*)data, fileSize);
+    return numFailed == 0 && numDisconnects == 0 && !numCorrupted ? 0 : 1;
+}
+
+// the commands the server dispatched on before Protocol.hpp (the order of Cmd)
+const char* const benchCmds[] = {"PING", "PONG", "NAME", "CHAT", "COMP", "TOKN", "RESM", "ACKN",
+                                 "ROOM"};
+constexpr int numBenchCmds = sizeof(benchCmds) / sizeof(benchCmds[0]);
+
+// the server loop before the frame indexer, returns a checksum
+// dispatch - match the commands too (otherwise only the message lengths are computed)
+long long frameMemchrLoop(const char* data, int size, bool dispatch)
+{
+    long long sum = 0;
+    const char* end = data;
+
+    while(const char* const tmp = (const char*)memchr(end, '\0', data + size - end))
+    {
+        const char* const begin = end;
+        end = tmp + 1;
+
+        if(!dispatch)
+        {
+            sum += strlen(begin);
+            continue;
+        }
+
+        for(int i = 0; i < numBenchCmds; ++i)
+        {
+            const int cmdLen = strlen(benchCmds[i]);
+
+            if(cmdLen > int(strlen(begin)))
+                continue;
+
+            if(strncmp(begin, benchCmds[i], cmdLen) == 0)
+            {
+                sum += i + 1;
+                break;
+            }
+        }
+    }
+
+    return sum + (end - data);
+}
+
+long long frameIndexLoop(const char* data, int size, bool dispatch, Array<Frame>& frames,
+                         int (*index)(const char*, int, Array<Frame>&))
+{
+    long long sum = index(data, size, frames);
+
+    // the server dispatcher
+    for(const Frame& frame: frames)
+        sum += dispatch ? parseMsg(data, frame).cmd : frame.size;
+
+    return sum;
+}
+
+int runFrames(const Options& options)
+{
+    // one receive buffer of small messages, -clients is the number of messages
+    Array<char> buf;
+    for(int i = 0; i < options.numClients; ++i)
+    {
+        char msg[64];
+        int len;
+
+        if(i % 4 == 0)
+            len = snprintf(msg, sizeof(msg), "CHAT message number %d", i);
+        else if(i % 4 == 1)
+            len = snprintf(msg, sizeof(msg), "ACKN %d", i);
+        else
+            len = snprintf(msg, sizeof(msg), "%s ", i % 4 == 2 ? "PING" : "PONG");
+
+        const int prevSize = buf.size();
+        buf.resize(prevSize + len + 1);
+        memcpy(buf.data() + prevSize, msg, len + 1);
+    }
+
+    // incomplete message at the end
+    buf.pushBack('C');
+
+    Array<Frame> frames;
+    const char* names[] = {"memchr loop", "indexer scalar", "indexer sse2", "indexer avx2"};
+    long long checksums[4] = {};
+    const float durationSec = options.durationSec < 1.f ? options.durationSec : 1.f;
+
+    for(int test = 0; test < 8; ++test)
+    {
+        const int variant = test % 4;
+        const bool dispatch = test >= 4;
+
+        if(variant == 0)
+            printf(dispatch ? "framing + command dispatch:\n" : "framing only:\n");
+
+#ifdef FRAME_INDEX_X86
+        if((variant == 2 && !__builtin_cpu_supports("sse2")) ||
+           (variant == 3 && !__builtin_cpu_supports("avx2")))
+            continue;
+#else
+        if(variant >= 2)
+            continue;
+#endif
+
+        long long sum = 0;
+        long long numRuns = 0;
+        const double startTime = getTimeSec();
+        double time;
+
+        do
+        {
+            for(int i = 0; i < 64; ++i)
+            {
+                // the buffer may have changed, the compiler can't hoist the work
+                asm volatile("" : : "r"(buf.data()) : "memory");
+
+                if(variant == 0)
+                    sum = frameMemchrLoop(buf.data(), buf.size(), dispatch);
+#ifdef FRAME_INDEX_X86
+                else if(variant == 2)
+                    sum = frameIndexLoop(buf.data(), buf.size(), dispatch, frames,
+                                         indexFramesSse2);
+                else if(variant == 3)
+                    sum = frameIndexLoop(buf.data(), buf.size(), dispatch, frames,
+                                         indexFramesAvx2);
+#endif
+                else
+                    sum = frameIndexLoop(buf.data(), buf.size(), dispatch, frames,
+                                         indexFramesScalar);
+            }
+
+            numRuns += 64;
+            time = getTimeSec() - startTime;
+        }
+        while(time < durationSec);
+
+        checksums[variant] = sum;
+        printf("  %-15s %8.2f GB/s %8.1f M msgs/s%s\n", names[variant],
+               buf.size() * numRuns / time / 1e9, options.numClients * numRuns / time / 1e6,
+               sum == checksums[0] ? "" : " (wrong result)");
+    }
+
+    printf("buffer: %d bytes, %d messages\n", buf.size(), options.numClients);
+    return 0;
+}
+
+// a masked frame with the payload length field as given (not necessarily valid), the payload
+// is zeroes
+void addRawWsFrame(Array<char>& buf, int len, unsigned long long extLen, int payloadSize)
+{
+    unsigned char h[14] = {0x80 | int(WsOpcode::Binary), (unsigned char)(0x80 | len)};
+    int headerSize = 2;
+
+    if(len == 126 || len == 127)
+    {
+        const int numBytes = len == 126 ? 2 : 8;
+        for(int i = 0; i < numBytes; ++i)
+            h[2 + i] = extLen >> (numBytes - 1 - i) * 8;
+
+        headerSize += numBytes;
+    }
+
+    headerSize += 4; // the mask key, 0
+    const int prevSize = buf.size();
+    buf.resize(prevSize + headerSize + payloadSize);
+    memcpy(buf.data() + prevSize, h, headerSize);
+    memset(buf.data() + prevSize + headerSize, 0, payloadSize);
+}
+
+int runWebSocket()
+{
+    struct Test
+    {
+        const char* name;
+        int len;
+        unsigned long long extLen;
+        int payloadSize;
+        bool valid;
+    };
+
+    const Test tests[] = {
+        {"7-bit length", 5, 0, 5, true},
+        {"16-bit length", 126, 200, 200, true},
+        {"64-bit length", 127, 70000, 0, false}, // over wsMaxFrameSize
+        {"64-bit length with the top bit", 127, 0xffffffffffffffffull, 64, false},
+        {"64-bit length with the top bit, small", 127, 0x8000000000000005ull, 64, false},
+        {"16-bit length under 126", 126, 5, 5, false},
+        {"64-bit length under 65536", 127, 200, 200, false}
+    };
+
+    int numFailed = 0;
+
+    for(const Test& test: tests)
+    {
+        // then a valid one, a negative length would move back into it
+        Array<char> buf;
+        const char msg[] = "PING ";
+        addRawWsFrame(buf, test.len, test.extLen, test.payloadSize);
+        addMaskedWsFrame(buf, WsOpcode::Text, msg, sizeof(msg) - 1, 0x12345678);
+
+        // room for the '\0' of the decoded messages
+        buf.resize(buf.size() + 64);
+        int numDecoded = 0;
+        Array<char> replies;
+        bool closed = false;
+        WsStats stats;
+        const int size = decodeWsFrames(buf.data(), numDecoded, buf.size() - 64, replies,
+                                        closed, stats);
+
+        // the zeroes (end with a '\0' already) and "PING \0"
+        const bool ok = test.valid ? size == test.payloadSize + 6 && numDecoded == size &&
+                                     memcmp(buf.data() + test.payloadSize, msg, 6) == 0
+                                   : size == -1;
+
+        printf("  %-40s %s\n", test.name, ok ? "ok" : "FAILED");
+        numFailed += !ok;
+    }
+
+    printf(numFailed ? "%d failed\n" : "all passed\n", numFailed);
+    return numFailed ? 1 : 0;
+}
+
+// returns false if failed
+bool openJournal(Journal& journal, const char* path, JournalState& state, double& openMs)
+{
+    const double startTime = getTimeSec();
+    const bool ok = journal.open(path, state);
+    openMs = (getTimeSec() - startTime) * 1000.0;
+    return ok;
+}
+
+// -clients is the number of profiles, the appends run for -duration (or until the log is
+// at 3/4 of the mapping), chat messages go to -rooms rooms
+int runJournal(const Options& options)
+{
+    const char* const path = options.captureFile ? options.captureFile : "loadgen-journal.log";
+    unlink(path);
+
+    Journal journal;
+    // only the explicit one
+    journal.compactIntervalSec = 1e9f;
+    JournalState state;
+    state.init(16 * 1024, 256);
+    double openMs;
+
+    if(!openJournal(journal, path, state, openMs))
+        return 1;
+
+    // a typical broadcast block of a room: a few CHAT messages
+    char msgs[256];
+    int msgsSize = 0;
+    for(int m = 0; m < 3; ++m)
+    {
+        msgsSize += snprintf(msgs + msgsSize, sizeof(msgs) - msgsSize,
+                             "CHAT player%d: message number %d of the benchmark", m, m) + 1;
+    }
+
+    const long long maxSize = journal.mapSize / 4 * 3;
+    long long numAdded = 0;
+    const double startTime = getTimeSec();
+    double time = 0.0;
+
+    while(time < options.durationSec && journal.getSize() < maxSize)
+    {
+        for(int k = 0; k < 1024; ++k, ++numAdded)
+        {
+            char name[journalNameSize];
+            snprintf(name, sizeof(name), "player%lld", numAdded / 10 % options.numClients);
+
+            // 8 chat blocks, a profile and a reservation in 10 records
+            const int kind = numAdded % 10;
+            if(kind < 8)
+            {
+                snprintf(name, sizeof(name), "room%lld", numAdded % options.numRooms);
+                journalChat(journal, state, name, msgs, msgsSize);
+            }
+            else if(kind == 8)
+            {
+                ProfileStats stats = state.getProfile(name).stats;
+                stats.lastSeen = numAdded;
+                stats.logins += 1;
+                journalProfile(journal, state, name, stats);
+            }
+            else
+                journalReservation(journal, state, name, numAdded, numAdded + 600);
+        }
+
+        journal.poll();
+        time = getTimeSec() - startTime;
+    }
+
+    // the last group commit
+    journal.close();
+    const double closeTime = getTimeSec() - startTime;
+    const JournalStats& stats = journal.stats;
+    const long long numSyncs = stats.syncs.load();
+    const long long logSize = journal.getSize();
+
+    printf("appends: %lld records (%lld dropped), %.1f MB in %.2f s, %.2f M records/s,"
+           " %.0f MB/s\n", journal.numRecords, journal.numDropped, journal.numBytes / 1e6,
+           time, journal.numRecords / time / 1e6, journal.numBytes / time / 1e6);
+    printf("  group commit: %lld msyncs, %lld records per msync, avg %lld us, max %lld us,"
+           " durable %.2f s after the start\n", numSyncs,
+           numSyncs ? stats.syncedRecords.load() / numSyncs : 0,
+           numSyncs ? stats.syncSumUs.load() / numSyncs : 0, stats.syncMaxUs.load(), closeTime);
+
+    if(!openJournal(journal, path, state, openMs))
+        return 1;
+
+    printf("startup: %lld records (%.1f MB) replayed in %.1f ms, %.0f MB/s, %d profiles\n",
+           journal.numRecovered, journal.recoveredBytes / 1e6, openMs,
+           journal.recoveredBytes / (openMs / 1000.0) / 1e6, state.getNumProfiles());
+
+    if(journal.numRecovered != journal.numRecords)
+        printf("  the log has lost records\n");
+
+    // after the replay of the writer
+    const double compactStartTime = getTimeSec();
+    journal.requestCompaction();
+    while(journal.stats.compactions.load() == 0)
+    {
+        journal.poll();
+        usleep(1000);
+    }
+
+    printf("compaction: %.1f MB -> %.1f MB in %.1f ms after the open (snapshot %.1f ms)\n",
+           logSize / 1e6, journal.getSize() / 1e6, (getTimeSec() - compactStartTime) * 1000.0,
+           journal.stats.compactMaxUs.load() / 1000.0);
+
+    journal.close();
+
+    if(!openJournal(journal, path, state, openMs))
+        return 1;
+
+    printf("startup after the compaction: %lld records (%.1f MB) replayed in %.1f ms,"
+           " %d profiles\n", journal.numRecovered, journal.recoveredBytes / 1e6, openMs,
+           state.getNumProfiles());
+
+    journal.close();
+    unlink(path);
+    return 0;
+}
+
+// connected stream sockets, bufSize 0 - the system default buffers
+// returns false if failed
+bool createPair(bool unix, int bufSize, int fds[2])
+{
+    if(unix)
+    {
+        if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) == -1)
+        {
+            perror("socketpair() failed");
+            return false;
+        }
+    }
+    else
+    {
+        // any port on the loopback interface
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t addrSize = sizeof(addr);
+
+        const int listenfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        fds[0] = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        fds[1] = -1;
+
+        // the accepted socket inherits the buffer sizes of the listener
+        if(bufSize)
+        {
+            setsockopt(listenfd, SOL_SOCKET, SO_RCVBUF, &bufSize, sizeof(bufSize));
+            setsockopt(listenfd, SOL_SOCKET, SO_SNDBUF, &bufSize, sizeof(bufSize));
+        }
+
+        if(listenfd == -1 || fds[0] == -1 ||
+           bind(listenfd, (const sockaddr*)&addr, sizeof(addr)) == -1 ||
+           getsockname(listenfd, (sockaddr*)&addr, &addrSize) == -1 ||
+           listen(listenfd, 1) == -1 ||
+           connect(fds[0], (const sockaddr*)&addr, sizeof(addr)) == -1 ||
+           (fds[1] = accept4(listenfd, nullptr, nullptr, SOCK_CLOEXEC)) == -1)
+        {
+            perror("loopback TCP connection failed");
+            close(listenfd);
+            close(fds[0]);
+            return false;
+        }
+
+        close(listenfd);
+
+        // as the server and the client do
+        const int option = 1;
+        setsockopt(fds[0], IPPROTO_TCP, TCP_NODELAY, &option, sizeof(option));
+        setsockopt(fds[1], IPPROTO_TCP, TCP_NODELAY, &option, sizeof(option));
+    }
+
+    if(bufSize)
+    {
+        setsockopt(fds[0], SOL_SOCKET, SO_RCVBUF, &bufSize, sizeof(bufSize));
+        setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &bufSize, sizeof(bufSize));
+        setsockopt(fds[1], SOL_SOCKET, SO_RCVBUF, &bufSize, sizeof(bufSize));
+        setsockopt(fds[1], SOL_SOCKET, SO_SNDBUF, &bufSize, sizeof(bufSize));
+    }
+
+    return true;
+}
+
+// returns false if the peer has closed the connection
+bool readAll(int sockfd, char* data, int size)
+{
+    while(size)
+    {
+        const int rc = read(sockfd, data, size);
+        if(rc <= 0)
+        {
+            if(rc == -1 && errno == EINTR)
+                continue;
+
+            return false;
+        }
+
+        data += rc;
+        size -= rc;
+    }
+    return true;
+}
+
+// the peer of runTransport(), echo == false - reads until EOF then writes the number
+// of bytes read
+void runTransportPeer(int sockfd, bool echo)
+{
+    static char buf[256 * 1024];
+    long long numRead = 0;
+
+    while(true)
+    {
+        const int rc = read(sockfd, buf, sizeof(buf));
+        if(rc <= 0)
+        {
+            if(rc == -1 && errno == EINTR)
+                continue;
+
+            break;
+        }
+
+        numRead += rc;
+
+        if(echo && write(sockfd, buf, rc) != rc)
+            break;
+    }
+
+    if(!echo && write(sockfd, &numRead, sizeof(numRead)) != sizeof(numRead))
+        perror("write() (transport peer) failed");
+}
+
+int runTransport(const Options& options)
+{
+    // same as the server (-unix-buf)
+    const int largeBufSize = 4 * 1024 * 1024;
+    const int msgSize = 64;          // a typical game message
+    const int chunkSize = 64 * 1024; // a bulk transfer write
+    const float durationSec = options.durationSec < 1.f ? options.durationSec : 1.f;
+
+    printf("%-30s %10s %10s %10s %12s\n", "", "rtt p50", "rtt p99", "rt/s", "throughput");
+
+    for(int test = 0; test < 4; ++test)
+    {
+        const bool unix = test >= 2;
+        const int bufSize = test % 2 ? largeBufSize : 0;
+        double rtPerSec = 0.0;
+        double bytesPerSec = 0.0;
+        Array<float> rttUs;
+
+        // ping-pong then streaming, a new connection and a new peer for each
+        for(int phase = 0; phase < 2; ++phase)
+        {
+            int fds[2];
+            if(!createPair(unix, bufSize, fds))
+                return 1;
+
+            const pid_t pid = fork();
+            if(pid == -1)
+            {
+                perror("fork() failed");
+                return 1;
+            }
+
+            if(pid == 0)
+            {
+                close(fds[0]);
+                runTransportPeer(fds[1], phase == 0);
+                _exit(0);
+            }
+
+            close(fds[1]);
+            const int sockfd = fds[0];
+            const double startTime = getTimeSec();
+            double time;
+
+            if(phase == 0)
+            {
+                char msg[msgSize] = {};
+                long long numRoundTrips = 0;
+
+                do
+                {
+                    const double sendTime = getTimeSec();
+                    if(write(sockfd, msg, msgSize) != msgSize || !readAll(sockfd, msg, msgSize))
+                    {
+                        printf("transport peer has failed\n");
+                        break;
+                    }
+
+                    time = getTimeSec();
+                    rttUs.pushBack((time - sendTime) * 1e6);
+                    ++numRoundTrips;
+                    time -= startTime;
+                }
+                while(time < durationSec);
+
+                rtPerSec = numRoundTrips / time;
+            }
+            else
+            {
+                static char chunk[chunkSize];
+                long long numSent = 0;
+
+                do
+                {
+                    const int rc = write(sockfd, chunk, chunkSize);
+                    if(rc <= 0)
+                    {
+                        if(rc == -1 && errno == EINTR)
+                            continue;
+
+                        printf("transport peer has failed\n");
+                        break;
+                    }
+
+                    numSent += rc;
+                }
+                while(getTimeSec() - startTime < durationSec);
+
+                // everything is received when the peer answers
+                long long numRecv = 0;
+                shutdown(sockfd, SHUT_WR);
+                readAll(sockfd, (char*)&numRecv, sizeof(numRecv));
+                time = getTimeSec() - startTime;
+                bytesPerSec = numRecv / time;
+
+                if(numRecv != numSent)
+                    printf("transport peer has received %lld of %lld bytes\n", numRecv, numSent);
+            }
+
+            close(sockfd);
+            waitpid(pid, nullptr, 0);
+        }
+
+        char name[64];
+        snprintf(name, sizeof(name), "%s, %s buffers", unix ? "AF_UNIX" : "loopback TCP",
+                 bufSize ? "4 MB" : "default");
+
+        // getPercentile() sorts, p99 is then a lookup
+        const float p50 = getPercentile(rttUs, 0.5f);
+        printf("%-30s %8.1fus %8.1fus %10.0f %7.2f GB/s\n", name, p50,
+               getPercentile(rttUs, 0.99f), rtPerSec, bytesPerSec / 1e9);
+    }
+
+    printf("round trip: %d byte messages, throughput: %d KB writes\n", msgSize,
+           chunkSize / 1024);
+    return 0;
+}
+
+// "10,100,500", returns false if empty or a value isn't positive
+bool parseList(const char* list, Array<float>& values)
+{
+    values.clear();
+
+    while(*list)
+    {
+        char* end;
+        const float value = strtof(list, &end);
+
+        if(end == list || value <= 0.f || (*end && *end != ','))
+            return false;
+
+        values.pushBack(value);
+        list = *end ? end + 1 : end;
+    }
+
+    return !values.empty();
+}
+
+// the server of one slo step, its stdout (a line per message) goes to /dev/null
+// returns the pid, -1 if failed
+pid_t startServer(const Options& options, int maxClients)
+{
+    char maxClientsStr[16];
+    snprintf(maxClientsStr, sizeof(maxClientsStr), "%d", maxClients);
+
+    const pid_t pid = fork();
+    if(pid == -1)
+    {
+        perror("fork() failed");
+        return -1;
+    }
+
+    if(pid == 0)
+    {
+        const int nullfd = open("/dev/null", O_WRONLY);
+        if(nullfd != -1)
+            dup2(nullfd, STDOUT_FILENO);
+
+        // the CHAT limit would measure the rate limiter instead of the fanout,
+        // the players connect at once
+        execl(options.serverPath, options.serverPath, "-port", options.port,
+              "-max-clients", maxClientsStr, "-udp-port", "0", "-admit", "0", "0",
+              "-rate", "CHAT", "0", "0", (char*)nullptr);
+        perror("execl() (server) failed");
+        _exit(1);
+    }
+
+    return pid;
+}
+
+// returns false if the server doesn't accept connections within the timeout
+bool waitForServer(const Options& options, const addrinfo& addr)
+{
+    const double startTime = getTimeSec();
+
+    while(getTimeSec() - startTime < options.timeoutSec)
+    {
+        const int sockfd = socket(addr.ai_family, addr.ai_socktype, addr.ai_protocol);
+        if(sockfd == -1)
+            break;
+
+        const bool ok = connect(sockfd, addr.ai_addr, addr.ai_addrlen) == 0;
+        close(sockfd);
+
+        if(ok)
+            return true;
+
+        usleep(10000);
+    }
+
+    printf("server at %s:%s is not accepting connections\n", options.host, options.port);
+    return false;
+}
+
+struct SloResult
+{
+    long long numSent = 0;
+    long long numExpected = 0; // one per player in the room at the send time
+    long long numDelivered = 0;
+    int numFailed = 0;         // players that couldn't join or were disconnected
+    Array<float> latenciesMs;
+};
+
+// all the players join the lobby, then they take turns sending timestamped CHATs at
+// the rate for -duration, every delivery is a latency sample
+// returns false if not all the players have joined
+bool runSloStep(const Options& options, const addrinfo& addr, int numPlayers, float rate,
+                SloResult& result)
+{
+    const int epollfd = epoll_create1(0);
+    if(epollfd == -1)
+    {
+        perror("epoll_create1() failed");
+        return false;
+    }
+
+    Array<Conn> conns;
+    conns.resize(numPlayers);
+    Array<char>* const recvBufs = new Array<char>[numPlayers];
+    int numJoined = 0;
+    const double startTime = getTimeSec();
+
+    for(int i = 0; i < conns.size(); ++i)
+    {
+        Conn& conn = conns[i];
+        conn.sockfd = startConnect(addr, i);
+        conn.state = ConnState::Connecting;
+
+        epoll_event event = {};
+        event.events = EPOLLOUT;
+        event.data.u32 = i;
+
+        if(conn.sockfd == -1 || epoll_ctl(epollfd, EPOLL_CTL_ADD, conn.sockfd, &event) == -1)
+        {
+            conn.state = ConnState::Failed;
+            ++result.numFailed;
+        }
+    }
+
+    // 0.0 - the players are joining
+    double sendStartTime = 0.0;
+    double nextSendTime = 0.0;
+    int nextSender = 0;
+    // time for the last messages to arrive
+    const float drainSec = 1.f;
+
+    while(true)
+    {
+        const double time = getTimeSec();
+
+        if(sendStartTime == 0.0)
+        {
+            if(numJoined + result.numFailed == numPlayers)
+            {
+                if(result.numFailed)
+                    break;
+
+                sendStartTime = nextSendTime = time;
+            }
+            else if(time - startTime > options.timeoutSec)
+            {
+                printf("%d of %d players have joined within %.0f s\n", numJoined, numPlayers,
+                       options.timeoutSec);
+                result.numFailed = numPlayers - numJoined;
+                break;
+            }
+        }
+        else if(time - sendStartTime >= options.durationSec &&
+                (result.numDelivered >= result.numExpected ||
+                 time - sendStartTime >= options.durationSec + drainSec))
+            break;
+
+        while(sendStartTime != 0.0 && time - sendStartTime < options.durationSec &&
+              time >= nextSendTime)
+        {
+            nextSendTime += 1.0 / rate;
+            Conn& conn = conns[nextSender];
+            nextSender = (nextSender + 1) % numPlayers;
+
+            if(conn.state != ConnState::Playing)
+                continue;
+
+            char msg[64];
+            const int len = snprintf(msg, sizeof(msg), "CHAT slo %lld",
+                                     (long long)(getTimeSec() * 1e6)) + 1;
+
+            if(send(conn.sockfd, msg, len, MSG_NOSIGNAL) == len)
+            {
+                result.numSent += 1;
+                result.numExpected += numPlayers - result.numFailed;
+            }
+        }
+
+        epoll_event events[256];
+        const int numEvents = epoll_wait(epollfd, events, 256, 1);
+
+        for(int e = 0; e < numEvents; ++e)
+        {
+            const int idx = events[e].data.u32;
+            Conn& conn = conns[idx];
+
+            if(conn.state == ConnState::Connecting)
+            {
+                int error = 0;
+                socklen_t size = sizeof(error);
+                getsockopt(conn.sockfd, SOL_SOCKET, SO_ERROR, &error, &size);
+
+                char msg[32];
+                const int len = snprintf(msg, sizeof(msg), "NAME slo%d", idx) + 1;
+
+                if(error || send(conn.sockfd, msg, len, MSG_NOSIGNAL) != len)
+                {
+                    conn.state = ConnState::Failed;
+                    ++result.numFailed;
+                    epoll_ctl(epollfd, EPOLL_CTL_DEL, conn.sockfd, nullptr);
+                    continue;
+                }
+
+                epoll_event event = {};
+                event.events = EPOLLIN;
+                event.data.u32 = idx;
+                epoll_ctl(epollfd, EPOLL_CTL_MOD, conn.sockfd, &event);
+                conn.state = ConnState::Handshake;
+                continue;
+            }
+
+            if(conn.state != ConnState::Handshake && conn.state != ConnState::Playing)
+                continue;
+
+            Array<char>& buf = recvBufs[idx];
+            char data[16 * 1024];
+            const int rc = recv(conn.sockfd, data, sizeof(data), 0);
+
+            if(rc <= 0)
+            {
+                if(rc == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                    continue;
+
+                printf("player %d disconnected\n", idx);
+                conn.state = ConnState::Failed;
+                ++result.numFailed;
+                epoll_ctl(epollfd, EPOLL_CTL_DEL, conn.sockfd, nullptr);
+                continue;
+            }
+
+            const double recvTime = getTimeSec();
+            const int prevSize = buf.size();
+            buf.resize(prevSize + rc);
+            memcpy(buf.data() + prevSize, data, rc);
+
+            const char* begin = buf.data();
+            const char* const end = buf.data() + buf.size();
+
+            while(const char* const msgEnd = (const char*)memchr(begin, '\0', end - begin))
+            {
+                if(strncmp(begin, "CHAT", 4) == 0)
+                {
+                    // "CHAT slo<sender>: slo <send time us>"
+                    const char* const stamp = strstr(begin, ": slo ");
+
+                    if(stamp && conn.state == ConnState::Playing)
+                    {
+                        const long long sendTimeUs = atoll(stamp + 6);
+                        result.latenciesMs.pushBack((recvTime * 1e6 - sendTimeUs) / 1000.0);
+                        result.numDelivered += 1;
+                    }
+                    else if(conn.state == ConnState::Handshake)
+                    {
+                        // the room is joined with the own join message
+                        char joined[64];
+                        snprintf(joined, sizeof(joined), "CHAT 'slo%d' has joined", idx);
+
+                        if(strncmp(begin, joined, strlen(joined)) == 0)
+                        {
+                            conn.state = ConnState::Playing;
+                            ++numJoined;
+                        }
+                    }
+                }
+                else if(strncmp(begin, "PING", 4) == 0)
+                {
+                    const char msg[] = "PONG ";
+                    send(conn.sockfd, msg, sizeof(msg), MSG_NOSIGNAL);
+                }
+                else if(strncmp(begin, "NAME", 4) == 0 || strncmp(begin, "BUSY", 4) == 0)
+                {
+                    printf("player %d was refused: '%s'\n", idx, begin);
+                    conn.state = ConnState::Failed;
+                    ++result.numFailed;
+                    epoll_ctl(epollfd, EPOLL_CTL_DEL, conn.sockfd, nullptr);
+                    break;
+                }
+
+                begin = msgEnd + 1;
+            }
+
+            buf.erase(0, begin - buf.data());
+        }
+    }
+
+    for(Conn& conn: conns)
+    {
+        if(conn.sockfd != -1)
+            close(conn.sockfd);
+    }
+
+    delete[] recvBufs;
+    close(epollfd);
+    return sendStartTime != 0.0;
+}
+
+int runSlo(const Options& options)
+{
+    Array<float> playerCounts, rates;
+    if(!parseList(options.sloClients, playerCounts) || !parseList(options.sloRates, rates))
+    {
+        printf("invalid -slo-clients or -slo-rates list\n");
+        return 1;
+    }
+
+    addrinfo* list;
+    if(!resolve(options, list))
+        return 1;
+
+    const bool startServers = strcmp(options.serverPath, "-") != 0;
+    bool passed = true;
+
+    printf("%8s %8s %9s %11s %6s %9s %9s %9s %9s %9s\n", "players", "rate/s", "sent",
+           "delivered", "lost", "p50 ms", "p90 ms", "p99 ms", "p99.9 ms", "max ms");
+
+    for(float players: playerCounts)
+    {
+        for(float rate: rates)
+        {
+            const int numPlayers = players;
+            pid_t pid = -1;
+
+            if(startServers)
+            {
+                pid = startServer(options, numPlayers + 16);
+                if(pid == -1)
+                {
+                    freeaddrinfo(list);
+                    return 1;
+                }
+            }
+
+            SloResult result;
+            const bool joined = waitForServer(options, *list) &&
+                                runSloStep(options, *list, numPlayers, rate, result);
+
+            if(pid != -1)
+            {
+                kill(pid, SIGINT);
+                waitpid(pid, nullptr, 0);
+            }
+
+            if(!joined)
+            {
+                printf("%8d %8.0f players could not join\n", numPlayers, rate);
+                passed = false;
+                continue;
+            }
+
+            // getPercentile() sorts, the rest are lookups
+            const float p50 = getPercentile(result.latenciesMs, 0.5f);
+            const float p99 = getPercentile(result.latenciesMs, 0.99f);
+            const long long numLost = result.numExpected - result.numDelivered;
+            const bool ok = p50 <= options.p50MaxMs && p99 <= options.p99MaxMs &&
+                            numLost <= 0 && result.numFailed == 0;
+
+            printf("%8d %8.0f %9lld %11lld %6lld %9.2f %9.2f %9.2f %9.2f %9.2f%s\n",
+                   numPlayers, rate, result.numSent, result.numDelivered, numLost, p50,
+                   getPercentile(result.latenciesMs, 0.9f), p99,
+                   getPercentile(result.latenciesMs, 0.999f),
+                   getPercentile(result.latenciesMs, 1.f), ok ? "" : "  FAIL");
+
+            passed = passed && ok;
+        }
+    }
+
+    freeaddrinfo(list);
+    printf("thresholds: p50 <= %.1f ms, p99 <= %.1f ms, no lost messages: %s\n",
+           options.p50MaxMs, options.p99MaxMs, passed ? "passed" : "FAILED");
+    return passed ? 0 : 1;
+}
+
+int main(int argc, const char* const * const argv)
+{
+    Options options;
+
+    if(argc < 2 || !parseArgs(argc, argv, options))
+    {
+        printUsage();
+        return 1;
+    }
+
+    // one descriptor per connection
+    {
+        rlimit limit;
+        if(getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+        {
+            limit.rlim_cur = limit.rlim_max;
+            if(setrlimit(RLIMIT_NOFILE, &limit) == -1)
+                perror("setrlimit() (RLIMIT_NOFILE) failed");
+        }
+    }
+
+    if(strcmp(argv[1], "storm") == 0)
+        return runStorm(options);
+
+    if(strcmp(argv[1], "players") == 0)
+        return runPlayers(options);
+
+    if(strcmp(argv[1], "recovery") == 0)
+        return runRecovery(options);
+
+    if(strcmp(argv[1], "replay") == 0)
+        return runReplay(options);
+
+    if(strcmp(argv[1], "frames") == 0)
+        return runFrames(options);
+
+    if(strcmp(argv[1], "transport") == 0)
+        return runTransport(options);
+
+    if(strcmp(argv[1], "journal") == 0)
+        return runJournal(options);
+
+    if(strcmp(argv[1], "websocket") == 0)
+        return runWebSocket();
+
+    if(strcmp(argv[1], "slo") == 0)
+        return runSlo(options);
+
+    printUsage();
+    return 1;
+}
@@ -11,11 +11,35 @@
 #include <signal.h>
 #include <time.h>
 #include <netinet/tcp.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <sys/random.h>
+#include <sys/un.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
 #include "Array.hpp"
+#include "Lz.hpp"
+#include "Protocol.hpp"
+#include "Packetizer.hpp"
+#include "WebSocket.hpp"
+#include "TileMap.hpp"
+#include "FdPassing.hpp"
+#include "MsgRing.hpp"
+#include "Capture.hpp"
+#include "Journal.hpp"
+#include "SpscQueue.hpp"
+#include "Broker.hpp"
+#include "BitSet.hpp"
+#include "Profiler.hpp"
+#include <thread>
+#include <atomic>
 
 template<typename T>
 T min(T l, T r) {return l > r ? r : l;}
 
+template<typename T>
+T max(T l, T r) {return l < r ? r : l;}
+
 double getTimeSec()
 {
     timespec ts;
@@ -31,508 +55,4088 @@ const void* get_in_addr(const sockaddr* const sa)
     return &( ( (sockaddr_in6*)sa )->sin6_addr );
 }
 
-struct Cmd
+// http response, not framed as a protocol message
+void addRawMsg(Array<char>& buffer, const char* text)
 {
-    enum
-    {
-        _nil,
-        Ping,
-        Pong,
-        Name,
-        Chat,
-        _count
-    };
+    const int len = strlen(text) + 1;
+    const int prevSize = buffer.size();
+    buffer.resize(prevSize + len);
+    memcpy(buffer.data() + prevSize, text, len);
+}
+
+// characters of a chat message taken from the player
+constexpr int maxChatSize = 500;
+
+// the protocol is the same over every transport
+enum class Transport
+{
+    Tcp,
+    Unix // co-located processes (bots, sidecars), can pass descriptors
+};
+
+enum class ClientStatus
+{
+    Waiting,
+    Browser,
+    Player,
+    PlayerRename
+};
+
+// the socket options follow the class of the connection
+enum class SocketClass
+{
+    Player,  // TCP connections that aren't browsers (also before NAME)
+    Browser, // one bulk reply
+    Bot,     // AF_UNIX connections
+    _count
+};
+
+constexpr const char* socketClassStrs[] = {"player", "browser", "bot"};
+
+inline SocketClass getSocketClass(ClientStatus status, Transport transport)
+{
+    if(transport == Transport::Unix)
+        return SocketClass::Bot;
+
+    return status == ClientStatus::Browser ? SocketClass::Browser : SocketClass::Player;
+}
+
+struct SocketProfile
+{
+    int bufSize = 0;          // SO_SNDBUF and SO_RCVBUF, 0 - kernel default (autotuned)
+    bool adaptiveBuf = false; // SO_SNDBUF from the measured throughput and RTT (TCP)
+    int notsentLowat = 0;     // TCP_NOTSENT_LOWAT, 0 - system default
+    int busyPollUs = 0;       // SO_BUSY_POLL, 0 - off
+    bool quickAck = false;    // TCP_QUICKACK after every receive (not sticky)
+};
+
+struct RateLimit
+{
+    float perSec; // <= 0 - unlimited
+    float burst;
+};
+
+struct TokenBucket
+{
+    float tokens;
+    double lastTime;
+};
+
+// refills lazily, returns false if the message has to be dropped
+bool takeToken(TokenBucket& bucket, const RateLimit& limit, double time)
+{
+    if(limit.perSec <= 0.f)
+        return true;
+
+    bucket.tokens = min(limit.burst, bucket.tokens + float(time - bucket.lastTime) *
+                                                     limit.perSec);
+    bucket.lastTime = time;
+
+    if(bucket.tokens < 1.f)
+        return false;
+
+    bucket.tokens -= 1.f;
+    return true;
+}
+
+// the state read by the phase loops is in HotClients
+struct Client
+{
+    char name[20] = "dummy";
+    bool alive = true;
+    int rateStrikes = 0; // rate limit violations in the current heartbeat period
+    TokenBucket buckets[Cmd::_count]; // Cmd::_nil is for unknown commands
+
+    // adaptive SO_SNDBUF (0 - not set), bytes sent since the last heartbeat
+    int sndBufSize = 0;
+    long long periodBytesSent = 0;
+
+    // frames of the send buffer (raw messages, LZ blocks after the first sendNumRaw
+    // bytes of a compressed client), the priority lane goes in after the frame at the
+    // head, sendHeadLeft - its unsent bytes (0 - the buffer begins with a frame)
+    int sendHeadLeft = 0;
+    int sendNumRaw = 0;
+
+    // WebSocket, the receive buffer begins with the unmasked messages of this many bytes,
+    // the frames follow
+    int wsNumDecoded = 0;
+
+    // the chunk of the tile map the view is centered on (with HotClients::viewing)
+    int viewX = 0;
+    int viewY = 0;
+
+    // session of a player, resumable with the token (0 - none) after the connection
+    // is lost, the session log keeps CHAT messages with
+    // sequence numbers (sessionLogBase, sessionSeq] until the client acks them
+    unsigned long long token = 0;
+    double detachTime;
+    long long sessionSeq = 0;
+    long long sessionLogBase = 0;
+
+    int captureId = 0; // 0 - not captured
+
+    // from the timestamps of our PINGs and the client's PONGs
+    LinkStats link;
+    double linkSampleTime = 0.0;
+    bool pinged = false; // in the current heartbeat period
+
+    // UDP peer of the player (after BIND), udpAddrSize 0 - not bound
+    sockaddr_storage udpAddr;
+    socklen_t udpAddrSize = 0;
+};
+
+// the per-iteration state of the clients as a structure of arrays indexed like clients,
+// the phase loops scan these (the flags a 64-bit word at a time) and read a Client
+// (a few hundred bytes) only when the client has something to do
+struct HotClients
+{
+    int* sockfds; // -1 - detached
+    Transport* transports;
+    ClientStatus* statuses;
+    int* rooms;
+    BitSet remove;
+    BitSet closeAfterSend; // browsers, removed after their reply is sent
+    BitSet detached;       // the connection was lost, the session is kept
+    BitSet compress;
+    BitSet congested;      // between the high and the low send watermark
+    BitSet replayHistory;  // send the chat history of the room
+    BitSet unsent;         // send buffer not empty after the send phase
+    BitSet websocket;      // browser players, see WebSocket.hpp
+    BitSet viewing;        // players that get the tile map updates (after VIEW)
+    BitSet staleView;      // tile messages were skipped while congested, resent when drained
+};
+
+void initHotClients(HotClients& hot, int maxClients)
+{
+    hot.sockfds = new int[maxClients];
+    hot.transports = new Transport[maxClients];
+    hot.statuses = new ClientStatus[maxClients];
+    hot.rooms = new int[maxClients];
+    hot.remove.init(maxClients);
+    hot.closeAfterSend.init(maxClients);
+    hot.detached.init(maxClients);
+    hot.compress.init(maxClients);
+    hot.congested.init(maxClients);
+    hot.replayHistory.init(maxClients);
+    hot.unsent.init(maxClients);
+    hot.websocket.init(maxClients);
+    hot.viewing.init(maxClients);
+    hot.staleView.init(maxClients);
+}
+
+void freeHotClients(HotClients& hot)
+{
+    delete[] hot.sockfds;
+    delete[] hot.transports;
+    delete[] hot.statuses;
+    delete[] hot.rooms;
+}
+
+// a new client at index i
+void resetHotClient(HotClients& hot, int i, int sockfd, Transport transport)
+{
+    hot.sockfds[i] = sockfd;
+    hot.transports[i] = transport;
+    hot.statuses[i] = ClientStatus::Waiting;
+    hot.rooms[i] = 0;
+    hot.remove.reset(i);
+    hot.closeAfterSend.reset(i);
+    hot.detached.reset(i);
+    hot.compress.reset(i);
+    hot.congested.reset(i);
+    hot.replayHistory.reset(i);
+    hot.unsent.reset(i);
+    hot.websocket.reset(i);
+    hot.viewing.reset(i);
+    hot.staleView.reset(i);
+}
+
+// the client at index from takes the index to, the swap-with-last removal
+void moveHotClient(HotClients& hot, int to, int from)
+{
+    hot.sockfds[to] = hot.sockfds[from];
+    hot.transports[to] = hot.transports[from];
+    hot.statuses[to] = hot.statuses[from];
+    hot.rooms[to] = hot.rooms[from];
+    hot.remove.move(to, from);
+    hot.closeAfterSend.move(to, from);
+    hot.detached.move(to, from);
+    hot.compress.move(to, from);
+    hot.congested.move(to, from);
+    hot.replayHistory.move(to, from);
+    hot.unsent.move(to, from);
+    hot.websocket.move(to, from);
+    hot.viewing.move(to, from);
+    hot.staleView.move(to, from);
+}
+
+// room 0 is the lobby, every player starts there
+struct Room
+{
+    char name[20];
+    char subscribed[20];  // room name subscribed at the broker, "" - none
+    bool used;
+    unsigned generation;  // changes when the slot is reused, see SimMsg::roomGen
+    int numPlayers;       // detached players included
+    int numBroadcastMsgs; // in the current iteration
 };
 
-const char* getCmdStr(int cmd)
+// returns the room index, -1 if not found
+int findRoom(const Array<Room>& rooms, const char* name)
 {
-    switch(cmd)
+    for(int i = 0; i < rooms.size(); ++i)
     {
-        case Cmd::Ping: return "PING";
-        case Cmd::Pong: return "PONG";
-        case Cmd::Name: return "NAME";
-        case Cmd::Chat: return "CHAT";
+        if(rooms[i].used && strcmp(rooms[i].name, name) == 0)
+            return i;
     }
-    assert(false);
+    return -1;
 }
 
-void addMsg(Array<char>& buffer, int cmd, const char* payload = "")
+// returns the room index, -1 if all the rooms are used
+int createRoom(Array<Room>& rooms, const char* name)
 {
-    if(cmd)
+    for(int i = 0; i < rooms.size(); ++i)
     {
-        const char* cmdStr = getCmdStr(cmd);
-        int len = strlen(cmdStr) + strlen(payload) + 2; // ' ' + '\0'
-        int prevSize = buffer.size();
-        buffer.resize(prevSize + len);
-        assert(snprintf(buffer.data() + prevSize, len, "%s %s", cmdStr, payload) == len - 1);
+        if(rooms[i].used)
+            continue;
+
+        Room& room = rooms[i];
+        room.used = true;
+        room.generation += 1;
+        room.numPlayers = 0;
+        room.numBroadcastMsgs = 0;
+        snprintf(room.name, sizeof(room.name), "%s", name);
+        return i;
     }
-    // special case for http response
-    else
+    return -1;
+}
+
+// frees the room (and its history) if it is empty
+void leaveRoom(Array<Room>& rooms, MsgRing* histories, int idx)
+{
+    Room& room = rooms[idx];
+    --room.numPlayers;
+
+    if(room.numPlayers == 0 && idx != 0)
     {
-        int len = strlen(payload) + 1;
-        int prevSize = buffer.size();
-        buffer.resize(prevSize + len);
-        memcpy(buffer.data() + prevSize, payload, len);
+        room.used = false;
+        histories[idx].clear();
     }
 }
 
-enum class ClientStatus
+// the journaled history of the room (if any) replaces its history
+void loadHistory(const JournalState& state, const char* room, MsgRing& history)
 {
-    Waiting,
-    Browser,
-    Player,
-    PlayerRename
-};
+    history.clear();
+    const MsgRing* const journaled = state.findHistory(room);
+    if(!journaled)
+        return;
 
-struct Client
+    iovec iov[2];
+    const int numSpans = journaled->getSpans(iov);
+    for(int s = 0; s < numSpans; ++s)
+        history.push((const char*)iov[s].iov_base, iov[s].iov_len);
+}
+
+int countMsgs(const char* msgs, int size)
 {
-    ClientStatus status = ClientStatus::Waiting;
-    char name[20] = "dummy";
-    int sockfd;
-    bool remove = false;
-    bool alive = true;
+    int numMsgs = 0;
+    for(int i = 0; i < size; ++i)
+        numMsgs += msgs[i] == '\0';
+
+    return numMsgs;
+}
+
+// players on the other nodes of the cluster
+struct PlayerName
+{
+    char name[20];
 };
 
-const char* getStatusStr(ClientStatus code)
+// the name is used by a player here
+bool isNameLocal(const Array<Client>& clients, const HotClients& hot, const char* name)
 {
-    switch(code)
+    for(int i = 0; i < clients.size(); ++i)
     {
-        case ClientStatus::Waiting: return "Waiting";
-        case ClientStatus::Browser: return "Browser";
-        case ClientStatus::Player:  return "Player";
-        case ClientStatus::PlayerRename: return "PlayerRename";
+        if(hot.statuses[i] == ClientStatus::Player && strcmp(clients[i].name, name) == 0)
+            return true;
     }
-    assert(false);
+
+    return false;
 }
 
-static volatile int gExitLoop = false;
-void sigHandler(int) {gExitLoop = true;}
+// the name is used by a player here or on another node
+bool isNameTaken(const Array<Client>& clients, const HotClients& hot,
+                 const Array<PlayerName>& remoteNames, const char* name)
+{
+    if(isNameLocal(clients, hot, name))
+        return true;
+
+    for(const PlayerName& remote: remoteNames)
+    {
+        if(strcmp(remote.name, name) == 0)
+            return true;
+    }
 
-int main()
+    return false;
+}
+
+// the rooms are subscribed in the next exchange, the names of the other nodes come
+// from the broker
+void openBroker(BrokerLink& broker, const char* addr, Array<Room>& rooms,
+                const Array<Client>& clients, const HotClients& hot,
+                Array<PlayerName>& remoteNames)
 {
-    signal(SIGINT, sigHandler);
-    signal(SIGTERM, sigHandler);
+    remoteNames.clear();
 
-    addrinfo hints = {};
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_flags = AI_PASSIVE;
+    if(!broker.open(addr))
+        return;
 
-    addrinfo* list;
+    printf("connected to the broker at %s\n", addr);
+
+    for(Room& room: rooms)
+        room.subscribed[0] = '\0';
+
+    // detached players keep their names
+    for(int i = 0; i < clients.size(); ++i)
     {
-        // this blocks
-        const int ec = getaddrinfo(nullptr, "3000", &hints, &list);
-        if(ec != 0)
-        {
-            printf("getaddrinfo() failed: %s\n", gai_strerror(ec));
-            return 0;
-        }
+        if(hot.statuses[i] == ClientStatus::Player)
+            broker.add(BrokerCmd::Claim, clients[i].name);
     }
+}
 
-    int sockfd;
+struct Config
+{
+    int maxClients = 1000;
+    int port = 3000;
+    int listenBacklog = 1024;
+    int deferAcceptSec = 0; // TCP_DEFER_ACCEPT, 0 - disabled
+    int handoffFd = -1;     // set in the process started by the hot upgrade
 
-    const addrinfo* it;
-    for(it = list; it != nullptr; it = it->ai_next)
+    Config()
     {
-        sockfd = socket(it->ai_family, it->ai_socktype, it->ai_protocol);
-        if(sockfd == -1)
+        rateLimits[Cmd::_nil] = {1.f, 5.f};
+        rateLimits[Cmd::Ping] = {2.f, 5.f};
+        rateLimits[Cmd::Pong] = {2.f, 5.f};
+        rateLimits[Cmd::Name] = {1.f, 3.f};
+        rateLimits[Cmd::Chat] = {5.f, 10.f};
+        rateLimits[Cmd::Comp] = {1.f, 3.f};
+        rateLimits[Cmd::Token] = {1.f, 3.f};
+        rateLimits[Cmd::Resume] = {1.f, 3.f};
+        rateLimits[Cmd::Ack] = {2.f, 5.f};
+        rateLimits[Cmd::Room] = {1.f, 3.f};
+        rateLimits[Cmd::Bind] = {1.f, 3.f};
+        rateLimits[Cmd::Pass] = {0.f, 0.f}; // a gateway hands over connections in bursts
+        rateLimits[Cmd::Busy] = {1.f, 3.f};
+        rateLimits[Cmd::Frag] = {1.f, 3.f}; // reassembled before the dispatch
+        rateLimits[Cmd::Tile] = {20.f, 40.f};
+        rateLimits[Cmd::View] = {5.f, 10.f};
+        rateLimits[Cmd::Chunk] = {1.f, 3.f};
+        rateLimits[Cmd::TileDiff] = {1.f, 3.f};
+
+        // fresh game state shouldn't wait behind older data in the kernel, the rest of
+        // a player's backlog stays in its send buffer (collapsed when congested)
+        SocketProfile& player = socketProfiles[int(SocketClass::Player)];
+        player.adaptiveBuf = true;
+        player.notsentLowat = 16 * 1024;
+
+        // bulk traffic of the sidecars without the TCP per-segment overhead
+        socketProfiles[int(SocketClass::Bot)].bufSize = 4 * 1024 * 1024;
+    }
+
+    // admission control, new connections over the rate (or over maxClients) get
+    // "BUSY <retry after ms>" and are closed, the hints are spread over the admission
+    // rate so the deferred players come back one by one instead of in a wave
+    // (0 - unlimited), at most listenBacklog connections are accepted per iteration
+    RateLimit admitLimit = {2000.f, 500.f};
+    float maxRetryAfterSec = 60.f;
+
+    // send buffer limits in bytes, above high watermark bulk messages are dropped and
+    // state messages are collapsed until the buffer drains below low watermark,
+    // above max size the client is disconnected
+    int sendLowWatermark = 16 * 1024;
+    int sendHighWatermark = 64 * 1024;
+    int sendMaxSize = 256 * 1024;
+
+    // every command (and its fanout) is limited per client, messages over the limit
+    // are dropped and cost penaltySec worth of tokens, with maxStrikes violations
+    // in a heartbeat period the client is disconnected (0 - never)
+    RateLimit rateLimits[Cmd::_count];
+    float ratePenaltySec = 1.f;
+    int rateMaxStrikes = 20;
+
+    // sessions of disconnected players are kept for sessionGraceSec (0 - no sessions),
+    // session logs (unacked messages) are limited to sessionLogMax bytes
+    float sessionGraceSec = 30.f;
+    int sessionLogMax = 64 * 1024;
+
+    // chat history memory is maxRooms * historySize
+    int maxRooms = 64;
+    int historySize = 16 * 1024;
+
+    // inbound frames of all the connections are appended to this file (nullptr - off)
+    const char* captureFile = nullptr;
+
+    // player profiles, name reservations and chat histories persist in this journal
+    // (Journal.hpp, nullptr - off), the name of a player who left is reserved for its
+    // session token for reserveNameSec
+    const char* journalFile = nullptr;
+    int reserveNameSec = 600;
+
+    // connections with traffic don't need a PING to prove they are alive, they get one
+    // only for a fresh RTT sample every rttRefreshSec
+    float rttRefreshSec = 30.f;
+
+    // AF_UNIX stream listener (nullptr - none), its connections are bots
+    const char* unixPath = nullptr;
+
+    // adaptive send buffers are sized for 2 * throughput * RTT within these
+    SocketProfile socketProfiles[int(SocketClass::_count)];
+    int minAdaptiveBuf = 16 * 1024;
+    int maxAdaptiveBuf = 4 * 1024 * 1024;
+
+    // datagrams of the players bound with their session token, -1 - the TCP port,
+    // 0 - TCP only
+    int udpPort = -1;
+
+    // the servers of a cluster exchange room broadcasts and player names through
+    // the broker (nullptr - standalone)
+    const char* brokerAddr = nullptr;
+
+    // simulation ticks per second, queue capacities are in commands / messages
+    float tickRate = 60.f;
+    int simQueueSize = 4096;
+
+    // the world is mapSize x mapSize chunks (TileMap.hpp), a player sees the chunks within
+    // viewRadius chunks of its view
+    int mapSize = 16;
+    int viewRadius = 2;
+    unsigned mapSeed = 1;
+
+    // spans of the loop phases and the command dispatch kept for the trace (0 - off),
+    // SIGUSR1 writes them to traceFile, GET /trace returns them
+    int profileSpans = 64 * 1024;
+    const char* traceFile = "cavetiles-trace.json";
+};
+
+void printUsage()
+{
+    printf("usage: server [options]\n"
+           "  -max-clients <n>\n"
+           "  -port <port>         TCP port, default: 3000\n"
+           "  -backlog <n>         listen() backlog\n"
+           "  -defer-accept <sec>  accept only connections that have sent data"
+                                   " (TCP_DEFER_ACCEPT)\n"
+           "  -send-low <bytes>    send buffer low watermark\n"
+           "  -send-high <bytes>   send buffer high watermark\n"
+           "  -send-max <bytes>    send buffer size at which the client is disconnected\n"
+           "  -rate <CMD> <per second> <burst>\n"
+           "                       token bucket for a command (UNKNOWN for unknown"
+                                   " commands, 0 - unlimited)\n"
+           "  -rate-penalty <sec>  tokens taken for a message over the limit\n"
+           "  -admit <per second> <burst>\n"
+           "                       admission rate of new connections (0 - unlimited), the"
+                                   " rest get BUSY\n"
+           "  -retry-max <sec>     max retry after hint sent with BUSY\n"
+           "  -rate-strikes <n>    violations per heartbeat period before disconnect"
+                                   " (0 - never)\n"
+           "  -session-grace <sec> keep sessions of disconnected players (0 - disabled)\n"
+           "  -session-log <bytes> unacked messages kept per session for the replay\n"
+           "  -max-rooms <n>\n"
+           "  -history <bytes>     chat history kept per room\n"
+           "  -capture <file>      append the received frames to the file"
+                                   " (for loadgen replay)\n"
+           "  -journal <file>      persist profiles, name reservations and chat history\n"
+           "  -reserve <sec>       name reservation of a player who left (with -journal)\n"
+           "  -rtt-refresh <sec>   PING interval for connections with traffic\n"
+           "  -udp-port <port>     UDP port for PING / PONG of the players (default: the TCP"
+                                   " port, 0 - disabled)\n"
+           "  -broker <addr>       join a cluster, socket path or [host:]port of the broker\n"
+           "  -unix <path>         also accept AF_UNIX connections (same protocol)\n"
+           "  -unix-buf <bytes>    socket buffer sizes of the AF_UNIX connections"
+                                   " (-sock bot buf)\n"
+           "  -sock <class> <option> <value>\n"
+           "                       socket profile of a connection class (player, browser,"
+                                   " bot), options:\n"
+           "                       buf <bytes> (0 - kernel default), adaptive <0|1>,"
+                                   " notsent-lowat <bytes>,\n"
+           "                       busy-poll <us>, quickack <0|1>\n"
+           "  -tick-rate <hz>      simulation ticks per second\n"
+           "  -sim-queue <n>       capacity of the simulation queues\n"
+           "  -map-size <chunks>   width and height of the world, chunks of 32 x 32 tiles\n"
+           "  -view-radius <n>     chunks a player sees around its view\n"
+           "  -map-seed <n>        of the generated cave\n"
+           "  -profile <spans>     spans kept by the loop profiler (0 - off)\n"
+           "  -trace-file <file>   written on SIGUSR1 (Chrome trace JSON)\n"
+           "  -handoff <fd>        (internal) take over from the running server\n"
+           "send SIGUSR2 to hand all the connections over to a new server process\n"
+           "send SIGUSR1 or GET /trace for the trace of the latest loop iterations\n");
+}
+
+// returns false on invalid arguments
+bool parseArgs(int argc, const char* const * const argv, Config& config)
+{
+    for(int i = 1; i < argc; ++i)
+    {
+        const char* const arg = argv[i];
+        const char* const value = i + 1 < argc ? argv[i + 1] : nullptr;
+
+        if(strcmp(arg, "-max-clients") == 0 && value)
+            config.maxClients = atoi(value);
+        else if(strcmp(arg, "-port") == 0 && value)
+            config.port = atoi(value);
+        else if(strcmp(arg, "-backlog") == 0 && value)
+            config.listenBacklog = atoi(value);
+        else if(strcmp(arg, "-defer-accept") == 0 && value)
+            config.deferAcceptSec = atoi(value);
+        else if(strcmp(arg, "-send-low") == 0 && value)
+            config.sendLowWatermark = atoi(value);
+        else if(strcmp(arg, "-send-high") == 0 && value)
+            config.sendHighWatermark = atoi(value);
+        else if(strcmp(arg, "-send-max") == 0 && value)
+            config.sendMaxSize = atoi(value);
+        else if(strcmp(arg, "-handoff") == 0 && value)
+            config.handoffFd = atoi(value);
+        else if(strcmp(arg, "-session-grace") == 0 && value)
+            config.sessionGraceSec = atof(value);
+        else if(strcmp(arg, "-session-log") == 0 && value)
+            config.sessionLogMax = atoi(value);
+        else if(strcmp(arg, "-max-rooms") == 0 && value)
+            config.maxRooms = atoi(value);
+        else if(strcmp(arg, "-history") == 0 && value)
+            config.historySize = atoi(value);
+        else if(strcmp(arg, "-journal") == 0 && value)
+            config.journalFile = value;
+        else if(strcmp(arg, "-reserve") == 0 && value)
+            config.reserveNameSec = atoi(value);
+        else if(strcmp(arg, "-capture") == 0 && value)
+            config.captureFile = value;
+        else if(strcmp(arg, "-profile") == 0 && value)
+            config.profileSpans = atoi(value);
+        else if(strcmp(arg, "-trace-file") == 0 && value)
+            config.traceFile = value;
+        else if(strcmp(arg, "-rtt-refresh") == 0 && value)
+            config.rttRefreshSec = atof(value);
+        else if(strcmp(arg, "-udp-port") == 0 && value)
+            config.udpPort = atoi(value);
+        else if(strcmp(arg, "-broker") == 0 && value)
+            config.brokerAddr = value;
+        else if(strcmp(arg, "-unix") == 0 && value)
+            config.unixPath = value;
+        else if(strcmp(arg, "-unix-buf") == 0 && value)
+            config.socketProfiles[int(SocketClass::Bot)].bufSize = atoi(value);
+        else if(strcmp(arg, "-sock") == 0 && i + 3 < argc)
         {
-            perror("socket() failed");
-            continue;
+            int sc = -1;
+            for(int c = 0; c < int(SocketClass::_count); ++c)
+            {
+                if(strcmp(value, socketClassStrs[c]) == 0)
+                    sc = c;
+            }
+
+            const char* const option = argv[i + 2];
+            const int optionValue = atoi(argv[i + 3]);
+            SocketProfile& profile = config.socketProfiles[sc == -1 ? 0 : sc];
+
+            if(sc == -1)
+            {
+                printf("invalid socket class: '%s'\n", value);
+                return false;
+            }
+            else if(strcmp(option, "buf") == 0)
+                profile.bufSize = optionValue;
+            else if(strcmp(option, "adaptive") == 0)
+                profile.adaptiveBuf = optionValue;
+            else if(strcmp(option, "notsent-lowat") == 0)
+                profile.notsentLowat = optionValue;
+            else if(strcmp(option, "busy-poll") == 0)
+                profile.busyPollUs = optionValue;
+            else if(strcmp(option, "quickack") == 0)
+                profile.quickAck = optionValue;
+            else
+            {
+                printf("invalid socket option: '%s'\n", option);
+                return false;
+            }
+
+            i += 2;
+        }
+        else if(strcmp(arg, "-tick-rate") == 0 && value)
+            config.tickRate = atof(value);
+        else if(strcmp(arg, "-sim-queue") == 0 && value)
+            config.simQueueSize = atoi(value);
+        else if(strcmp(arg, "-map-size") == 0 && value)
+            config.mapSize = atoi(value);
+        else if(strcmp(arg, "-view-radius") == 0 && value)
+            config.viewRadius = atoi(value);
+        else if(strcmp(arg, "-map-seed") == 0 && value)
+            config.mapSeed = strtoul(value, nullptr, 10);
+        else if(strcmp(arg, "-rate-penalty") == 0 && value)
+            config.ratePenaltySec = atof(value);
+        else if(strcmp(arg, "-rate-strikes") == 0 && value)
+            config.rateMaxStrikes = atoi(value);
+        else if(strcmp(arg, "-admit") == 0 && i + 2 < argc)
+        {
+            config.admitLimit.perSec = atof(value);
+            config.admitLimit.burst = atof(argv[i + 2]);
+            ++i;
         }
+        else if(strcmp(arg, "-retry-max") == 0 && value)
+            config.maxRetryAfterSec = atof(value);
+        else if(strcmp(arg, "-rate") == 0 && i + 3 < argc)
+        {
+            int cmd = -1;
+            for(int c = 1; c < Cmd::_count; ++c)
+            {
+                if(strcmp(value, getCmdStr(c)) == 0)
+                    cmd = c;
+            }
 
-        const int option = 1;
-        if(setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &option, sizeof(option)) == -1)
+            if(strcmp(value, "UNKNOWN") == 0)
+                cmd = Cmd::_nil;
+
+            if(cmd == -1)
+            {
+                printf("invalid command: '%s'\n", value);
+                return false;
+            }
+
+            config.rateLimits[cmd].perSec = atof(argv[i + 2]);
+            config.rateLimits[cmd].burst = atof(argv[i + 3]);
+            i += 2;
+        }
+        else
         {
-            close(sockfd);
-            perror("setsockopt() (SO_REUSEADDR) failed");
-            return 0;
+            printf("invalid option: '%s'\n", arg);
+            return false;
         }
 
-        if(fcntl(sockfd, F_SETFL, O_NONBLOCK) == -1)
+        ++i;
+    }
+
+    if(config.maxClients < 1 || config.maxRooms < 1)
+    {
+        printf("max clients and max rooms must be positive\n");
+        return false;
+    }
+
+    if(config.tickRate <= 0.f || config.simQueueSize < 1)
+    {
+        printf("tick rate and simulation queue size must be positive\n");
+        return false;
+    }
+
+    // 1 KB of tiles a chunk, 64 MB at most
+    if(config.mapSize < 1 || config.mapSize > 256 || config.viewRadius < 0)
+    {
+        printf("map size must be in [1, 256], view radius must not be negative\n");
+        return false;
+    }
+
+    if(config.sendLowWatermark > config.sendHighWatermark ||
+       config.sendHighWatermark > config.sendMaxSize)
+    {
+        printf("send watermarks must satisfy: low <= high <= max\n");
+        return false;
+    }
+
+    return true;
+}
+
+// simulation
+// the game logic runs in its own thread at a fixed rate, the I/O loop hands it parsed
+// game commands and takes the outbound messages, both through SPSC queues
+// (batched, once per loop iteration and once per tick)
+
+struct SimCmd
+{
+    int cmd;
+    int room;       // of the player when the command was received
+    unsigned roomGen; // Room::generation of the room
+    int lagUs;      // one way delay estimate, for lag compensation
+    long long recvUs; // monotonic, the loop iteration that has received the command
+    int client;     // index and session token of the player, for the replies only to it
+    unsigned long long token;
+    int args[4];    // TILE: x, y, type; VIEW: chunk x, y, the previous ones (-1 - none)
+    char name[20];
+    int payloadSize;
+    char payload[maxChatSize];
+};
+
+constexpr int maxSimMsgSize = maxChunkMsgSize > maxChatSize + 64 ? maxChunkMsgSize :
+                                                                   maxChatSize + 64;
+
+struct SimMsg
+{
+    int room;  // the message is broadcast to the room, -1 - tile map message
+    unsigned roomGen; // of the command, the room might have been freed and reused since
+    int chunk; // of a tile map message, it goes to the players that see the chunk
+    int client; // a reply only to this player (token 0 - none), the index is a hint
+    unsigned long long token;
+    int size;
+    char data[maxSimMsgSize]; // framed message
+};
+
+// written by the simulation thread, read by the metrics
+struct SimStats
+{
+    std::atomic<long long> ticks{0};
+    std::atomic<long long> overruns{0};   // ticks that started a whole period late
+    std::atomic<long long> jitterSumUs{0}; // tick start - scheduled start
+    std::atomic<long long> jitterMaxUs{0};
+    std::atomic<long long> tickMaxUs{0};   // duration of the longest tick
+    std::atomic<long long> msgsDropped{0}; // outbound queue was full
+    std::atomic<long long> tileEdits{0};
+    std::atomic<long long> tileEditsInvalid{0}; // out of the map
+    std::atomic<long long> chunkUpdates{0};     // dirty chunks, serialized once per tick
+    std::atomic<long long> chunkDiffs{0};       // updates sent as TDIF
+    std::atomic<long long> chunkSnapshots{0};   // CHNKs of the chunks coming into a view
+};
+
+struct Sim
+{
+    SpscQueue<SimCmd> cmds; // I/O loop -> simulation
+    SpscQueue<SimMsg> msgs; // simulation -> I/O loop
+    SimStats stats;
+    float tickRate;
+    int viewRadius;
+    TileMap map; // the simulation thread's while it runs
+    std::atomic<bool> stop{false};
+    std::thread thread;
+};
+
+long long getTimeUs()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+void updateMax(std::atomic<long long>& max, long long value)
+{
+    if(value > max.load(std::memory_order_relaxed))
+        max.store(value, std::memory_order_relaxed);
+}
+
+void addSimMsg(Array<SimMsg>& out, const Array<char>& data, int room, unsigned roomGen,
+               int chunk = -1, int client = -1, unsigned long long token = 0)
+{
+    assert(data.size() <= maxSimMsgSize);
+    out.resize(out.size() + 1);
+    SimMsg& msg = out.back();
+    msg.room = room;
+    msg.roomGen = roomGen;
+    msg.chunk = chunk;
+    msg.client = client;
+    msg.token = token;
+    msg.size = data.size();
+    memcpy(msg.data, data.data(), data.size());
+}
+
+// lag compensation, the edits of a tick are applied in the order the players made them
+// (received - one way delay), the latest one wins a tile even if it has arrived first
+struct TimedTileEdit
+{
+    long long issueUs;
+    int seq; // the order of arrival, for the same time
+    TileEdit edit;
+};
+
+int compareTimedTileEdits(const void* a, const void* b)
+{
+    const TimedTileEdit& l = *(const TimedTileEdit*)a;
+    const TimedTileEdit& r = *(const TimedTileEdit*)b;
+
+    if(l.issueUs != r.issueUs)
+        return l.issueUs < r.issueUs ? -1 : 1;
+
+    return l.seq - r.seq;
+}
+
+// the tile edits are collected for the batch at the end of the tick
+void simulate(const SimCmd& cmd, Sim& sim, Array<TimedTileEdit>& edits, Array<char>& scratch,
+              Array<SimMsg>& out)
+{
+    switch(cmd.cmd)
+    {
+        case Cmd::Chat:
         {
-            close(sockfd);
-            perror("fcntl() failed");
-            return 0;
+            scratch.clear();
+            addMsg(scratch, Cmd::Chat, str(cmd.name), lit(": "),
+                   StrField{cmd.payload, cmd.payloadSize});
+
+            addSimMsg(out, scratch, cmd.room, cmd.roomGen);
+            break;
         }
 
-        if(bind(sockfd, it->ai_addr, it->ai_addrlen) == -1)
+        case Cmd::Tile:
         {
-            close(sockfd);
-            perror("bind() failed");
-            continue;
+            edits.pushBack(TimedTileEdit{cmd.recvUs - cmd.lagUs, edits.size(),
+                                         TileEdit{cmd.args[0], cmd.args[1], cmd.args[2]}});
+            break;
         }
 
-        break;
+        // the chunks that come into the view, the updates of this tick follow them
+        case Cmd::View:
+        {
+            const TileMap& map = sim.map;
+            const int r = sim.viewRadius;
+            const int cx = cmd.args[0];
+            const int cy = cmd.args[1];
+
+            for(int y = max(cy - r, 0); y <= min(cy + r, map.getHeightChunks() - 1); ++y)
+            {
+                for(int x = max(cx - r, 0); x <= min(cx + r, map.getWidthChunks() - 1); ++x)
+                {
+                    if(cmd.args[2] != -1 && abs(x - cmd.args[2]) <= r &&
+                       abs(y - cmd.args[3]) <= r)
+                        continue;
+
+                    const int chunk = y * map.getWidthChunks() + x;
+                    scratch.clear();
+                    map.writeChunk(chunk, scratch);
+                    addSimMsg(out, scratch, -1, 0, chunk, cmd.client, cmd.token);
+                    sim.stats.chunkSnapshots.fetch_add(1, std::memory_order_relaxed);
+                }
+            }
+
+            break;
+        }
     }
-    freeaddrinfo(list);
+}
+
+// the dirty chunks are serialized once, the I/O loop copies them to the players
+void commitTileEdits(Sim& sim, Array<TimedTileEdit>& edits, Array<char>& scratch,
+                     Array<SimMsg>& out)
+{
+    TileMap& map = sim.map;
+    qsort(edits.data(), edits.size(), sizeof(TimedTileEdit), compareTimedTileEdits);
+
+    int numInvalid = 0;
+    for(const TimedTileEdit& e: edits)
+        numInvalid += !map.set(e.edit.x, e.edit.y, e.edit.tile);
+
+    sim.stats.tileEdits.fetch_add(edits.size() - numInvalid, std::memory_order_relaxed);
+    sim.stats.tileEditsInvalid.fetch_add(numInvalid, std::memory_order_relaxed);
+    edits.clear();
+
+    int numDiffs = 0;
+    for(int d = 0; d < map.getNumDirtyChunks(); ++d)
+    {
+        const int chunk = map.getDirtyChunk(d);
+        scratch.clear();
+        map.writeUpdate(chunk, scratch);
+        numDiffs += memcmp(scratch.data(), getCmdStr(Cmd::TileDiff), cmdSize) == 0;
+        addSimMsg(out, scratch, -1, 0, chunk);
+    }
+
+    sim.stats.chunkUpdates.fetch_add(map.getNumDirtyChunks(), std::memory_order_relaxed);
+    sim.stats.chunkDiffs.fetch_add(numDiffs, std::memory_order_relaxed);
+    map.clearDirty();
+}
+
+void runSim(Sim& sim)
+{
+    const long long periodUs = 1000000 / sim.tickRate;
+    long long nextUs = getTimeUs();
+    Array<SimCmd> cmds;
+    cmds.resize(256);
+    Array<SimMsg> out;
+    Array<char> scratch;
+    Array<TimedTileEdit> edits;
+
+    while(true)
+    {
+        // after the stop request the queued commands are still processed
+        const bool stopping = sim.stop.load(std::memory_order_acquire);
+
+        if(!stopping)
+        {
+            nextUs += periodUs;
+            const timespec ts = {time_t(nextUs / 1000000), long(nextUs % 1000000 * 1000)};
+            while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR)
+                ;
+        }
+
+        const long long startUs = getTimeUs();
+
+        if(!stopping)
+        {
+            const long long jitterUs = startUs - nextUs;
+            sim.stats.jitterSumUs.fetch_add(jitterUs, std::memory_order_relaxed);
+            updateMax(sim.stats.jitterMaxUs, jitterUs);
+
+            // don't try to catch up
+            if(jitterUs > periodUs)
+            {
+                sim.stats.overruns.fetch_add(1, std::memory_order_relaxed);
+                nextUs = startUs;
+            }
+        }
+
+        out.clear();
+        int numCmds;
+        while((numCmds = sim.cmds.pop(cmds.data(), cmds.size())))
+        {
+            for(int i = 0; i < numCmds; ++i)
+                simulate(cmds[i], sim, edits, scratch, out);
+        }
+
+        commitTileEdits(sim, edits, scratch, out);
+
+        const int numPushed = sim.msgs.push(out.data(), out.size());
+        sim.stats.msgsDropped.fetch_add(out.size() - numPushed, std::memory_order_relaxed);
+        sim.stats.ticks.fetch_add(1, std::memory_order_relaxed);
+        updateMax(sim.stats.tickMaxUs, getTimeUs() - startUs);
+
+        if(stopping)
+            break;
+    }
+}
+
+void startSim(Sim& sim)
+{
+    sim.stop.store(false);
+    sim.thread = std::thread(runSim, std::ref(sim));
+}
+
+// the simulation processes everything queued before it stops
+void stopSim(Sim& sim)
+{
+    sim.stop.store(true, std::memory_order_release);
+    sim.thread.join();
+}
+
+struct Metrics
+{
+    long long accepted = 0;
+    long long deferred = 0; // got BUSY
+    long long acceptedUnix = 0;
+    long long passedConns = 0; // received with SCM_RIGHTS
+    long long bytesSent = 0;
+    long long bytesRecv = 0;
+    long long lzBlocks = 0;    // compressor invocations
+    long long lzBytesIn = 0;   // per recipient, before compression
+    long long lzBytesOut = 0;  // per recipient, after compression
+    long long bpCongested = 0; // high watermark crossings
+    long long bpDroppedMsgs = 0;
+    long long bpDroppedBytes = 0;
+    long long bpCollapsed = 0; // state messages replaced by a newer one
+    long long bpDisconnects = 0;
+    long long rlDropped = 0;
+    long long rlDisconnects = 0;
+    long long sessionsDetached = 0;
+    long long sessionsResumed = 0;
+    long long sessionsExpired = 0;
+    long long sessionReplayedMsgs = 0;
+    long long sessionLogDropped = 0; // not acked and evicted from a full log
+    long long historyReplays = 0;
+    long long historyMsgs = 0;
+    long long captureFrames = 0;
+    long long captureBytes = 0; // written to the file
+    long long journalRecoveryMs = 0; // replay of the journal at startup
+    long long journalResumed = 0;    // sessions restored from the name reservations
+    long long simCmdsDropped = 0; // simulation queue was full
+    long long simMsgsStale = 0;   // for a room freed since the command
+    long long tileMsgsSent = 0;   // CHNK / TDIF, per player
+    long long tileBytesSent = 0;
+    long long tileMsgsSkipped = 0; // the player was congested
+    long long tileViewResends = 0; // of the skipped views, after the congestion
+    long long pingsSent = 0;
+    long long pingsSkipped = 0;   // the connection had traffic
+    long long udpRecv = 0;        // datagrams
+    long long udpSent = 0;
+    long long udpDropped = 0;     // unbound peer, incomplete message or not a UDP command
+    long long udpBinds = 0;
+    long long udpMsgsSent = 0;
+    long long udpBytesSent = 0;   // datagram payloads
+    long long udpFragsSent = 0;
+    FragStats udpFragsRecv;
+    long long udpSentPerSec = 0;  // datagrams, in the last heartbeat period
+    long long udpSentPeriodBase = 0;
+    long long brokerPublished = 0; // room broadcasts sent to the other nodes
+    long long brokerReceived = 0;  // from the other nodes
+    long long loops = 0;           // server loop iterations
+    long long loopBusyUs = 0;      // sum of the iteration times without the sleep
+    long long loopMaxUs = 0;
+    long long sockResizes = 0;      // adaptive SO_SNDBUF changes
+    long long sockQuickAcks = 0;
+    long long sockOptionErrors = 0; // failed setsockopt() calls
+    // TCP players sampled at the last heartbeat, the kernel queues are from SIOCOUTQ
+    // (unacked and unsent) and SIOCOUTQNSD (unsent)
+    long long sockSampled = 0;
+    long long sockSndBufSum = 0;
+    long long sockQueuedSum = 0;
+    long long sockUnsentSum = 0;
+    long long sockUnsentMax = 0;
+    long long prioBytes = 0;         // sent in the priority lane
+    long long prioBypassedBytes = 0; // queued bulk data the priority lane went ahead of
+    long long wsUpgrades = 0;
+    long long wsErrors = 0;     // protocol errors, the browser is removed
+    long long wsFramesSent = 0; // framed per room broadcast, not per recipient
+    WsStats wsRecv;
+};
+
+void addMetric(Array<char>& text, const char* name, long long value)
+{
+    char line[128];
+    const int len = snprintf(line, sizeof(line), "%s %lld\n", name, value);
+    const int prevSize = text.size();
+    text.resize(prevSize + len);
+    memcpy(text.data() + prevSize, line, len);
+}
+
+void writeMetrics(Array<char>& buffer, const Metrics& m, const SimStats& sim,
+                  const Array<Client>& clients, const HotClients& hot, const BrokerLink& broker,
+                  int numRemoteNames, const Journal& journal, const JournalState& journalState)
+{
+    Array<char> text;
+    addRawMsg(text, "HTTP/1.1 200 OK\r\n"
+                    "Content-Type: text/plain\r\n\r\n");
+    text.popBack(); // '\0'
+
+    addMetric(text, "accepted", m.accepted);
+    addMetric(text, "deferred", m.deferred);
+    addMetric(text, "accepted_unix", m.acceptedUnix);
+    addMetric(text, "passed_connections", m.passedConns);
+    addMetric(text, "bytes_sent", m.bytesSent);
+    addMetric(text, "bytes_recv", m.bytesRecv);
+    addMetric(text, "lz_blocks", m.lzBlocks);
+    addMetric(text, "lz_bytes_in", m.lzBytesIn);
+    addMetric(text, "lz_bytes_out", m.lzBytesOut);
+    addMetric(text, "lz_bytes_saved", m.lzBytesIn - m.lzBytesOut);
+    addMetric(text, "bp_congested", m.bpCongested);
+    addMetric(text, "bp_dropped_msgs", m.bpDroppedMsgs);
+    addMetric(text, "bp_dropped_bytes", m.bpDroppedBytes);
+    addMetric(text, "bp_collapsed", m.bpCollapsed);
+    addMetric(text, "bp_disconnects", m.bpDisconnects);
+    addMetric(text, "rl_dropped", m.rlDropped);
+    addMetric(text, "rl_disconnects", m.rlDisconnects);
+    addMetric(text, "sessions_detached", m.sessionsDetached);
+    addMetric(text, "sessions_resumed", m.sessionsResumed);
+    addMetric(text, "sessions_expired", m.sessionsExpired);
+    addMetric(text, "session_replayed_msgs", m.sessionReplayedMsgs);
+    addMetric(text, "session_log_dropped", m.sessionLogDropped);
+    addMetric(text, "history_replays", m.historyReplays);
+    addMetric(text, "history_msgs", m.historyMsgs);
+    addMetric(text, "capture_frames", m.captureFrames);
+    addMetric(text, "capture_bytes", m.captureBytes);
+
+    const JournalStats& js = journal.stats;
+    const long long numSyncs = js.syncs.load(std::memory_order_relaxed);
+    addMetric(text, "journal_open", journal.isOpen());
+    addMetric(text, "journal_records", journal.numRecords);
+    addMetric(text, "journal_bytes", journal.numBytes);
+    addMetric(text, "journal_dropped", journal.numDropped);
+    addMetric(text, "journal_unsynced_bytes", journal.isOpen() ? journal.getUnsyncedBytes() : 0);
+    addMetric(text, "journal_syncs", numSyncs);
+    addMetric(text, "journal_sync_avg_us", numSyncs ?
+              js.syncSumUs.load(std::memory_order_relaxed) / numSyncs : 0);
+    addMetric(text, "journal_sync_max_us", js.syncMaxUs.load(std::memory_order_relaxed));
+    // group commit, records made durable by one sync
+    addMetric(text, "journal_records_per_sync", numSyncs ?
+              js.syncedRecords.load(std::memory_order_relaxed) / numSyncs : 0);
+    addMetric(text, "journal_compactions", js.compactions.load(std::memory_order_relaxed));
+    addMetric(text, "journal_compact_max_us", js.compactMaxUs.load(std::memory_order_relaxed));
+    addMetric(text, "journal_log_bytes", journal.isOpen() ? journal.getSize() : 0);
+    addMetric(text, "journal_profiles", journalState.getNumProfiles());
+    addMetric(text, "journal_recovered_records", journal.numRecovered);
+    addMetric(text, "journal_recovered_bytes", journal.recoveredBytes);
+    addMetric(text, "journal_recovery_ms", m.journalRecoveryMs);
+    addMetric(text, "journal_resumed", m.journalResumed);
+    addMetric(text, "sim_cmds_dropped", m.simCmdsDropped);
+    addMetric(text, "sim_msgs_stale", m.simMsgsStale);
+
+    const long long numTicks = sim.ticks.load(std::memory_order_relaxed);
+    addMetric(text, "sim_ticks", numTicks);
+    addMetric(text, "sim_tick_overruns", sim.overruns.load(std::memory_order_relaxed));
+    addMetric(text, "sim_tick_jitter_avg_us", numTicks ?
+              sim.jitterSumUs.load(std::memory_order_relaxed) / numTicks : 0);
+    addMetric(text, "sim_tick_jitter_max_us", sim.jitterMaxUs.load(std::memory_order_relaxed));
+    addMetric(text, "sim_tick_max_us", sim.tickMaxUs.load(std::memory_order_relaxed));
+    addMetric(text, "sim_msgs_dropped", sim.msgsDropped.load(std::memory_order_relaxed));
+    addMetric(text, "tile_edits", sim.tileEdits.load(std::memory_order_relaxed));
+    addMetric(text, "tile_edits_invalid", sim.tileEditsInvalid.load(std::memory_order_relaxed));
+    addMetric(text, "tile_chunk_updates", sim.chunkUpdates.load(std::memory_order_relaxed));
+    addMetric(text, "tile_chunk_diffs", sim.chunkDiffs.load(std::memory_order_relaxed));
+    addMetric(text, "tile_chunk_snapshots", sim.chunkSnapshots.load(std::memory_order_relaxed));
+    addMetric(text, "tile_msgs_sent", m.tileMsgsSent);
+    addMetric(text, "tile_bytes_sent", m.tileBytesSent);
+    addMetric(text, "tile_msgs_skipped", m.tileMsgsSkipped);
+    addMetric(text, "tile_view_resends", m.tileViewResends);
+
+    addMetric(text, "pings_sent", m.pingsSent);
+    addMetric(text, "pings_skipped", m.pingsSkipped);
+    addMetric(text, "udp_datagrams_recv", m.udpRecv);
+    addMetric(text, "udp_datagrams_sent", m.udpSent);
+    addMetric(text, "udp_dropped", m.udpDropped);
+    addMetric(text, "udp_binds", m.udpBinds);
+    addMetric(text, "udp_msgs_sent", m.udpMsgsSent);
+    addMetric(text, "udp_bytes_sent", m.udpBytesSent);
+    addMetric(text, "udp_datagrams_sent_per_sec", m.udpSentPerSec);
+    addMetric(text, "udp_msgs_per_datagram_x100",
+              m.udpSent ? m.udpMsgsSent * 100 / m.udpSent : 0);
+    // with the IP and UDP headers
+    addMetric(text, "udp_wire_bytes_per_msg", m.udpMsgsSent ?
+              (m.udpBytesSent + m.udpSent * udpHeaderSize) / m.udpMsgsSent : 0);
+    addMetric(text, "udp_frags_sent", m.udpFragsSent);
+    addMetric(text, "udp_frags_recv", m.udpFragsRecv.frags);
+    addMetric(text, "udp_frags_reassembled", m.udpFragsRecv.reassembled);
+    addMetric(text, "udp_frags_invalid", m.udpFragsRecv.invalid);
+    addMetric(text, "broker_connected", broker.isOpen());
+    addMetric(text, "broker_published", m.brokerPublished);
+    addMetric(text, "broker_received", m.brokerReceived);
+    addMetric(text, "loops", m.loops);
+    addMetric(text, "loop_busy_us", m.loopBusyUs);
+    addMetric(text, "loop_max_us", m.loopMaxUs);
+    addMetric(text, "sock_resizes", m.sockResizes);
+    addMetric(text, "sock_quickacks", m.sockQuickAcks);
+    addMetric(text, "sock_option_errors", m.sockOptionErrors);
+    addMetric(text, "sock_sampled", m.sockSampled);
+    addMetric(text, "sock_sndbuf_avg_bytes",
+              m.sockSampled ? m.sockSndBufSum / m.sockSampled : 0);
+    addMetric(text, "sock_queued_avg_bytes",
+              m.sockSampled ? m.sockQueuedSum / m.sockSampled : 0);
+    addMetric(text, "sock_unsent_avg_bytes",
+              m.sockSampled ? m.sockUnsentSum / m.sockSampled : 0);
+    addMetric(text, "sock_unsent_max_bytes", m.sockUnsentMax);
+    addMetric(text, "prio_lane_bytes", m.prioBytes);
+    addMetric(text, "prio_lane_bypassed_bytes", m.prioBypassedBytes);
+    addMetric(text, "ws_upgrades", m.wsUpgrades);
+    addMetric(text, "ws_errors", m.wsErrors);
+    addMetric(text, "ws_frames_sent", m.wsFramesSent);
+    addMetric(text, "ws_frames_recv", m.wsRecv.frames);
+    addMetric(text, "ws_control_frames_recv", m.wsRecv.controlFrames);
+    addMetric(text, "ws_bytes_unmasked", m.wsRecv.bytes);
+    addMetric(text, "remote_players", numRemoteNames);
+
+    // over the connections with an estimate
+    int numLinks = 0;
+    double rttSum = 0.0, rttVarSum = 0.0;
+    float rttMax = 0.f, offsetMax = 0.f;
+
+    for(int i = 0; i < clients.size(); ++i)
+    {
+        const LinkStats& link = clients[i].link;
+        if(hot.detached.test(i) || !link.numSamples)
+            continue;
+
+        ++numLinks;
+        rttSum += link.rttUs;
+        rttVarSum += link.rttVarUs;
+        rttMax = link.rttUs > rttMax ? link.rttUs : rttMax;
+        const float offset = link.offsetUs < 0.f ? -link.offsetUs : link.offsetUs;
+        offsetMax = offset > offsetMax ? offset : offsetMax;
+    }
+
+    addMetric(text, "link_clients", numLinks);
+    addMetric(text, "link_rtt_avg_us", numLinks ? rttSum / numLinks : 0);
+    addMetric(text, "link_rtt_max_us", rttMax);
+    addMetric(text, "link_jitter_avg_us", numLinks ? rttVarSum / numLinks : 0);
+    addMetric(text, "link_clock_offset_max_us", offsetMax);
+
+    text.pushBack('\0');
+    addRawMsg(buffer, text.data());
+}
+
+void writeTrace(Array<char>& buffer, const Profiler& profiler)
+{
+    Array<char> text;
+    addRawMsg(text, "HTTP/1.1 200 OK\r\n"
+                    "Content-Type: application/json\r\n\r\n");
+    text.popBack(); // '\0'
+
+    profiler.writeTrace(text, getpid());
+    text.pushBack('\0');
+    addRawMsg(buffer, text.data());
+}
+
+// replaces the file, returns false if failed
+bool writeTraceFile(const char* filename, const Profiler& profiler)
+{
+    Array<char> trace;
+    profiler.writeTrace(trace, getpid());
+
+    const int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd == -1)
+    {
+        perror("open() (trace) failed");
+        return false;
+    }
+
+    int numWritten = 0;
+
+    while(numWritten < trace.size())
+    {
+        const int rc = write(fd, trace.data() + numWritten, trace.size() - numWritten);
+
+        if(rc == -1)
+        {
+            if(errno == EINTR)
+                continue;
+
+            perror("write() (trace) failed");
+            close(fd);
+            return false;
+        }
+
+        numWritten += rc;
+    }
+
+    close(fd);
+    return true;
+}
+
+// state messages (only the latest one matters) go to the priority lane, they are held
+// back while the client is congested, a newer message with the same cmd replaces the
+// pending one
+template<typename Field = StrField>
+void addStateMsg(Array<char>& prio, Array<char>& pending, bool congested, int cmd,
+                 Metrics& metrics, const Field& payload = lit(""))
+{
+    if(!congested)
+    {
+        addMsg(prio, cmd, payload);
+        return;
+    }
+
+    int begin = 0;
+
+    while(begin < pending.size())
+    {
+        const int len = strlen(pending.data() + begin) + 1;
+
+        if(memcmp(pending.data() + begin, getCmdStr(cmd), cmdSize) == 0)
+        {
+            pending.erase(begin, len);
+            metrics.bpCollapsed += 1;
+            break;
+        }
+
+        begin += len;
+    }
+
+    addMsg(pending, cmd, payload);
+}
+
+// a tile map message of the simulation goes to the players that see its chunk, a reply
+// only to the player that has sent the command (the index might have changed since)
+// a congested player gets none, only the latest state matters and its whole view is sent
+// again when it has drained
+void addTileMsg(const SimMsg& msg, const Array<Client>& clients, HotClients& hot,
+                Array<char>* sendBufs, const Config& config, Metrics& metrics)
+{
+    int first = 0;
+    int last = clients.size() - 1;
+
+    if(msg.token)
+    {
+        first = msg.client;
+        if(first >= clients.size() || clients[first].token != msg.token)
+        {
+            for(first = 0; first < clients.size(); ++first)
+            {
+                if(clients[first].token == msg.token)
+                    break;
+            }
+
+            if(first == clients.size())
+                return;
+        }
+
+        last = first;
+    }
+
+    const int cx = msg.chunk % config.mapSize;
+    const int cy = msg.chunk / config.mapSize;
+
+    for(int i = hot.viewing.findNext(first); i != -1 && i <= last;
+        i = hot.viewing.findNext(i + 1))
+    {
+        const Client& client = clients[i];
+
+        if(hot.statuses[i] != ClientStatus::Player || hot.remove.test(i) ||
+           abs(cx - client.viewX) > config.viewRadius ||
+           abs(cy - client.viewY) > config.viewRadius)
+            continue;
+
+        if(hot.congested.test(i))
+        {
+            hot.staleView.set(i);
+            metrics.tileMsgsSkipped += 1;
+            continue;
+        }
+
+        Array<char>& buf = sendBufs[i];
+        const int prevSize = buf.size();
+        buf.resize(prevSize + msg.size);
+        memcpy(buf.data() + prevSize, msg.data, msg.size);
+        metrics.tileMsgsSent += 1;
+        metrics.tileBytesSent += msg.size;
+    }
+}
+
+// returns the size of the first numMsgs messages
+int getMsgsSize(const Array<char>& buf, long long numMsgs)
+{
+    int pos = 0;
+    for(; numMsgs > 0 && pos < buf.size(); --numMsgs)
+        pos += strlen(buf.data() + pos) + 1;
+
+    return pos;
+}
+
+void addSessionLog(Client& client, Array<char>& log, const char* msgs, int size, int numMsgs,
+                   int maxSize, Metrics& metrics)
+{
+    const int prevSize = log.size();
+    log.resize(prevSize + size);
+    memcpy(log.data() + prevSize, msgs, size);
+    client.sessionSeq += numMsgs;
+
+    if(log.size() <= maxSize)
+        return;
+
+    int pos = 0;
+    int numDropped = 0;
+    while(log.size() - pos > maxSize)
+    {
+        pos += strlen(log.data() + pos) + 1;
+        ++numDropped;
+    }
+
+    log.erase(0, pos);
+    client.sessionLogBase += numDropped;
+    metrics.sessionLogDropped += numDropped;
+}
+
+// the client has received numReceived messages of the session
+void ackSessionLog(Client& client, Array<char>& log, long long numReceived)
+{
+    if(numReceived > client.sessionSeq)
+        numReceived = client.sessionSeq;
+
+    if(numReceived <= client.sessionLogBase)
+        return;
+
+    log.erase(0, getMsgsSize(log, numReceived - client.sessionLogBase));
+    client.sessionLogBase = numReceived;
+}
+
+// the player lost the connection but the session can be resumed
+bool willDetach(const Client& client, const HotClients& hot, int i, const Config& config)
+{
+    return hot.remove.test(i) && hot.statuses[i] == ClientStatus::Player && client.token &&
+           !hot.detached.test(i) && config.sessionGraceSec > 0.f;
+}
+
+// the player has taken the name, the name is reserved for the session (if any) so that
+// the player can resume it after a restart
+void journalLogin(Journal& journal, JournalState& state, const Client& client,
+                  const Config& config)
+{
+    const long long now = time(nullptr);
+    ProfileStats stats = state.getProfile(client.name).stats;
+    stats.firstSeen = stats.firstSeen ? stats.firstSeen : now;
+    stats.lastSeen = now;
+    stats.logins += 1;
+    journalProfile(journal, state, client.name, stats);
+
+    if(client.token)
+        journalReservation(journal, state, client.name, client.token, now + config.reserveNameSec);
+}
+
+// the player has left, the name stays reserved for the session for reserveNameSec
+void journalLeave(Journal& journal, JournalState& state, const Client& client,
+                  const Config& config)
+{
+    const long long now = time(nullptr);
+    ProfileStats stats = state.getProfile(client.name).stats;
+    stats.lastSeen = now;
+    journalProfile(journal, state, client.name, stats);
+
+    if(client.token)
+        journalReservation(journal, state, client.name, client.token, now + config.reserveNameSec);
+}
+
+unsigned long long createToken()
+{
+    unsigned long long token = 0;
+    while(token == 0)
+    {
+        if(getrandom(&token, sizeof(token), 0) != sizeof(token))
+            perror("getrandom() failed");
+    }
+
+    return token;
+}
+
+// compresses the raw messages queued after numWire (already on-the-wire bytes)
+void encodeSendBuf(Array<char>& buf, int numWire, LzEncoder& encoder, Array<char>& scratch,
+                   Metrics& metrics)
+{
+    const int rawSize = buf.size() - numWire;
+    if(!rawSize)
+        return;
+
+    scratch.resize(rawSize);
+    memcpy(scratch.data(), buf.data() + numWire, rawSize);
+    buf.resize(numWire);
+
+    metrics.lzBlocks += 1;
+    metrics.lzBytesIn += rawSize;
+    metrics.lzBytesOut += encoder.encode(scratch.data(), rawSize, buf);
+}
+
+// the frames of a send buffer: raw messages, then LZ blocks (after COMP) or WebSocket
+// frames (after the upgrade reply)
+enum class SendFraming
+{
+    Raw,
+    Lz,
+    WebSocket
+};
+
+// returns the end of the frame of the send buffer that begins at pos, the blocks begin
+// at blockBegin (the buffer size if none)
+int getFrameEnd(const Array<char>& buf, int pos, int blockBegin, SendFraming framing)
+{
+    if(pos >= blockBegin && framing == SendFraming::WebSocket)
+        return pos + getWsFrameSize(buf.data() + pos);
+
+    if(pos >= blockBegin)
+    {
+        const unsigned char* const header = (const unsigned char*)buf.data() + pos;
+        return pos + lzBlockHeaderSize + (header[0] | header[1] << 8);
+    }
+
+    // a browser reply has no '\0', it is one frame
+    const char* const end = (const char*)memchr(buf.data() + pos, '\0', blockBegin - pos);
+    return end ? end - buf.data() + 1 : blockBegin;
+}
+
+// queues the priority lane (raw messages) ahead of the bulk data of the send buffer,
+// behind the frame that has been partially sent, the lane is cleared
+void addPrioMsgs(Array<char>& buf, Array<char>& prio, Client& client, SendFraming framing,
+                 LzEncoder& encoder, Array<char>& scratch, Metrics& metrics)
+{
+    int pos = client.sendHeadLeft;
+    const char* data = prio.data();
+    int size = prio.size();
+
+    // compressed if it lands among the LZ blocks
+    if(framing == SendFraming::Lz && pos >= client.sendNumRaw)
+    {
+        scratch.clear();
+        metrics.lzBlocks += 1;
+        metrics.lzBytesIn += size;
+        metrics.lzBytesOut += encoder.encode(data, size, scratch);
+        data = scratch.data();
+        size = scratch.size();
+    }
+    else if(framing == SendFraming::Lz)
+        client.sendNumRaw += size;
+    else if(framing == SendFraming::WebSocket)
+    {
+        // the upgrade reply goes first
+        if(pos < client.sendNumRaw)
+            pos = client.sendNumRaw;
+
+        scratch.clear();
+        addWsFrame(scratch, WsOpcode::Binary, data, size);
+        data = scratch.data();
+        size = scratch.size();
+        metrics.wsFramesSent += 1;
+    }
+
+    metrics.prioBytes += size;
+    metrics.prioBypassedBytes += buf.size() - pos;
+
+    const int prevSize = buf.size();
+    buf.resize(prevSize + size);
+    memmove(buf.data() + pos + size, buf.data() + pos, prevSize - pos);
+    memcpy(buf.data() + pos, data, size);
+    prio.clear();
+}
+
+// erases the sent bytes of the send buffer, keeps track of the frame at the head
+void eraseSent(Array<char>& buf, int numSent, Client& client, SendFraming framing)
+{
+    const int blockBegin = framing != SendFraming::Raw ? client.sendNumRaw : buf.size();
+    int end = client.sendHeadLeft;
+
+    if(numSent == buf.size())
+        end = numSent;
+    else if(numSent > end && numSent <= blockBegin)
+    {
+        // raw messages end with '\0'
+        end = buf[numSent - 1] == '\0' ? numSent :
+                                         getFrameEnd(buf, numSent, blockBegin, framing);
+    }
+    else if(numSent > end)
+    {
+        // hop over the block headers
+        if(end < blockBegin)
+            end = blockBegin;
+
+        while(end < numSent)
+            end = getFrameEnd(buf, end, blockBegin, framing);
+    }
+
+    client.sendHeadLeft = end - numSent;
+    client.sendNumRaw = client.sendNumRaw > numSent ? client.sendNumRaw - numSent : 0;
+    buf.erase(0, numSent);
+}
+
+// wraps the raw messages queued after numWire (already on-the-wire bytes) in one
+// binary frame
+void frameSendBuf(Array<char>& buf, int numWire, Metrics& metrics)
+{
+    const int rawSize = buf.size() - numWire;
+    if(!rawSize)
+        return;
+
+    const int headerSize = getWsHeaderSize(rawSize, false);
+    buf.resize(buf.size() + headerSize);
+    memmove(buf.data() + numWire + headerSize, buf.data() + numWire, rawSize);
+    writeWsHeader(buf.data() + numWire, WsOpcode::Binary, rawSize);
+    metrics.wsFramesSent += 1;
+}
+
+SendFraming getSendFraming(const HotClients& hot, int i)
+{
+    if(hot.compress.test(i))
+        return SendFraming::Lz;
+
+    return hot.websocket.test(i) ? SendFraming::WebSocket : SendFraming::Raw;
+}
+
+const char* getStatusStr(ClientStatus code)
+{
+    switch(code)
+    {
+        case ClientStatus::Waiting: return "Waiting";
+        case ClientStatus::Browser: return "Browser";
+        case ClientStatus::Player:  return "Player";
+        case ClientStatus::PlayerRename: return "PlayerRename";
+    }
+    assert(false);
+}
+
+// returns listening socket descriptor, -1 if failed
+int createListener(const Config& config)
+{
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    char port[16];
+    snprintf(port, sizeof(port), "%d", config.port);
+
+    addrinfo* list;
+    {
+        // this blocks
+        const int ec = getaddrinfo(nullptr, port, &hints, &list);
+        if(ec != 0)
+        {
+            printf("getaddrinfo() failed: %s\n", gai_strerror(ec));
+            return -1;
+        }
+    }
+
+    int sockfd;
+
+    const addrinfo* it;
+    for(it = list; it != nullptr; it = it->ai_next)
+    {
+        sockfd = socket(it->ai_family, it->ai_socktype | SOCK_CLOEXEC, it->ai_protocol);
+        if(sockfd == -1)
+        {
+            perror("socket() failed");
+            continue;
+        }
+
+        const int option = 1;
+        if(setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &option, sizeof(option)) == -1)
+        {
+            close(sockfd);
+            perror("setsockopt() (SO_REUSEADDR) failed");
+            return -1;
+        }
+
+        if(fcntl(sockfd, F_SETFL, O_NONBLOCK) == -1)
+        {
+            close(sockfd);
+            perror("fcntl() failed");
+            return -1;
+        }
+
+        // inherited by the accepted sockets (no per client setsockopt())
+        if(setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &option, sizeof(option)) == -1)
+        {
+            close(sockfd);
+            perror("setsockopt() (TCP_NODELAY) failed");
+            return -1;
+        }
+
+        if(config.deferAcceptSec && setsockopt(sockfd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+                                               &config.deferAcceptSec,
+                                               sizeof(config.deferAcceptSec)) == -1)
+        {
+            close(sockfd);
+            perror("setsockopt() (TCP_DEFER_ACCEPT) failed");
+            return -1;
+        }
+
+        if(bind(sockfd, it->ai_addr, it->ai_addrlen) == -1)
+        {
+            close(sockfd);
+            perror("bind() failed");
+            continue;
+        }
+
+        break;
+    }
+    freeaddrinfo(list);
+
+    if(it == nullptr)
+    {
+        printf("binding procedure failed\n");
+        return -1;
+    }
+
+    if(listen(sockfd, config.listenBacklog) == -1)
+    {
+        perror("listen() failed");
+        close(sockfd);
+        return -1;
+    }
+
+    return sockfd;
+}
+
+// returns the listening socket descriptor, -1 if failed
+int createUnixListener(const Config& config)
+{
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+
+    if(strlen(config.unixPath) >= sizeof(addr.sun_path))
+    {
+        printf("unix socket path is too long: '%s'\n", config.unixPath);
+        return -1;
+    }
+
+    strcpy(addr.sun_path, config.unixPath);
+
+    const int sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(sockfd == -1)
+    {
+        perror("socket() (AF_UNIX) failed");
+        return -1;
+    }
+
+    // left by a previous run
+    unlink(config.unixPath);
+
+    if(bind(sockfd, (const sockaddr*)&addr, sizeof(addr)) == -1 ||
+       listen(sockfd, config.listenBacklog) == -1)
+    {
+        perror("bind() / listen() (AF_UNIX) failed");
+        close(sockfd);
+        return -1;
+    }
+
+    return sockfd;
+}
+
+struct Listener
+{
+    int sockfd; // -1 - not used
+    Transport transport;
+};
+
+// a connection before it becomes a client
+struct NewConn
+{
+    int sockfd;
+    Transport transport;
+};
+
+// sets the options of the class profile, the rest is inherited from the listener
+// (TCP_NODELAY), returns false if an option has failed
+bool setSocketOptions(int sockfd, Transport transport, const SocketProfile& profile)
+{
+    bool ok = true;
+
+    if(profile.bufSize &&
+       (setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &profile.bufSize,
+                   sizeof(profile.bufSize)) == -1 ||
+        setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &profile.bufSize,
+                   sizeof(profile.bufSize)) == -1))
+    {
+        perror("setsockopt() (socket buffers) failed");
+        ok = false;
+    }
+
+    if(transport != Transport::Tcp)
+        return ok;
+
+    // set even if 0, a connection can change its class (a browser was a player)
+    if(setsockopt(sockfd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &profile.notsentLowat,
+                  sizeof(profile.notsentLowat)) == -1)
+    {
+        perror("setsockopt() (TCP_NOTSENT_LOWAT) failed");
+        ok = false;
+    }
+
+    // raising it needs CAP_NET_ADMIN
+    if(setsockopt(sockfd, SOL_SOCKET, SO_BUSY_POLL, &profile.busyPollUs,
+                  sizeof(profile.busyPollUs)) == -1)
+    {
+        perror("setsockopt() (SO_BUSY_POLL) failed");
+        ok = false;
+    }
+
+    return ok;
+}
+
+// heartbeat of a TCP player, adapts its send buffer to 2 * throughput * RTT (a power
+// of 2, so it changes only on a real trend) and samples the kernel queues
+// the RTT is the kernel's estimate, PING / PONG includes the server loop
+void tuneSocket(int sockfd, Client& client, const SocketProfile& profile, float periodSec,
+                const Config& config, Metrics& metrics)
+{
+    const long long bytesPerSec = client.periodBytesSent / periodSec;
+    client.periodBytesSent = 0;
+
+    tcp_info info;
+    socklen_t infoSize = sizeof(info);
+
+    if(profile.adaptiveBuf &&
+       getsockopt(sockfd, IPPROTO_TCP, TCP_INFO, &info, &infoSize) == 0)
+    {
+        const long long bdp = bytesPerSec * info.tcpi_rtt / 1000000;
+        int size = config.minAdaptiveBuf;
+
+        while(size < 2 * bdp && size < config.maxAdaptiveBuf)
+            size *= 2;
+
+        if(size != client.sndBufSize)
+        {
+            if(setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)) == -1)
+                metrics.sockOptionErrors += 1;
+            else
+            {
+                client.sndBufSize = size;
+                metrics.sockResizes += 1;
+            }
+        }
+    }
+
+    int sndBuf = 0, queued = 0, unsent = 0;
+    socklen_t size = sizeof(sndBuf);
+
+    if(getsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &sndBuf, &size) == -1 ||
+       ioctl(sockfd, SIOCOUTQ, &queued) == -1 || ioctl(sockfd, SIOCOUTQNSD, &unsent) == -1)
+        return;
+
+    metrics.sockSampled += 1;
+    metrics.sockSndBufSum += sndBuf;
+    metrics.sockQueuedSum += queued;
+    metrics.sockUnsentSum += unsent;
+
+    if(unsent > metrics.sockUnsentMax)
+        metrics.sockUnsentMax = unsent;
+}
+
+// sends BUSY with the time of the next free admission slot and closes the connection
+// nextSlotTime - the virtual queue of the deferred connections
+void deferConn(int sockfd, double& nextSlotTime, const Config& config, double time)
+{
+    const float slotSec = config.admitLimit.perSec > 0.f ? 1.f / config.admitLimit.perSec :
+                                                            0.f;
+    if(nextSlotTime < time)
+        nextSlotTime = time;
+
+    nextSlotTime += slotSec;
+
+    if(nextSlotTime - time > config.maxRetryAfterSec)
+        nextSlotTime = time + config.maxRetryAfterSec;
+
+    // a full server (no admission limit) has no slots, 1 s and the client jitter
+    const float retryAfterSec = slotSec > 0.f ? nextSlotTime - time : 1.f;
+
+    char msg[32];
+    const int size = snprintf(msg, sizeof(msg), "%s %d", getCmdStr(Cmd::Busy),
+                              int(retryAfterSec * 1000.f)) + 1;
+
+    // unread data would make close() send RST and the peer could lose BUSY
+    // (the client sends its NAME right after connect)
+    send(sockfd, msg, size, MSG_NOSIGNAL | MSG_DONTWAIT);
+    shutdown(sockfd, SHUT_WR);
+
+    char buf[256];
+    while(recv(sockfd, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+        ;
+
+    close(sockfd);
+}
+
+// of a passed descriptor, returns false if it is not a stream socket
+bool getTransport(int sockfd, Transport& transport)
+{
+    int type;
+    socklen_t typeSize = sizeof(type);
+    sockaddr_storage addr;
+    socklen_t addrSize = sizeof(addr);
+
+    if(getsockopt(sockfd, SOL_SOCKET, SO_TYPE, &type, &typeSize) == -1 ||
+       type != SOCK_STREAM || getsockname(sockfd, (sockaddr*)&addr, &addrSize) == -1)
+        return false;
+
+    transport = addr.ss_family == AF_UNIX ? Transport::Unix : Transport::Tcp;
+    return true;
+}
+
+// returns the UDP socket descriptor, -1 if failed
+int createUdpSocket(const Config& config)
+{
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    char port[16];
+    snprintf(port, sizeof(port), "%d", config.udpPort == -1 ? config.port : config.udpPort);
+
+    addrinfo* list;
+    {
+        const int ec = getaddrinfo(nullptr, port, &hints, &list);
+        if(ec != 0)
+        {
+            printf("getaddrinfo() (UDP) failed: %s\n", gai_strerror(ec));
+            return -1;
+        }
+    }
+
+    int sockfd = -1;
+
+    for(const addrinfo* it = list; it != nullptr; it = it->ai_next)
+    {
+        sockfd = socket(it->ai_family, it->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                        it->ai_protocol);
+        if(sockfd == -1)
+        {
+            perror("socket() (UDP) failed");
+            continue;
+        }
+
+        if(bind(sockfd, it->ai_addr, it->ai_addrlen) == -1)
+        {
+            perror("bind() (UDP) failed");
+            close(sockfd);
+            sockfd = -1;
+            continue;
+        }
+
+        break;
+    }
+    freeaddrinfo(list);
+    return sockfd;
+}
+
+// datagram bytes queued per player and iteration, the rest is dropped
+// (the rate limits apply to the messages later)
+constexpr int maxUdpRecvSize = 16 * maxDatagramSize;
+
+bool isSameAddr(const sockaddr_storage& l, socklen_t lSize, const sockaddr_storage& r,
+                socklen_t rSize)
+{
+    return lSize == rSize && memcmp(&l, &r, lSize) == 0;
+}
+
+// returns the index of the player the datagram belongs to, -1 if none
+// a BIND with the session token binds the peer address (also after a NAT rebinding)
+int findUdpPeer(Array<Client>& clients, const HotClients& hot, const sockaddr_storage& addr,
+                socklen_t addrSize, const char* datagram)
+{
+    for(int i = 0; i < clients.size(); ++i)
+    {
+        const Client& client = clients[i];
+        if(!hot.detached.test(i) &&
+           isSameAddr(client.udpAddr, client.udpAddrSize, addr, addrSize))
+            return i;
+    }
+
+    if(strncmp(datagram, "BIND ", msgHeaderSize) != 0)
+        return -1;
+
+    const unsigned long long token = strtoull(datagram + msgHeaderSize, nullptr, 16);
+
+    for(int i = 0; token && i < clients.size(); ++i)
+    {
+        Client& client = clients[i];
+
+        if(client.token == token && hot.statuses[i] == ClientStatus::Player &&
+           !hot.detached.test(i) && !hot.remove.test(i))
+        {
+            memcpy(&client.udpAddr, &addr, addrSize);
+            client.udpAddrSize = addrSize;
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+// the messages go out packed into datagrams of at most maxDatagramSize bytes (larger
+// ones fragmented), whatever the kernel doesn't take is lost
+void sendDatagrams(int udpfd, const Client& client, const Array<char>& buf,
+                   Packetizer& packetizer, Metrics& metrics)
+{
+    const long long prevNumMsgs = packetizer.numMsgs;
+    const long long prevNumFrags = packetizer.numFrags;
+    packetizer.pack(buf.data(), buf.size());
+    metrics.udpMsgsSent += packetizer.numMsgs - prevNumMsgs;
+    metrics.udpFragsSent += packetizer.numFrags - prevNumFrags;
+
+    for(int d = 0; d < packetizer.getNumDatagrams(); ++d)
+    {
+        int size;
+        const char* const datagram = packetizer.getDatagram(d, size);
+        const int rc = sendto(udpfd, datagram, size, 0, (const sockaddr*)&client.udpAddr,
+                              client.udpAddrSize);
+
+        if(rc == -1)
+            metrics.udpDropped += 1;
+        else
+        {
+            metrics.udpSent += 1;
+            metrics.udpBytesSent += rc;
+        }
+    }
+}
+
+void initBuckets(Client& client, const Config& config, double time)
+{
+    for(int c = 0; c < Cmd::_count; ++c)
+        client.buckets[c] = {config.rateLimits[c].burst, time};
+}
+
+// hot upgrade
+// the running server starts a new process (argv[0], so the binary is read again from
+// the disk) and hands over the listening socket and all the clients through a socketpair:
+// [HandoffHeader + listening socket] [one byte + UDP socket (if HandoffHeader::udp)]
+// [one byte + AF_UNIX listening socket (if HandoffHeader::unix)]
+// then for every used room [HandoffRoom][history]
+// then the tile map [chunk versions][tiles] (HandoffHeader::mapSize)
+// and for every client
+// [HandoffClient + client socket][sendBuf][recvBuf][prioBuf][pendingStateBuf][sessionLog]
+// (detached players have no socket)
+// the new process answers with one byte when it has taken everything over
+
+constexpr int handoffVersion = 13;
+
+struct HandoffHeader
+{
+    int version;
+    int nextCaptureId;
+    int numRooms;
+    int numClients;
+    int mapSize;
+    float heartbeatTimer;
+    bool udp;
+    bool unixListener;
+};
+
+struct HandoffRoom
+{
+    int idx;
+    char name[20];
+    int numPlayers;
+    int historySize;
+};
+
+struct HandoffClient
+{
+    ClientStatus status;
+    Transport transport;
+    char name[20];
+    bool alive;
+    bool compress;
+    bool congested;
+    bool detached;
+    bool websocket;
+    bool viewing;
+    bool staleView;
+    bool replayHistory;
+    int viewX;
+    int viewY;
+    unsigned long long token;
+    double detachTime;
+    long long sessionSeq;
+    long long sessionLogBase;
+    int room;
+    int captureId;
+    sockaddr_storage udpAddr;
+    socklen_t udpAddrSize;
+    int sendBufSize;
+    int sendBufNumWire;
+    int sendHeadLeft;
+    int sendNumRaw;
+    int recvBufNumUsed;
+    int wsNumDecoded;
+    int prioBufSize;
+    int pendingStateBufSize;
+    int sessionLogSize;
+};
+
+// returns the socket for the handoff, -1 if failed
+int spawnUpgrade(int argc, const char* const * const argv, pid_t& pid)
+{
+    pid = -1;
+    int fds[2];
+
+    if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) == -1)
+    {
+        perror("socketpair() failed");
+        return -1;
+    }
+
+    pid = fork();
+
+    if(pid == -1)
+    {
+        perror("fork() failed");
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+
+    if(pid == 0)
+    {
+        // dup() clears FD_CLOEXEC, only this descriptor survives exec()
+        char fdStr[16];
+        snprintf(fdStr, sizeof(fdStr), "%d", dup(fds[1]));
+
+        Array<const char*> args;
+        for(int i = 0; i < argc; ++i)
+        {
+            if(strcmp(argv[i], "-handoff") == 0)
+                ++i;
+            else
+                args.pushBack(argv[i]);
+        }
+
+        args.pushBack("-handoff");
+        args.pushBack(fdStr);
+        args.pushBack(nullptr);
+
+        execvp(argv[0], (char* const*)args.data());
+        perror("execvp() failed");
+        _exit(1);
+    }
+
+    close(fds[1]);
+
+    // don't hang if the new process does
+    timeval timeout = {10, 0};
+    setsockopt(fds[0], SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fds[0], SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    return fds[0];
+}
+
+bool sendRoomState(int sockfd, int idx, const Room& room, const MsgRing& history)
+{
+    HandoffRoom hr = {};
+    hr.idx = idx;
+    memcpy(hr.name, room.name, sizeof(hr.name));
+    hr.numPlayers = room.numPlayers;
+    hr.historySize = history.size();
+
+    iovec iov[2];
+    const int numSpans = history.getSpans(iov);
+    bool ok = sendAll(sockfd, &hr, sizeof(hr));
+
+    for(int i = 0; ok && i < numSpans; ++i)
+        ok = sendAll(sockfd, iov[i].iov_base, iov[i].iov_len);
+
+    return ok;
+}
+
+bool recvRoomState(int sockfd, Array<Room>& rooms, MsgRing* histories, Array<char>& scratch)
+{
+    HandoffRoom hr;
+    if(!recvAll(sockfd, &hr, sizeof(hr)) || hr.idx < 0 || hr.idx >= rooms.size())
+        return false;
+
+    Room& room = rooms[hr.idx];
+    room.used = true;
+    memcpy(room.name, hr.name, sizeof(room.name));
+    room.name[sizeof(room.name) - 1] = '\0';
+    room.numPlayers = hr.numPlayers;
+    room.numBroadcastMsgs = 0;
+
+    scratch.resize(hr.historySize);
+    if(!recvAll(sockfd, scratch.data(), scratch.size()))
+        return false;
+
+    histories[hr.idx].clear();
+    histories[hr.idx].push(scratch.data(), scratch.size());
+    return true;
+}
+
+// the simulation is stopped
+bool sendMapState(int sockfd, TileMap& map)
+{
+    const int numChunks = map.getNumChunks();
+    return sendAll(sockfd, map.getVersions(), numChunks * sizeof(unsigned)) &&
+           sendAll(sockfd, map.getTiles(), numChunks * chunkArea);
+}
+
+// a map of another size is read and dropped, the new process keeps its generated one
+bool recvMapState(int sockfd, TileMap& map, int mapSize, Array<char>& scratch)
+{
+    const int numChunks = mapSize * mapSize;
+
+    if(mapSize != map.getWidthChunks() || mapSize != map.getHeightChunks())
+    {
+        printf("the map size has changed, the world is regenerated\n");
+        scratch.resize(numChunks * (sizeof(unsigned) + chunkArea));
+        return recvAll(sockfd, scratch.data(), scratch.size());
+    }
+
+    return recvAll(sockfd, map.getVersions(), numChunks * sizeof(unsigned)) &&
+           recvAll(sockfd, map.getTiles(), numChunks * chunkArea);
+}
+
+bool sendClientState(int sockfd, const Client& client, const HotClients& hot, int i,
+                     const Array<char>& sendBuf, int sendBufNumWire, const Array<char>& recvBuf,
+                     int recvBufNumUsed, const Array<char>& prioBuf,
+                     const Array<char>& pendingStateBuf, const Array<char>& sessionLog)
+{
+    HandoffClient hc = {};
+    hc.status = hot.statuses[i];
+    hc.transport = hot.transports[i];
+    memcpy(hc.name, client.name, sizeof(hc.name));
+    hc.alive = client.alive;
+    hc.compress = hot.compress.test(i);
+    hc.congested = hot.congested.test(i);
+    hc.detached = hot.detached.test(i);
+    hc.websocket = hot.websocket.test(i);
+    hc.viewing = hot.viewing.test(i);
+    hc.staleView = hot.staleView.test(i);
+    hc.replayHistory = hot.replayHistory.test(i);
+    hc.viewX = client.viewX;
+    hc.viewY = client.viewY;
+    hc.token = client.token;
+    hc.detachTime = client.detachTime;
+    hc.sessionSeq = client.sessionSeq;
+    hc.sessionLogBase = client.sessionLogBase;
+    hc.room = hot.rooms[i];
+    hc.captureId = client.captureId;
+    hc.udpAddr = client.udpAddr;
+    hc.udpAddrSize = client.udpAddrSize;
+    hc.sendBufSize = sendBuf.size();
+    hc.sendBufNumWire = sendBufNumWire;
+    hc.sendHeadLeft = client.sendHeadLeft;
+    hc.sendNumRaw = client.sendNumRaw;
+    hc.wsNumDecoded = client.wsNumDecoded;
+    hc.recvBufNumUsed = recvBufNumUsed;
+    hc.prioBufSize = prioBuf.size();
+    hc.pendingStateBufSize = pendingStateBuf.size();
+    hc.sessionLogSize = sessionLog.size();
+
+    const bool ok = hc.detached ? sendAll(sockfd, &hc, sizeof(hc)) :
+                                  sendWithFd(sockfd, &hc, sizeof(hc), hot.sockfds[i]);
+
+    return ok && sendAll(sockfd, sendBuf.data(), sendBuf.size()) &&
+           sendAll(sockfd, recvBuf.data(), recvBufNumUsed) &&
+           sendAll(sockfd, prioBuf.data(), prioBuf.size()) &&
+           sendAll(sockfd, pendingStateBuf.data(), pendingStateBuf.size()) &&
+           sendAll(sockfd, sessionLog.data(), sessionLog.size());
+}
+
+bool recvClientState(int sockfd, Client& client, HotClients& hot, int i, Array<char>& sendBuf,
+                     int& sendBufNumWire, Array<char>& recvBuf, int& recvBufNumUsed,
+                     Array<char>& prioBuf, Array<char>& pendingStateBuf,
+                     Array<char>& sessionLog)
+{
+    HandoffClient hc;
+    int clientSockfd;
+    if(!recvWithFd(sockfd, &hc, sizeof(hc), clientSockfd) || (clientSockfd == -1) != hc.detached)
+        return false;
+
+    resetHotClient(hot, i, clientSockfd, hc.transport);
+    hot.statuses[i] = hc.status;
+    hot.closeAfterSend.assign(i, hc.status == ClientStatus::Browser);
+    memcpy(client.name, hc.name, sizeof(client.name));
+    client.name[sizeof(client.name) - 1] = '\0';
+    client.alive = hc.alive;
+    hot.compress.assign(i, hc.compress);
+    hot.congested.assign(i, hc.congested);
+    hot.detached.assign(i, hc.detached);
+    hot.websocket.assign(i, hc.websocket);
+    hot.viewing.assign(i, hc.viewing);
+    hot.staleView.assign(i, hc.staleView);
+    hot.replayHistory.assign(i, hc.replayHistory);
+    client.viewX = hc.viewX;
+    client.viewY = hc.viewY;
+    client.token = hc.token;
+    client.detachTime = hc.detachTime;
+    client.sessionSeq = hc.sessionSeq;
+    client.sessionLogBase = hc.sessionLogBase;
+    hot.rooms[i] = hc.room;
+    client.captureId = hc.captureId;
+    client.udpAddr = hc.udpAddr;
+    client.udpAddrSize = hc.udpAddrSize <= sizeof(client.udpAddr) ? hc.udpAddrSize : 0;
+
+    sendBuf.resize(hc.sendBufSize);
+    sendBufNumWire = hc.sendBufNumWire;
+    client.sendHeadLeft = hc.sendHeadLeft;
+    client.sendNumRaw = hc.sendNumRaw;
+    client.wsNumDecoded = hc.wsNumDecoded;
+    prioBuf.resize(hc.prioBufSize);
+    pendingStateBuf.resize(hc.pendingStateBufSize);
+    sessionLog.resize(hc.sessionLogSize);
+    recvBufNumUsed = hc.recvBufNumUsed;
+
+    if(recvBuf.size() < recvBufNumUsed)
+        recvBuf.resize(recvBufNumUsed);
+
+    return recvAll(sockfd, sendBuf.data(), sendBuf.size()) &&
+           recvAll(sockfd, recvBuf.data(), recvBufNumUsed) &&
+           recvAll(sockfd, prioBuf.data(), prioBuf.size()) &&
+           recvAll(sockfd, pendingStateBuf.data(), pendingStateBuf.size()) &&
+           recvAll(sockfd, sessionLog.data(), sessionLog.size());
+}
+
+static volatile int gExitLoop = false;
+void sigHandler(int) {gExitLoop = true;}
+
+static volatile int gUpgrade = false;
+void upgradeHandler(int) {gUpgrade = true;}
+
+static volatile int gWriteTrace = false;
+void traceHandler(int) {gWriteTrace = true;}
+
+int main(int argc, const char* const * const argv)
+{
+    Config config;
+    if(!parseArgs(argc, argv, config))
+    {
+        printUsage();
+        return 0;
+    }
+
+    signal(SIGINT, sigHandler);
+    signal(SIGTERM, sigHandler);
+    signal(SIGUSR2, upgradeHandler);
+    signal(SIGUSR1, traceHandler);
+
+    // accepted sockets will need one descriptor each
+    {
+        rlimit limit;
+        if(getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+        {
+            limit.rlim_cur = limit.rlim_max;
+            if(setrlimit(RLIMIT_NOFILE, &limit) == -1)
+                perror("setrlimit() (RLIMIT_NOFILE) failed");
+        }
+    }
+
+    const int maxClients = config.maxClients;
+    Array<Client> clients;
+    clients.reserve(maxClients);
+    HotClients hot;
+    initHotClients(hot, maxClients);
+    Array<char>* const sendBufs = new Array<char>[maxClients];
+    Array<char>* const recvBufs = new Array<char>[maxClients];
+    int* const recvBufsNumUsed = new int[maxClients];
+    // sendBufs[i] bytes before this index are ready for send(), the rest are raw
+    // messages queued during this iteration (compressed before the send phase)
+    int* const sendBufsNumWire = new int[maxClients];
+    // raw PING / PONG and state messages, they go ahead of the bulk data (chat) in the send
+    // phase
+    Array<char>* const prioBufs = new Array<char>[maxClients];
+    // state messages held back while the client is congested
+    Array<char>* const pendingStateBufs = new Array<char>[maxClients];
+    // CHAT messages not acked by the player, replayed when the session is resumed
+    Array<char>* const sessionLogs = new Array<char>[maxClients];
+    // messages of the datagrams received in this iteration / to be sent
+    Array<char>* const udpRecvBufs = new Array<char>[maxClients];
+    Array<char>* const udpSendBufs = new Array<char>[maxClients];
+    // the message being reassembled from FRAGs
+    FragAssembler* const udpAssemblers = new FragAssembler[maxClients];
+
+    const int maxRooms = config.maxRooms;
+    Array<Room> rooms;
+    rooms.resize(maxRooms);
+    // pre-framed CHAT messages, replayed to the players who join the room
+    MsgRing* const histories = new MsgRing[maxRooms];
+    // messages for every player in the room, encoded once per iteration
+    Array<char>* const broadcastBufs = new Array<char>[maxRooms];
+    Array<char>* const broadcastBufsLz = new Array<char>[maxRooms];
+    Array<char>* const broadcastBufsWs = new Array<char>[maxRooms];
+    Array<char> scratchBuf;
+    // messages of one receive buffer (and the datagrams of the client)
+    Array<Frame> frames;
+    Array<Frame> udpFrames;
+    char datagram[maxDatagramSize];
+    Packetizer packetizer;
+    LzEncoder encoder;
+    Metrics metrics;
+    CaptureWriter capture;
+    int nextCaptureId = 1;
+    Journal journal;
+    // histories of the rooms used recently, not only the current ones
+    JournalState journalState;
+    journalState.init(config.historySize, maxRooms * 4);
+    Sim sim;
+    sim.tickRate = config.tickRate;
+    sim.viewRadius = config.viewRadius;
+    sim.map.init(config.mapSize, config.mapSize, config.mapSeed);
+    sim.cmds.init(config.simQueueSize);
+    sim.msgs.init(config.simQueueSize);
+    // batches for the simulation queues
+    Array<SimCmd> simCmds;
+    Array<SimMsg> simMsgs;
+    simMsgs.resize(256);
+    BrokerLink broker;
+    Array<PlayerName> remoteNames;
+    // accepted and passed connections of this iteration
+    Array<NewConn> newConns;
+    TokenBucket admitBucket = {config.admitLimit.burst, getTimeSec()};
+    double admitSlotTime = 0.0; // see deferConn()
+    Profiler profiler;
+    profiler.init(config.profileSpans);
+
+    if(config.captureFile && !capture.open(config.captureFile))
+        return 0;
+
+    for(int i = 0; i < maxClients; ++i)
+    {
+        sendBufs[i].reserve(500);
+        recvBufs[i].resize(500);
+    }
+
+    for(int i = 0; i < maxRooms; ++i)
+    {
+        rooms[i].used = false;
+        rooms[i].generation = 0;
+        rooms[i].subscribed[0] = '\0';
+        histories[i].init(config.historySize);
+    }
+
+    createRoom(rooms, "lobby");
+
+    if(config.journalFile)
+    {
+        const double startTime = getTimeSec();
+        if(!journal.open(config.journalFile, journalState))
+            return 0;
+
+        metrics.journalRecoveryMs = (getTimeSec() - startTime) * 1000.0;
+        printf("journal: %lld records, %d profiles recovered in %lld ms\n",
+               journal.numRecovered, journalState.getNumProfiles(), metrics.journalRecoveryMs);
+
+        // the hot upgrade replaces it with the history of the running server
+        loadHistory(journalState, rooms[0].name, histories[0]);
+    }
+
+    double currentTime = getTimeSec();
+    float timer = 0.f;
+    int sockfd;
+    int udpfd = -1;
+    int unixfd = -1;
+
+    if(config.handoffFd == -1)
+    {
+        sockfd = createListener(config);
+        if(sockfd == -1)
+            return 0;
+
+        if(config.udpPort != 0)
+        {
+            udpfd = createUdpSocket(config);
+            if(udpfd == -1)
+                printf("UDP is disabled\n");
+        }
+
+        if(config.unixPath)
+        {
+            unixfd = createUnixListener(config);
+            if(unixfd == -1)
+                return 0;
+        }
+    }
+    // take over from the previous process
+    else
+    {
+        HandoffHeader header;
+        bool ok = recvWithFd(config.handoffFd, &header, sizeof(header), sockfd) &&
+                  sockfd != -1 && header.version == handoffVersion &&
+                  header.numClients <= maxClients;
+
+        if(ok && header.udp)
+        {
+            char byte;
+            ok = recvWithFd(config.handoffFd, &byte, 1, udpfd) && udpfd != -1;
+        }
+
+        if(ok && header.unixListener)
+        {
+            char byte;
+            ok = recvWithFd(config.handoffFd, &byte, 1, unixfd) && unixfd != -1;
+        }
+
+        for(int i = 0; ok && i < header.numRooms; ++i)
+            ok = recvRoomState(config.handoffFd, rooms, histories, scratchBuf);
+
+        ok = ok && header.mapSize > 0 && header.mapSize <= 256 &&
+             recvMapState(config.handoffFd, sim.map, header.mapSize, scratchBuf);
+
+        for(int i = 0; ok && i < header.numClients; ++i)
+        {
+            clients.pushBack(Client());
+            initBuckets(clients.back(), config, currentTime);
+            ok = recvClientState(config.handoffFd, clients.back(), hot, i, sendBufs[i],
+                                 sendBufsNumWire[i], recvBufs[i], recvBufsNumUsed[i],
+                                 prioBufs[i], pendingStateBufs[i], sessionLogs[i]) &&
+                 hot.rooms[i] < maxRooms;
+        }
+
+        // the names must stay claimed at the broker when the previous process exits
+        // after the ack
+        if(ok && config.brokerAddr)
+        {
+            openBroker(broker, config.brokerAddr, rooms, clients, hot, remoteNames);
+
+            if(broker.isOpen() && !broker.flushAll(1000))
+                printf("claiming the names at the broker failed\n");
+        }
+
+        const char ack = 1;
+        if(!ok || !sendAll(config.handoffFd, &ack, 1))
+        {
+            printf("taking over from the previous process failed\n");
+            return 0;
+        }
+
+        close(config.handoffFd);
+        timer = header.heartbeatTimer;
+        nextCaptureId = header.nextCaptureId;
+        printf("took over %d clients from the previous process\n", clients.size());
+    }
+
+    startSim(sim);
+    bool handedOver = false;
+
+    // a hot upgraded process has joined as a new node before the ack, the broker keeps
+    // the names claimed by both processes until the old one exits
+    if(config.brokerAddr && !broker.isOpen())
+        openBroker(broker, config.brokerAddr, rooms, clients, hot, remoteNames);
+
+    // server loop
+    // note: don't change the order of operations
+    // (some logic is based on this)
+    while(gExitLoop == false)
+    {
+        const long long loopStartUs = getTimeUs();
+
+        // update clients
+        PROFILE_PHASE(profiler, "heartbeat");
+        {
+            const double newTime = getTimeSec();
+            timer += newTime - currentTime;
+            currentTime = newTime;
+
+            if(timer > 5.f)
+            {
+                const float periodSec = timer;
+                timer = 0.f;
+
+                metrics.sockSampled = 0;
+                metrics.sockSndBufSum = 0;
+                metrics.sockQueuedSum = 0;
+                metrics.sockUnsentSum = 0;
+                metrics.sockUnsentMax = 0;
+                metrics.udpSentPerSec = (metrics.udpSent - metrics.udpSentPeriodBase) / periodSec;
+                metrics.udpSentPeriodBase = metrics.udpSent;
+
+                if(config.brokerAddr && !broker.isOpen())
+                    openBroker(broker, config.brokerAddr, rooms, clients, hot, remoteNames);
+
+                for(int i = 0; i < clients.size(); ++i)
+                {
+                    Client& client = clients[i];
+                    const ClientStatus status = hot.statuses[i];
+
+                    if(hot.detached.test(i))
+                    {
+                        if(currentTime - client.detachTime > config.sessionGraceSec)
+                        {
+                            printf("session of '%s' has expired\n", client.name);
+                            hot.remove.set(i);
+                            metrics.sessionsExpired += 1;
+                        }
+                        continue;
+                    }
+
+                    // a browser gets one to two heartbeat periods to take its reply
+                    if(status == ClientStatus::Browser)
+                    {
+                        if(client.pinged)
+                        {
+                            printf("browser '%s' will be removed (reply not taken)\n",
+                                   client.name);
+                            hot.remove.set(i);
+                        }
+
+                        client.pinged = true;
+                        continue;
+                    }
+
+                    if(hot.transports[i] == Transport::Tcp && status != ClientStatus::Waiting)
+                    {
+                        tuneSocket(hot.sockfds[i], client,
+                                   config.socketProfiles[int(SocketClass::Player)], periodSec,
+                                   config, metrics);
+                    }
+
+                    // players without any message after our PING
+                    if(client.alive == false &&
+                       (client.pinged || status == ClientStatus::Waiting))
+                    {
+                        printf("client '%s' (%s) will be removed (no PONG or init msg)\n",
+                               client.name, getStatusStr(status));
+                        hot.remove.set(i);
+                    }
+                    else if(status != ClientStatus::Waiting &&
+                            (!client.alive ||
+                             currentTime - client.linkSampleTime >= config.rttRefreshSec))
+                    {
+                        // the liveness check stays on TCP, a lost datagram is not a
+                        // lost connection
+                        if(client.alive && client.udpAddrSize)
+                            addMsg(udpSendBufs[i], Cmd::Ping, IntField{getWallTimeUs()});
+                        else
+                        {
+                            addStateMsg(prioBufs[i], pendingStateBufs[i], hot.congested.test(i),
+                                        Cmd::Ping, metrics, IntField{getWallTimeUs()});
+                        }
+
+                        client.pinged = true;
+                        metrics.pingsSent += 1;
+                    }
+                    // the traffic of the connection proves it's alive
+                    else if(status != ClientStatus::Waiting)
+                    {
+                        client.pinged = false;
+                        metrics.pingsSkipped += 1;
+                    }
+
+                    client.alive = false;
+                    client.rateStrikes = 0;
+                }
+            }
+        }
+
+        // handle new clients, drain the accept queues
+        PROFILE_PHASE(profiler, "accept");
+        {
+            const Listener listeners[] = {{sockfd, Transport::Tcp}, {unixfd, Transport::Unix}};
+            int numAccepts = 0;
+
+            for(const Listener& listener: listeners)
+            {
+                // over maxClients too, the connections get BUSY instead of waiting
+                // in the kernel queue
+                while(listener.sockfd != -1 && numAccepts < config.listenBacklog)
+                {
+                    sockaddr_storage clientAddr;
+                    socklen_t clientAddrSize = sizeof(clientAddr);
+                    // TCP_NODELAY is inherited from the listening socket
+                    const int clientSockfd = accept4(listener.sockfd, (sockaddr*)&clientAddr,
+                                                     &clientAddrSize,
+                                                     SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+                    if(clientSockfd == -1)
+                    {
+                        if(errno == ECONNABORTED || errno == EINTR)
+                            continue;
+
+                        if(errno != EAGAIN && errno != EWOULDBLOCK)
+                        {
+                            perror("accept()");
+
+                            // out of resources, try again in the next iteration
+                            if(errno != EMFILE && errno != ENFILE && errno != ENOBUFS &&
+                               errno != ENOMEM)
+                                gExitLoop = true;
+                        }
+                        break;
+                    }
+
+                    newConns.pushBack({clientSockfd, listener.transport});
+                    ++numAccepts;
+
+                    if(listener.transport == Transport::Unix)
+                    {
+                        printf("accepted local connection\n");
+                        metrics.acceptedUnix += 1;
+                        continue;
+                    }
+
+                    // print client ip
+                    char ipStr[INET6_ADDRSTRLEN];
+                    inet_ntop(clientAddr.ss_family, get_in_addr( (sockaddr*)&clientAddr ),
+                              ipStr, sizeof(ipStr));
+                    printf("accepted connection from %s\n", ipStr);
+                }
+            }
+
+            // the passed connections (from the previous iteration) too
+            for(const NewConn& conn: newConns)
+            {
+                if(clients.size() == maxClients ||
+                   !takeToken(admitBucket, config.admitLimit, currentTime))
+                {
+                    deferConn(conn.sockfd, admitSlotTime, config, currentTime);
+                    metrics.deferred += 1;
+                    continue;
+                }
+
+                const SocketClass sc = getSocketClass(ClientStatus::Waiting, conn.transport);
+                if(!setSocketOptions(conn.sockfd, conn.transport,
+                                     config.socketProfiles[int(sc)]))
+                    metrics.sockOptionErrors += 1;
+
+                clients.pushBack(Client());
+                resetHotClient(hot, clients.size() - 1, conn.sockfd, conn.transport);
+                initBuckets(clients.back(), config, currentTime);
+
+                sendBufs[clients.size() - 1].clear();
+                sendBufsNumWire[clients.size() - 1] = 0;
+                prioBufs[clients.size() - 1].clear();
+                pendingStateBufs[clients.size() - 1].clear();
+                sessionLogs[clients.size() - 1].clear();
+                udpRecvBufs[clients.size() - 1].clear();
+                udpSendBufs[clients.size() - 1].clear();
+                udpAssemblers[clients.size() - 1].clear();
+                recvBufsNumUsed[clients.size() - 1] = 0;
+                metrics.accepted += 1;
+
+                if(capture.isOpen())
+                {
+                    clients.back().captureId = nextCaptureId++;
+                    capture.addEvent(CaptureEvent::Open, clients.back().captureId);
+                }
+            }
+
+            newConns.clear();
+        }
+
+        // receive, PING and PONG timestamps are taken here
+        PROFILE_PHASE(profiler, "receive");
+        const long long recvTimeUs = getWallTimeUs();
+
+        for(int i = 0; i < clients.size(); ++i)
+        {
+            Array<char>& recvBuf = recvBufs[i];
+            int& recvBufNumUsed = recvBufsNumUsed[i];
+            Client& client = clients[i];
+            const int clientSockfd = hot.sockfds[i];
+
+            if(hot.detached.test(i))
+                continue;
+
+            while(true)
+            {
+                const int numFree = recvBuf.size() - recvBufNumUsed;
+                int passedFds[16];
+                int numPassedFds = 0;
+                const int rc = hot.transports[i] == Transport::Unix ?
+                               recvWithFds(clientSockfd, recvBuf.data() + recvBufNumUsed,
+                                           numFree, passedFds, 16, numPassedFds) :
+                               recv(clientSockfd, recvBuf.data() + recvBufNumUsed, numFree, 0);
+
+                // connections handed over by a co-located process (e.g. a gateway
+                // that accepted them), they become clients in the next iteration
+                for(int k = 0; k < numPassedFds; ++k)
+                {
+                    Transport transport;
+                    if(!getTransport(passedFds[k], transport) ||
+                       fcntl(passedFds[k], F_SETFL, O_NONBLOCK) == -1)
+                    {
+                        printf("'%s' has passed an invalid descriptor\n", client.name);
+                        close(passedFds[k]);
+                        continue;
+                    }
+
+                    newConns.pushBack({passedFds[k], transport});
+                    metrics.passedConns += 1;
+                }
+
+                if(rc == -1)
+                {
+                    if(errno != EAGAIN || errno != EWOULDBLOCK)
+                    {
+                        perror("recv() failed");
+                        hot.remove.set(i);
+                    }
+                    break;
+                }
+                else if(rc == 0)
+                {
+                    printf("client has closed the connection\n");
+                    hot.remove.set(i);
+                    break;
+                }
+                else
+                {
+                    recvBufNumUsed += rc;
+                    metrics.bytesRecv += rc;
+
+                    // the ACK goes out now, not with the reply or after the delayed
+                    // ACK timeout
+                    if(hot.transports[i] == Transport::Tcp &&
+                       config.socketProfiles[int(getSocketClass(hot.statuses[i],
+                                                 Transport::Tcp))].quickAck)
+                    {
+                        const int option = 1;
+                        setsockopt(clientSockfd, IPPROTO_TCP, TCP_QUICKACK, &option,
+                                   sizeof(option));
+                        metrics.sockQuickAcks += 1;
+                    }
+
+                    if(recvBufNumUsed < recvBuf.size())
+                        break;
+
+                    recvBuf.resize(recvBuf.size() * 2);
+                    if(recvBuf.size() > 10000)
+                    {
+                        printf("recvBuf big size issue, removing client: '%s' (%s)\n",
+                               client.name, getStatusStr(hot.statuses[i]));
+                        hot.remove.set(i);
+                        break;
+                    }
+                }
+            }
+
+            // the messages of a browser player are unmasked in place
+            if(hot.websocket.test(i) && recvBufNumUsed > client.wsNumDecoded &&
+               !hot.closeAfterSend.test(i) && !hot.remove.test(i))
+            {
+                scratchBuf.clear();
+                bool closed = false;
+                const int size = decodeWsFrames(recvBuf.data(), client.wsNumDecoded,
+                                                recvBufNumUsed, scratchBuf, closed,
+                                                metrics.wsRecv);
+                if(size == -1)
+                {
+                    printf("'%s' has sent an invalid WebSocket frame, removing\n",
+                           client.name);
+                    metrics.wsErrors += 1;
+                    hot.remove.set(i);
+                    continue;
+                }
+
+                recvBufNumUsed = size;
+
+                // PONG / CLOSE frames go after the complete frames of the send buffer
+                if(scratchBuf.size())
+                {
+                    Array<char>& sendBuf = sendBufs[i];
+                    const int pos = sendBufsNumWire[i];
+                    const int prevSize = sendBuf.size();
+                    sendBuf.resize(prevSize + scratchBuf.size());
+                    memmove(sendBuf.data() + pos + scratchBuf.size(), sendBuf.data() + pos,
+                            prevSize - pos);
+                    memcpy(sendBuf.data() + pos, scratchBuf.data(), scratchBuf.size());
+                    sendBufsNumWire[i] += scratchBuf.size();
+                }
+
+                if(closed)
+                    hot.closeAfterSend.set(i);
+            }
+        }
+
+        // datagrams are queued to the player their peer is bound to
+        PROFILE_PHASE(profiler, "receive udp");
+        while(udpfd != -1)
+        {
+            sockaddr_storage addr;
+            socklen_t addrSize = sizeof(addr);
+            const int rc = recvfrom(udpfd, datagram, sizeof(datagram), 0, (sockaddr*)&addr,
+                                    &addrSize);
+
+            if(rc == -1)
+            {
+                if(errno == EINTR)
+                    continue;
+
+                if(errno != EAGAIN && errno != EWOULDBLOCK)
+                    perror("recvfrom() failed");
+                break;
+            }
+
+            metrics.udpRecv += 1;
+
+            // a truncated datagram doesn't end with '\0'
+            const int idx = rc && datagram[rc - 1] == '\0' ?
+                            findUdpPeer(clients, hot, addr, addrSize, datagram) : -1;
+
+            if(idx == -1 || udpRecvBufs[idx].size() + rc > maxUdpRecvSize)
+            {
+                metrics.udpDropped += 1;
+                continue;
+            }
+
+            addDatagramMsgs(datagram, rc, udpAssemblers[idx], udpRecvBufs[idx],
+                            metrics.udpFragsRecv);
+        }
+
+        // process received data
+        PROFILE_PHASE(profiler, "process");
+        for(int i = 0; i < clients.size(); ++i)
+        {
+            Array<char>& sendBuf = sendBufs[i];
+            Array<char>& recvBuf = recvBufs[i];
+            int& recvBufNumUsed = recvBufsNumUsed[i];
+            Client& client = clients[i];
+
+            // most of the clients are idle
+            if(recvBufNumUsed == 0 && udpRecvBufs[i].empty())
+                continue;
+
+            const char* end = recvBuf.data();
+            const char* begin;
+
+            // a browser has its reply already, the rest of the request is dropped
+            // (also after a WebSocket CLOSE)
+            if(hot.closeAfterSend.test(i))
+            {
+                recvBufNumUsed = 0;
+                client.wsNumDecoded = 0;
+                continue;
+            }
+
+            // special case for http
+            if(recvBufNumUsed >= 3 && !hot.websocket.test(i))
+            {
+                const char* const cmd = "GET";
+                if(strncmp(cmd, recvBuf.data(), strlen(cmd)) == 0)
+                {
+                    const char* const headerEnd = (const char*)memmem(recvBuf.data(),
+                                                                      recvBufNumUsed,
+                                                                      "\r\n\r\n", 4);
+                    if(!headerEnd)
+                        continue;
+
+                    // a browser player, the same protocol in WebSocket frames, the frames
+                    // after the request are decoded in the next receive phase
+                    const int headerSize = headerEnd + 4 - recvBuf.data();
+                    char wsKey[32];
+
+                    if(hot.statuses[i] == ClientStatus::Waiting &&
+                       isWsUpgrade(recvBuf.data(), headerSize, wsKey))
+                    {
+                        addWsAcceptReply(sendBuf, wsKey);
+                        sendBufsNumWire[i] = sendBuf.size();
+                        client.sendNumRaw = sendBuf.size();
+                        client.wsNumDecoded = 0;
+                        hot.websocket.set(i);
+                        memmove(recvBuf.data(), recvBuf.data() + headerSize,
+                                recvBufNumUsed - headerSize);
+                        recvBufNumUsed -= headerSize;
+                        metrics.wsUpgrades += 1;
+                        continue;
+                    }
+
+                    hot.statuses[i] = ClientStatus::Browser;
+                    hot.closeAfterSend.set(i);
+
+                    const SocketClass sc = getSocketClass(ClientStatus::Browser,
+                                                          hot.transports[i]);
+                    if(sc == SocketClass::Browser &&
+                       !setSocketOptions(hot.sockfds[i], hot.transports[i],
+                                         config.socketProfiles[int(sc)]))
+                        metrics.sockOptionErrors += 1;
+
+                    const int requestSize = recvBufNumUsed;
+                    recvBufNumUsed = 0;
+
+                    const char* const path = "GET /metrics";
+                    if(requestSize >= int(strlen(path)) &&
+                       strncmp(path, recvBuf.data(), strlen(path)) == 0)
+                    {
+                        writeMetrics(sendBuf, metrics, sim.stats, clients, hot, broker,
+                                     remoteNames.size(), journal, journalState);
+                        continue;
+                    }
+
+                    const char* const tracePath = "GET /trace";
+                    if(requestSize >= int(strlen(tracePath)) &&
+                       strncmp(tracePath, recvBuf.data(), strlen(tracePath)) == 0)
+                    {
+                        writeTrace(sendBuf, profiler);
+                        continue;
+                    }
+
+                    addRawMsg(sendBuf,
+                            "HTTP/1.1 200 OK\r\n"
+                            "Content-Type: text/html\r\n\r\n"
+                            "<!DOCTYPE html>"
+                            "<html>"
+                            "<body>"
+                            "<h1>Welcome to the cavetiles server!</h1>"
+                            "<p><a href=\"https://github.com/m2games\">company</a></p>"
+                            // a player over WebSocket, the messages are '\0' terminated
+                            "<pre id=\"log\"></pre>"
+                            "<input id=\"text\" placeholder=\"name, then chat\">"
+                            "<script>"
+                            "var ws = new WebSocket('ws://' + location.host + '/play');"
+                            "var rx = '', named = false, dec = new TextDecoder();"
+                            "ws.binaryType = 'arraybuffer';"
+                            "ws.onmessage = function(e) {"
+                            "  var msgs = (rx + dec.decode(e.data, {stream: true}))"
+                            "    .split('\\0');"
+                            "  rx = msgs.pop();"
+                            "  msgs.forEach(function(m) {"
+                            "    if(m.startsWith('PING')) ws.send('PONG\\0');"
+                            "    else if(m.startsWith('CHAT '))"
+                            "      log.textContent += m.slice(5) + '\\n';"
+                            "  });"
+                            "};"
+                            "text.onkeydown = function(e) {"
+                            "  if(e.key != 'Enter' || !text.value) return;"
+                            "  ws.send((named ? 'CHAT ' : 'NAME ') + text.value + '\\0');"
+                            "  named = true;"
+                            "  text.value = '';"
+                            "};"
+                            "</script>"
+                            "</body>"
+                            "</html>");
+                    continue;
+                }
+            }
+
+            indexFrames(recvBuf.data(), hot.websocket.test(i) ? client.wsNumDecoded :
+                                                                recvBufNumUsed, frames);
+
+            // the datagrams go through the same dispatch after the stream
+            Array<char>& udpRecvBuf = udpRecvBufs[i];
+            const int numStreamFrames = frames.size();
+            indexFrames(udpRecvBuf.data(), udpRecvBuf.size(), udpFrames);
+
+            for(const Frame& frame: udpFrames)
+                frames.pushBack(frame);
+
+            for(int f = 0; f < frames.size(); ++f)
+            {
+                const Frame& frame = frames[f];
+                const bool viaUdp = f >= numStreamFrames;
+                const char* const data = viaUdp ? udpRecvBuf.data() : recvBuf.data();
+                // replies go back the same way
+                Array<char>& replyBuf = viaUdp ? udpSendBufs[i] : sendBuf;
+                begin = data + frame.offset;
+
+                if(!viaUdp)
+                    end = begin + frame.size + 1;
+
+                if(client.captureId)
+                {
+                    capture.addEvent(CaptureEvent::Frame, client.captureId, begin,
+                                     frame.size + 1);
+                    metrics.captureFrames += 1;
+                }
+
+                printf("'%s' (%s) received msg: '%s'%s\n", client.name,
+                       getStatusStr(hot.statuses[i]), begin, viaUdp ? " (UDP)" : "");
+
+                const MsgView msg = parseMsg(data, frame);
+                const int cmd = msg.cmd;
+                begin = msg.payload;
+                PROFILE_SCOPE(profiler, cmd ? getCmdStr(cmd) : "unknown");
+
+                // the rest needs the ordered stream
+                if(viaUdp && !isUdpCmd(cmd))
+                {
+                    metrics.udpDropped += 1;
+                    continue;
+                }
+
+                // checked before dispatch, CHAT fanout is capped by its limit
+                {
+                    TokenBucket& bucket = client.buckets[cmd];
+                    const RateLimit& limit = config.rateLimits[cmd];
+
+                    if(!takeToken(bucket, limit, currentTime))
+                    {
+                        metrics.rlDropped += 1;
+                        bucket.tokens -= config.ratePenaltySec * limit.perSec;
+                        client.rateStrikes += 1;
+
+                        if(config.rateMaxStrikes && client.rateStrikes >= config.rateMaxStrikes)
+                        {
+                            printf("client '%s' (%s) exceeded rate limits, removing\n",
+                                   client.name, getStatusStr(hot.statuses[i]));
+                            hot.remove.set(i);
+                            metrics.rlDisconnects += 1;
+                            break;
+                        }
+
+                        continue;
+                    }
+                }
+
+                switch(cmd)
+                {
+                    case 0:
+                        printf("WARNING unknown command received: '%s'\n", begin);
+                        break;
+
+                    case Cmd::Ping:
+                        addPongMsg(viaUdp ? replyBuf : prioBufs[i], msg, recvTimeUs);
+                        break;
+
+                    // peers that don't echo the timestamps get PINGs only for liveness
+                    case Cmd::Pong:
+                        addLinkSample(client.link, msg, recvTimeUs);
+                        client.linkSampleTime = currentTime;
+                        break;
+
+                    case Cmd::Name:
+                    {
+                        // the name of a player who left is kept for the session
+                        const bool ok = !isNameTaken(clients, hot, remoteNames, begin) &&
+                                        !(journal.isOpen() &&
+                                          journalState.isReserved(begin, client.token,
+                                                                  time(nullptr)));
+
+                        if(ok)
+                        {
+                            if(hot.statuses[i] != ClientStatus::Player)
+                            {
+                                hot.rooms[i] = 0;
+                                rooms[0].numPlayers += 1;
+                                hot.replayHistory.set(i);
+                            }
+                            else
+                            {
+                                broker.add(BrokerCmd::Release, client.name);
+
+                                if(journal.isOpen())
+                                    journalReservation(journal, journalState, client.name, 0, 0);
+                            }
+
+                            hot.statuses[i] = ClientStatus::Player;
+                            const int maxSize = sizeof(client.name);
+
+                            memcpy(client.name, begin, min(maxSize, msg.payloadSize + 1));
+                            client.name[maxSize - 1] = '\0';
+                            broker.add(BrokerCmd::Claim, client.name);
+
+                            addMsg(broadcastBufs[hot.rooms[i]], Cmd::Chat, lit("'"),
+                                   str(client.name), lit("' has joined the game!"));
+
+                            // the session starts with the messages after the token
+                            if(config.sessionGraceSec > 0.f)
+                            {
+                                client.token = createToken();
+                                client.sessionSeq = 0;
+                                client.sessionLogBase = 0;
+                                sessionLogs[i].clear();
+
+                                addMsg(sendBuf, Cmd::Token, HexField{client.token});
+                            }
+
+                            if(journal.isOpen())
+                                journalLogin(journal, journalState, client, config);
+                        }
+                        else
+                        {
+                            if(hot.statuses[i] == ClientStatus::Player)
+                            {
+                                leaveRoom(rooms, histories, hot.rooms[i]);
+                                broker.add(BrokerCmd::Release, client.name);
+
+                                if(journal.isOpen())
+                                    journalLeave(journal, journalState, client, config);
+                            }
+
+                            hot.statuses[i] = ClientStatus::PlayerRename;
+                            addMsg(sendBuf, Cmd::Name);
+                        }
+
+                        break;
+                    }
+
+                    case Cmd::Chat:
+                    {
+                        // the profile record goes out when the player leaves
+                        if(journal.isOpen() && hot.statuses[i] == ClientStatus::Player)
+                            journalState.getProfile(client.name).stats.chatMsgs += 1;
+
+                        SimCmd simCmd;
+                        simCmd.cmd = cmd;
+                        simCmd.room = hot.rooms[i];
+                        simCmd.roomGen = rooms[hot.rooms[i]].generation;
+                        simCmd.lagUs = client.link.rttUs / 2.f;
+                        simCmd.recvUs = loopStartUs;
+                        simCmd.client = i;
+                        simCmd.token = client.token;
+                        memset(simCmd.args, 0, sizeof(simCmd.args));
+                        memcpy(simCmd.name, client.name, sizeof(simCmd.name));
+                        simCmd.payloadSize = min(msg.payloadSize, maxChatSize);
+                        memcpy(simCmd.payload, begin, simCmd.payloadSize);
+                        simCmds.pushBack(simCmd);
+                        break;
+                    }
+
+                    // TILE <x> <y> <type>, applied with the other edits of the tick
+                    case Cmd::Tile:
+                    {
+                        if(hot.statuses[i] != ClientStatus::Player)
+                            break;
+
+                        SimCmd simCmd;
+                        simCmd.cmd = cmd;
+                        simCmd.room = hot.rooms[i];
+                        simCmd.roomGen = rooms[hot.rooms[i]].generation;
+                        simCmd.lagUs = client.link.rttUs / 2.f;
+                        simCmd.recvUs = loopStartUs;
+                        simCmd.client = i;
+                        simCmd.token = client.token;
+                        simCmd.args[3] = 0;
+                        memcpy(simCmd.name, client.name, sizeof(simCmd.name));
+                        simCmd.payloadSize = 0;
+
+                        if(sscanf(begin, "%d %d %d", &simCmd.args[0], &simCmd.args[1],
+                                  &simCmd.args[2]) == 3)
+                            simCmds.pushBack(simCmd);
+
+                        break;
+                    }
+
+                    // VIEW <x> <y>, the tile the view is centered on
+                    case Cmd::View:
+                    {
+                        int x, y;
+                        if(hot.statuses[i] != ClientStatus::Player ||
+                           sscanf(begin, "%d %d", &x, &y) != 2 || x < 0 || y < 0 ||
+                           x >= config.mapSize * chunkSize || y >= config.mapSize * chunkSize)
+                            break;
+
+                        SimCmd simCmd;
+                        simCmd.cmd = cmd;
+                        simCmd.room = hot.rooms[i];
+                        simCmd.roomGen = rooms[hot.rooms[i]].generation;
+                        simCmd.lagUs = client.link.rttUs / 2.f;
+                        simCmd.recvUs = loopStartUs;
+                        simCmd.client = i;
+                        simCmd.token = client.token;
+                        memcpy(simCmd.name, client.name, sizeof(simCmd.name));
+                        simCmd.args[0] = x >> chunkShift;
+                        simCmd.args[1] = y >> chunkShift;
+                        simCmd.payloadSize = 0;
+
+                        // the same view again - all of its chunks
+                        const bool moved = simCmd.args[0] != client.viewX ||
+                                           simCmd.args[1] != client.viewY;
+
+                        simCmd.args[2] = hot.viewing.test(i) && moved ? client.viewX : -1;
+                        simCmd.args[3] = client.viewY;
+                        client.viewX = simCmd.args[0];
+                        client.viewY = simCmd.args[1];
+                        hot.viewing.set(i);
+                        simCmds.pushBack(simCmd);
+                        break;
+                    }
+
+                    case Cmd::Room:
+                    {
+                        if(hot.statuses[i] != ClientStatus::Player)
+                            break;
+
+                        // as the room stores it
+                        char name[sizeof(Room::name)];
+                        snprintf(name, sizeof(name), "%s", begin);
+                        int room = findRoom(rooms, name);
+
+                        if(room == -1 && name[0])
+                        {
+                            room = createRoom(rooms, name);
+
+                            if(room != -1 && journal.isOpen())
+                                loadHistory(journalState, rooms[room].name, histories[room]);
+                        }
+
+                        // empty reply - the room can't be created
+                        if(room == -1 || room == hot.rooms[i])
+                        {
+                            addMsg(sendBuf, Cmd::Room, str(room == -1 ? "" : rooms[room].name));
+                            break;
+                        }
+
+                        const int prevRoom = hot.rooms[i];
+                        leaveRoom(rooms, histories, prevRoom);
+
+                        if(rooms[prevRoom].used)
+                        {
+                            addMsg(broadcastBufs[prevRoom], Cmd::Chat, lit("'"), str(client.name),
+                                   lit("' has left the room"));
+                        }
+
+                        hot.rooms[i] = room;
+                        rooms[room].numPlayers += 1;
+                        hot.replayHistory.set(i);
+                        addMsg(sendBuf, Cmd::Room, str(rooms[room].name));
+                        addMsg(broadcastBufs[room], Cmd::Chat, lit("'"), str(client.name),
+                               lit("' has joined the room"));
+                        break;
+                    }
+
+                    case Cmd::Comp:
+                    {
+                        if(hot.compress.test(i))
+                            break;
+
+                        // a browser has no decoder
+                        if(hot.websocket.test(i))
+                        {
+                            addMsg(sendBuf, Cmd::Comp, IntField{0});
+                            break;
+                        }
+
+                        // everything queued so far goes out uncompressed, the reply is the
+                        // last raw message
+                        const bool ok = atoi(begin) == lzVersion;
+                        addMsg(sendBuf, Cmd::Comp, IntField{ok ? lzVersion : 0});
+                        sendBufsNumWire[i] = sendBuf.size();
+                        client.sendNumRaw = sendBuf.size();
+
+                        if(ok)
+                            hot.compress.set(i);
+
+                        break;
+                    }
+
+                    // RESM <token> <number of CHAT messages received in the session>
+                    case Cmd::Resume:
+                    {
+                        unsigned long long token = 0;
+                        long long numReceived = 0;
+                        sscanf(begin, "%llx %lld", &token, &numReceived);
+
+                        int sessionIdx = -1;
+                        for(int k = 0; k < clients.size(); ++k)
+                        {
+                            if(k != i && token && clients[k].token == token &&
+                               !hot.remove.test(k))
+                            {
+                                sessionIdx = k;
+                                break;
+                            }
+                        }
+
+                        // the session of the token isn't here (e.g. the server restarted) but
+                        // the journal has kept its name, the player is back in the lobby
+                        // without the history and the join message, as after a normal RESM
+                        const PlayerProfile* const reserved =
+                            sessionIdx == -1 && journal.isOpen() ?
+                            journalState.findReservation(token, time(nullptr)) : nullptr;
+
+                        if(reserved && hot.statuses[i] != ClientStatus::Player &&
+                           !isNameTaken(clients, hot, remoteNames, reserved->name))
+                        {
+                            hot.statuses[i] = ClientStatus::Player;
+                            hot.rooms[i] = 0;
+                            rooms[0].numPlayers += 1;
+                            memcpy(client.name, reserved->name, sizeof(client.name));
+                            broker.add(BrokerCmd::Claim, client.name);
+
+                            // nothing to replay, the session continues from the client's count
+                            client.token = token;
+                            client.sessionSeq = max(numReceived, 0LL);
+                            client.sessionLogBase = client.sessionSeq;
+                            sessionLogs[i].clear();
+
+                            addMsg(sendBuf, Cmd::Resume, str(client.name));
+                            addMsg(sendBuf, Cmd::Room, str(rooms[0].name));
+
+                            journalLogin(journal, journalState, client, config);
+                            metrics.journalResumed += 1;
+                            printf("'%s' has resumed the session from the journal\n",
+                                   client.name);
+                            break;
+                        }
+
+                        // the client has to send NAME
+                        if(sessionIdx == -1 || hot.statuses[i] == ClientStatus::Player)
+                        {
+                            addMsg(sendBuf, Cmd::Resume);
+                            break;
+                        }
+
+                        // the session moves to this connection, the old one (detached or not
+                        // timed out yet) is removed without the 'has left' message
+                        Client& old = clients[sessionIdx];
+                        hot.statuses[i] = ClientStatus::Player;
+                        memcpy(client.name, old.name, sizeof(client.name));
+                        client.token = old.token;
+                        client.sessionSeq = old.sessionSeq;
+                        client.sessionLogBase = old.sessionLogBase;
+                        hot.rooms[i] = hot.rooms[sessionIdx];
+                        sessionLogs[i].swap(sessionLogs[sessionIdx]);
+
+                        old.token = 0;
+                        hot.statuses[sessionIdx] = ClientStatus::Waiting;
+                        hot.remove.set(sessionIdx);
+                        recvBufsNumUsed[sessionIdx] = 0;
+                        old.wsNumDecoded = 0;
+
+                        addMsg(sendBuf, Cmd::Resume, str(client.name));
+
+                        // replay only the missed messages
+                        long long numSkip = numReceived - client.sessionLogBase;
+                        if(numSkip < 0)
+                        {
+                            printf("'%s' has missed %lld evicted messages\n", client.name,
+                                   -numSkip);
+                            numSkip = 0;
+                        }
+
+                        const Array<char>& log = sessionLogs[i];
+                        const int from = getMsgsSize(log, numSkip);
+                        const int prevSize = sendBuf.size();
+                        sendBuf.resize(prevSize + log.size() - from);
+                        memcpy(sendBuf.data() + prevSize, log.data() + from, log.size() - from);
+
+                        for(int k = from; k < log.size(); ++k)
+                            metrics.sessionReplayedMsgs += log[k] == '\0';
+
+                        metrics.sessionsResumed += 1;
+                        printf("'%s' has resumed the session\n", client.name);
+                        break;
+                    }
+
+                    case Cmd::Ack:
+                        if(client.token)
+                            ackSessionLog(client, sessionLogs[i], atoll(begin));
+                        break;
+
+                    // the connection attached to the message (SCM_RIGHTS) was taken in
+                    // the receive phase
+                    case Cmd::Pass:
+                        break;
+
+                    // the peer was bound when the datagram arrived, the client repeats
+                    // BIND until this reply
+                    case Cmd::Bind:
+                        if(viaUdp)
+                        {
+                            addMsg(replyBuf, Cmd::Bind);
+                            metrics.udpBinds += 1;
+                        }
+                        break;
+                }
+
+                // any message from a player is as good as a PONG
+                if(hot.statuses[i] != ClientStatus::Waiting)
+                    client.alive = true;
+            }
+
+            const int numToFree = end - recvBuf.data();
+            memmove(recvBuf.data(), recvBuf.data() + numToFree, recvBufNumUsed - numToFree);
+            recvBufNumUsed -= numToFree;
+            udpRecvBuf.clear();
+
+            if(hot.websocket.test(i))
+                client.wsNumDecoded -= numToFree;
+        }
+
+        // a hot upgrade at the end of this iteration, nothing can stay in the simulation
+        const bool upgrading = gUpgrade;
+
+        // hand the game commands over to the simulation, take its messages
+        PROFILE_PHASE(profiler, "simulation");
+        {
+            const int numPushed = sim.cmds.push(simCmds.data(), simCmds.size());
+            metrics.simCmdsDropped += simCmds.size() - numPushed;
+            simCmds.clear();
+
+            if(upgrading)
+                stopSim(sim);
+
+            int numMsgs;
+            while((numMsgs = sim.msgs.pop(simMsgs.data(), simMsgs.size())))
+            {
+                for(int k = 0; k < numMsgs; ++k)
+                {
+                    const SimMsg& msg = simMsgs[k];
+
+                    if(msg.room == -1)
+                    {
+                        addTileMsg(msg, clients, hot, sendBufs, config, metrics);
+                        continue;
+                    }
+
+                    Array<char>& buf = broadcastBufs[msg.room];
+
+                    // the room was freed (and maybe reused) in the meantime
+                    if(!rooms[msg.room].used || rooms[msg.room].generation != msg.roomGen)
+                    {
+                        metrics.simMsgsStale += 1;
+                        continue;
+                    }
+
+                    const int prevSize = buf.size();
+                    buf.resize(prevSize + msg.size);
+                    memcpy(buf.data() + prevSize, msg.data, msg.size);
+                }
+            }
+        }
+
+        // inform players if someone will leave the game
+        PROFILE_PHASE(profiler, "inform");
+        for(int i = hot.remove.findNext(0); i != -1; i = hot.remove.findNext(i + 1))
+        {
+            const Client& client = clients[i];
+
+            if(hot.statuses[i] == ClientStatus::Player && !willDetach(client, hot, i, config))
+            {
+                addMsg(broadcastBufs[hot.rooms[i]], Cmd::Chat, lit("'"), str(client.name),
+                       lit("' has left"));
+            }
+        }
+
+        // exchange the room broadcasts with the other nodes, ours are published before
+        // theirs are added
+        PROFILE_PHASE(profiler, "broker");
+        if(broker.isOpen())
+        {
+            for(int r = 0; r < maxRooms; ++r)
+            {
+                Room& room = rooms[r];
+                const char* const name = room.used ? room.name : "";
+
+                // the slot of a freed room can be reused with another name
+                if(strcmp(room.subscribed, name) != 0)
+                {
+                    if(room.subscribed[0])
+                        broker.add(BrokerCmd::Unsub, room.subscribed);
+
+                    if(room.used)
+                        broker.add(BrokerCmd::Sub, room.name);
+
+                    snprintf(room.subscribed, sizeof(room.subscribed), "%s", name);
+                }
+
+                if(room.used && broadcastBufs[r].size())
+                {
+                    broker.add(BrokerCmd::Pub, room.name, broadcastBufs[r].data(),
+                               broadcastBufs[r].size());
+                    metrics.brokerPublished += 1;
+                }
+            }
+
+            BrokerMsg msg;
+            const char* data;
+
+            if(broker.receive())
+            {
+                while(broker.nextMsg(msg, data))
+                {
+                    switch(BrokerCmd(msg.cmd))
+                    {
+                        case BrokerCmd::Pub:
+                        {
+                            // unsubscribed in the meantime
+                            const int r = findRoom(rooms, msg.key);
+                            if(r == -1)
+                                break;
+
+                            Array<char>& buf = broadcastBufs[r];
+                            const int prevSize = buf.size();
+                            buf.resize(prevSize + msg.size);
+                            memcpy(buf.data() + prevSize, data, msg.size);
+                            metrics.brokerReceived += 1;
+                            break;
+                        }
+
+                        case BrokerCmd::Claim:
+                        {
+                            // the claims of the previous process for the players taken
+                            // over by this one
+                            if(isNameLocal(clients, hot, msg.key))
+                                break;
+
+                            PlayerName remote;
+                            snprintf(remote.name, sizeof(remote.name), "%s", msg.key);
+                            remoteNames.pushBack(remote);
+                            break;
+                        }
+
+                        case BrokerCmd::Release:
+                            for(int k = 0; k < remoteNames.size(); ++k)
+                            {
+                                if(strcmp(remoteNames[k].name, msg.key) == 0)
+                                {
+                                    remoteNames[k] = remoteNames.back();
+                                    remoteNames.popBack();
+                                    break;
+                                }
+                            }
+                            break;
+
+                        default:
+                            break;
+                    }
+                }
+            }
+        }
+
+        // encode outgoing data
+        PROFILE_PHASE(profiler, "encode");
+        {
+            for(int r = 0; r < maxRooms; ++r)
+            {
+                broadcastBufsLz[r].clear();
+                broadcastBufsWs[r].clear();
+                rooms[r].numBroadcastMsgs = countMsgs(broadcastBufs[r].data(),
+                                                      broadcastBufs[r].size());
+            }
+
+            for(int i = 0; i < clients.size(); ++i)
+            {
+                Array<char>& buf = sendBufs[i];
+                Client& client = clients[i];
+
+                if(hot.compress.test(i))
+                    encodeSendBuf(buf, sendBufsNumWire[i], encoder, scratchBuf, metrics);
+                else if(hot.websocket.test(i))
+                    frameSendBuf(buf, sendBufsNumWire[i], metrics);
+
+                if(hot.statuses[i] != ClientStatus::Player || hot.remove.test(i))
+                    continue;
+
+                if(hot.replayHistory.test(i))
+                {
+                    hot.replayHistory.reset(i);
+                    const MsgRing& history = histories[hot.rooms[i]];
+
+                    iovec iov[3];
+                    const int numSpans = history.getSpans(iov + 1);
+
+                    if(client.token)
+                    {
+                        for(int s = 1; s <= numSpans; ++s)
+                        {
+                            addSessionLog(client, sessionLogs[i], (const char*)iov[s].iov_base,
+                                          iov[s].iov_len, countMsgs((const char*)iov[s].iov_base,
+                                          iov[s].iov_len), config.sessionLogMax, metrics);
+                        }
+                    }
+
+                    if(numSpans && !hot.detached.test(i))
+                    {
+                        metrics.historyReplays += 1;
+                        metrics.historyMsgs += history.numMsgs();
+
+                        if(hot.compress.test(i))
+                        {
+                            for(int s = 1; s <= numSpans; ++s)
+                            {
+                                metrics.lzBlocks += 1;
+                                metrics.lzBytesIn += iov[s].iov_len;
+                                metrics.lzBytesOut += encoder.encode(
+                                    (const char*)iov[s].iov_base, iov[s].iov_len, buf);
+                            }
+                        }
+                        else if(hot.websocket.test(i))
+                        {
+                            for(int s = 1; s <= numSpans; ++s)
+                            {
+                                addWsFrame(buf, WsOpcode::Binary, (const char*)iov[s].iov_base,
+                                           iov[s].iov_len);
+                                metrics.wsFramesSent += 1;
+                            }
+                        }
+                        else
+                        {
+                            // pending data and the history with one syscall, no copies
+                            iov[0] = {buf.data(), size_t(buf.size())};
+                            int rc = writev(hot.sockfds[i], iov, numSpans + 1);
+
+                            if(rc == -1)
+                            {
+                                if(errno != EAGAIN && errno != EWOULDBLOCK)
+                                {
+                                    perror("writev() failed");
+                                    hot.remove.set(i);
+                                    continue;
+                                }
+                                rc = 0;
+                            }
 
-    if(it == nullptr)
-    {
-        printf("binding procedure failed\n");
-        return 0;
-    }
+                            metrics.bytesSent += rc;
 
-    if(listen(sockfd, 5) == -1)
-    {
-        perror("listen() failed");
-        close(sockfd);
-        return 0;
-    }
+                            // whatever the kernel did not take is queued
+                            char lastSent = '\0'; // of the history
+                            for(int s = 0; s <= numSpans; ++s)
+                            {
+                                const int len = iov[s].iov_len;
+                                const int numSent = rc < len ? rc : len;
+                                rc -= numSent;
 
-    constexpr int maxClients = 10;
-    FixedArray<Client, maxClients> clients;
-    Array<char> sendBufs[maxClients];
-    Array<char> recvBufs[maxClients];
-    int recvBufsNumUsed[maxClients];
+                                if(s == 0)
+                                {
+                                    eraseSent(buf, numSent, client, SendFraming::Raw);
+                                    continue;
+                                }
 
-    for(int i = 0; i < maxClients; ++i)
-    {
-        sendBufs[i].reserve(500);
-        recvBufs[i].resize(500);
-    }
+                                if(numSent)
+                                    lastSent = ((const char*)iov[s].iov_base)[numSent - 1];
 
-    double currentTime = getTimeSec();
-    float timer = 0.f;
+                                const int prevSize = buf.size();
+                                buf.resize(prevSize + len - numSent);
+                                memcpy(buf.data() + prevSize,
+                                       (const char*)iov[s].iov_base + numSent, len - numSent);
+                            }
 
-    // server loop
-    // note: don't change the order of operations
-    // (some logic is based on this)
-    while(gExitLoop == false)
-    {
-        // update clients
-        {
-            const double newTime = getTimeSec();
-            timer += newTime - currentTime;
-            currentTime = newTime;
+                            // the rest of a cut message is the frame at the head
+                            if(lastSent != '\0')
+                            {
+                                client.sendHeadLeft = getFrameEnd(buf, 0, buf.size(),
+                                                                  SendFraming::Raw);
+                            }
+                        }
+                    }
+                }
 
-            if(timer > 5.f)
-            {
-                timer = 0.f;
+                const Room& room = rooms[hot.rooms[i]];
+                const Array<char>& broadcastBuf = broadcastBufs[hot.rooms[i]];
+                Array<char>& broadcastBufLz = broadcastBufsLz[hot.rooms[i]];
+                Array<char>& broadcastBufWs = broadcastBufsWs[hot.rooms[i]];
 
-                for(int i = 0; i < clients.size(); ++i)
-                {
-                    Client& client = clients[i];
+                if(broadcastBuf.empty())
+                    continue;
 
-                    if(client.alive == false)
-                    {
-                        printf("client '%s' (%s) will be removed (no PONG or init msg)\n",
-                               client.name, getStatusStr(client.status));
-                        client.remove = true;
-                    }
-                    else if(client.status != ClientStatus::Waiting)
-                        addMsg(sendBufs[i], Cmd::Ping);
+                // chat is bulk traffic
+                if(hot.congested.test(i))
+                {
+                    metrics.bpDroppedMsgs += room.numBroadcastMsgs;
+                    metrics.bpDroppedBytes += broadcastBuf.size();
+                    continue;
+                }
 
-                    client.alive = false;
+                if(client.token)
+                {
+                    addSessionLog(client, sessionLogs[i], broadcastBuf.data(), broadcastBuf.size(),
+                                  room.numBroadcastMsgs, config.sessionLogMax, metrics);
                 }
-            }
-        }
 
-        // handle new client
-        if(clients.size() < clients.maxSize())
-        {
-            sockaddr_storage clientAddr;
-            socklen_t clientAddrSize = sizeof(clientAddr);
-            const int clientSockfd = accept(sockfd, (sockaddr*)&clientAddr, &clientAddrSize);
+                if(hot.detached.test(i))
+                    continue;
 
-            if(clientSockfd == -1)
-            {
-                if(errno != EAGAIN || errno != EWOULDBLOCK)
+                // compressed once per room, on the first use
+                if(hot.compress.test(i) && broadcastBufLz.empty())
                 {
-                    perror("accept()");
-                    break;
+                    encoder.encode(broadcastBuf.data(), broadcastBuf.size(), broadcastBufLz);
+                    metrics.lzBlocks += 1;
                 }
-            }
-            else
-            {
-                const int option = 1;
 
-                if(fcntl(clientSockfd, F_SETFL, O_NONBLOCK) == -1)
+                // framed once per room too
+                if(hot.websocket.test(i) && broadcastBufWs.empty())
                 {
-                    close(clientSockfd);
-                    perror("fcntl() on client failed");
+                    addWsFrame(broadcastBufWs, WsOpcode::Binary, broadcastBuf.data(),
+                               broadcastBuf.size());
+                    metrics.wsFramesSent += 1;
                 }
-                else if(setsockopt(clientSockfd, IPPROTO_TCP, TCP_NODELAY, &option,
-                                   sizeof(option)) == -1)
+
+                const Array<char>& block = hot.compress.test(i) ? broadcastBufLz :
+                                           hot.websocket.test(i) ? broadcastBufWs : broadcastBuf;
+                const int prevSize = buf.size();
+                buf.resize(prevSize + block.size());
+                memcpy(buf.data() + prevSize, block.data(), block.size());
+
+                if(hot.compress.test(i))
                 {
-                    close(clientSockfd);
-                    perror("setsockopt() (TCP_NODELAY) on client failed");
+                    metrics.lzBytesIn += broadcastBuf.size();
+                    metrics.lzBytesOut += block.size();
                 }
-                else
-                {
-                    clients.pushBack(Client());
-                    clients.back().sockfd = clientSockfd;
-                    sendBufs[clients.size() - 1].clear();
-                    recvBufsNumUsed[clients.size() - 1] = 0;
+            }
 
-                    // print client ip
-                    char ipStr[INET6_ADDRSTRLEN];
-                    inet_ntop(clientAddr.ss_family, get_in_addr( (sockaddr*)&clientAddr ),
-                              ipStr, sizeof(ipStr));
-                    printf("accepted connection from %s\n", ipStr);
+            for(int r = 0; r < maxRooms; ++r)
+            {
+                histories[r].push(broadcastBufs[r].data(), broadcastBufs[r].size());
+
+                // one record per room and iteration
+                if(journal.isOpen() && rooms[r].used && broadcastBufs[r].size())
+                {
+                    journalChat(journal, journalState, rooms[r].name, broadcastBufs[r].data(),
+                                broadcastBufs[r].size());
                 }
 
+                broadcastBufs[r].clear();
             }
         }
 
-        // receive
+        // send, whatever the kernel doesn't take is marked for the watermarks
+        PROFILE_PHASE(profiler, "send");
+        hot.unsent.clear();
+
         for(int i = 0; i < clients.size(); ++i)
         {
-            Array<char>& recvBuf = recvBufs[i];
-            int& recvBufNumUsed = recvBufsNumUsed[i];
-            Client& client = clients[i];
+            if(hot.remove.test(i) || hot.detached.test(i))
+                continue;
 
-            while(true)
+            if(udpSendBufs[i].size())
             {
-                const int numFree = recvBuf.size() - recvBufNumUsed;
-                const int rc = recv(client.sockfd, recvBuf.data() + recvBufNumUsed,
-                                    numFree, 0);
+                if(clients[i].udpAddrSize)
+                    sendDatagrams(udpfd, clients[i], udpSendBufs[i], packetizer, metrics);
+
+                udpSendBufs[i].clear();
+            }
+
+            Array<char>& buf = sendBufs[i];
+            if(prioBufs[i].size())
+            {
+                addPrioMsgs(buf, prioBufs[i], clients[i], getSendFraming(hot, i), encoder,
+                            scratchBuf, metrics);
+            }
+
+            if(buf.size())
+            {
+                const int rc = send(hot.sockfds[i], buf.data(), buf.size(), MSG_NOSIGNAL);
 
                 if(rc == -1)
                 {
-                    if(errno != EAGAIN || errno != EWOULDBLOCK)
+                    // kernel buffer is full, the data stays in sendBuf
+                    if(errno != EAGAIN && errno != EWOULDBLOCK)
                     {
-                        perror("recv() failed");
-                        client.remove = true;
+                        perror("send() failed");
+                        hot.remove.set(i);
                     }
-                    break;
-                }
-                else if(rc == 0)
-                {
-                    printf("client has closed the connection\n");
-                    client.remove = true;
-                    break;
                 }
                 else
                 {
-                    recvBufNumUsed += rc;
-
-                    if(recvBufNumUsed < recvBuf.size())
-                        break;
-
-                    recvBuf.resize(recvBuf.size() * 2);
-                    if(recvBuf.size() > 10000)
-                    {
-                        printf("recvBuf big size issue, removing client: '%s' (%s)\n",
-                               client.name, getStatusStr(client.status));
-                        client.remove = true;
-                        break;
-                    }
+                    eraseSent(buf, rc, clients[i], getSendFraming(hot, i));
+                    metrics.bytesSent += rc;
+                    clients[i].periodBytesSent += rc;
                 }
+
+                if(buf.size())
+                    hot.unsent.set(i);
             }
+
+            sendBufsNumWire[i] = buf.size();
         }
 
-        // process received data
-        for(int i = 0; i < clients.size(); ++i)
+        // subscriptions and name claims of this iteration go out with the broadcasts,
+        // the releases of the removed players in the next one
+        broker.flush();
+
+        // apply send buffer watermarks, only a client with unsent data or a congested one
+        // can cross them
+        PROFILE_PHASE(profiler, "watermarks");
+        for(int i = findNextEither(hot.unsent, hot.congested, 0); i != -1;
+            i = findNextEither(hot.unsent, hot.congested, i + 1))
         {
-            Array<char>& sendBuf = sendBufs[i];
-            Array<char>& recvBuf = recvBufs[i];
-            int& recvBufNumUsed = recvBufsNumUsed[i];
-            Client& client = clients[i];
+            Array<char>& buf = sendBufs[i];
 
-            const char* end = recvBuf.data();
-            const char* begin;
+            // the reply of a browser is as large as it needs to be
+            if(hot.remove.test(i) || hot.closeAfterSend.test(i))
+                continue;
 
-            // special case for http
-            if(recvBufNumUsed >= 3)
+            if(buf.size() > config.sendMaxSize)
             {
-                const char* const cmd = "GET";
-                if(strncmp(cmd, recvBuf.data(), strlen(cmd)) == 0)
-                {
-                    client.status = ClientStatus::Browser;
-                    addMsg(sendBuf, Cmd::_nil,
-                            "HTTP/1.1 200 OK\r\n"
-                            "Content-Type: text/html\r\n\r\n"
-                            "<!DOCTYPE html>"
-                            "<html>"
-                            "<body>"
-                            "<h1>Welcome to the cavetiles server!</h1>"
-                            "<p><a href=\"https://github.com/m2games\">company</a></p>"
-                            "</body>"
-                            "</html>");
-                    continue;
-                }
+                printf("send buffer of '%s' (%s) exceeded %d bytes, removing\n",
+                       clients[i].name, getStatusStr(hot.statuses[i]), config.sendMaxSize);
+                hot.remove.set(i);
+                metrics.bpDisconnects += 1;
             }
-
-            while(true)
+            else if(!hot.congested.test(i) && buf.size() > config.sendHighWatermark)
             {
-                begin = end;
-                {
-                    const char* tmp = (const char*)memchr((const void*)end, '\0',
-                                       recvBuf.data() + recvBufNumUsed - end);
+                hot.congested.set(i);
+                metrics.bpCongested += 1;
+            }
+            else if(hot.congested.test(i) && buf.size() <= config.sendLowWatermark)
+            {
+                // the held back state goes ahead of the backlog in the next iteration
+                Array<char>& pending = pendingStateBufs[i];
+                hot.congested.reset(i);
+                const int prevSize = prioBufs[i].size();
+                prioBufs[i].resize(prevSize + pending.size());
+                memcpy(prioBufs[i].data() + prevSize, pending.data(), pending.size());
+                pending.clear();
 
-                    if(tmp == nullptr) break;
-                    end = tmp;
+                // all the chunks of the view (see Cmd::View), a player without a session
+                // token can't get a reply, it sends VIEW after a version gap
+                if(hot.staleView.test(i) && clients[i].token)
+                {
+                    SimCmd simCmd = {};
+                    simCmd.cmd = Cmd::View;
+                    simCmd.room = hot.rooms[i];
+                    simCmd.roomGen = rooms[hot.rooms[i]].generation;
+                    simCmd.client = i;
+                    simCmd.token = clients[i].token;
+                    simCmd.args[0] = clients[i].viewX;
+                    simCmd.args[1] = clients[i].viewY;
+                    simCmd.args[2] = -1;
+                    simCmds.pushBack(simCmd);
+                    metrics.tileViewResends += 1;
                 }
 
-                ++end;
-
-                printf("'%s' (%s) received msg: '%s'\n", client.name,
-                                                         getStatusStr(client.status), begin);
+                hot.staleView.reset(i);
+            }
+        }
 
-                int cmd = 0;
-                for(int i = 1; i < Cmd::_count; ++i)
-                {
-                    const char* const cmdStr = getCmdStr(i);
-                    const int cmdLen = strlen(cmdStr);
+        // remove some clients
+        PROFILE_PHASE(profiler, "remove");
+        int removeIdx = findNextEither(hot.remove, hot.closeAfterSend, 0);
 
-                    if(cmdLen > int(strlen(begin)))
-                        continue;
+        while(removeIdx != -1)
+        {
+            const int i = removeIdx;
+            Client& client = clients[i];
 
-                    if(strncmp(begin, cmdStr, cmdLen) == 0)
-                    {
-                        cmd = i;
-                        begin += cmdLen + 1; // ' '
-                        break;
-                    }
-                }
+            // a browser is closed after its reply is sent
+            if(!hot.remove.test(i) && sendBufs[i].size())
+            {
+                removeIdx = findNextEither(hot.remove, hot.closeAfterSend, i + 1);
+                continue;
+            }
 
-                switch(cmd)
-                {
-                    case 0:
-                        printf("WARNING unknown command received: '%s'\n", begin);
-                        break;
+            // keep the session without the connection
+            if(willDetach(client, hot, i, config))
+            {
+                printf("'%s' has lost the connection, keeping the session for %.0f s\n",
+                       client.name, config.sessionGraceSec);
 
-                    case Cmd::Ping:
-                        addMsg(sendBuf, Cmd::Pong);
-                        break;
+                close(hot.sockfds[i]);
+                hot.sockfds[i] = -1;
+                if(client.captureId)
+                    capture.addEvent(CaptureEvent::Close, client.captureId);
 
-                    case Cmd::Pong:
-                        client.alive = true;
-                        break;
+                client.captureId = 0;
+                hot.detached.set(i);
+                client.detachTime = currentTime;
+                hot.remove.reset(i);
+                hot.compress.reset(i);
+                hot.congested.reset(i);
+                hot.websocket.reset(i);
+                hot.viewing.reset(i);
+                hot.staleView.reset(i);
+                sendBufs[i].clear();
+                sendBufsNumWire[i] = 0;
+                client.sendHeadLeft = 0;
+                client.sendNumRaw = 0;
+                client.wsNumDecoded = 0;
+                recvBufsNumUsed[i] = 0;
+                prioBufs[i].clear();
+                pendingStateBufs[i].clear();
+                client.udpAddrSize = 0;
+                udpRecvBufs[i].clear();
+                udpSendBufs[i].clear();
+                udpAssemblers[i].clear();
+                metrics.sessionsDetached += 1;
+                removeIdx = findNextEither(hot.remove, hot.closeAfterSend, i + 1);
+                continue;
+            }
 
-                    case Cmd::Name:
-                    {
-                        bool ok = true;
+            printf("removing client '%s' (%s)\n", client.name,
+                   getStatusStr(hot.statuses[i]));
 
-                        for(const Client& other: clients)
-                        {
-                            if(other.status == ClientStatus::Player &&
-                               strcmp(other.name, begin) == 0)
-                            {
-                                ok = false;
-                                break;
-                            }
-                        }
+            if(hot.statuses[i] == ClientStatus::Player)
+            {
+                leaveRoom(rooms, histories, hot.rooms[i]);
+                broker.add(BrokerCmd::Release, client.name);
 
-                        if(ok)
-                        {
-                            client.status = ClientStatus::Player;
-                            const int maxSize = sizeof(client.name);
+                if(journal.isOpen())
+                    journalLeave(journal, journalState, client, config);
+            }
 
-                            memcpy(client.name, begin, min(maxSize, int(strlen(begin)) + 1));
-                            client.name[maxSize - 1] = '\0';
+            if(hot.sockfds[i] != -1)
+                close(hot.sockfds[i]);
 
-                            for(int i = 0; i < clients.size(); ++i)
-                            {
-                                if(clients[i].status == ClientStatus::Player)
-                                {
-                                    char msg[64];
-                                    snprintf(msg, sizeof(msg), "'%s' has joined the game!",
-                                             client.name);
+            if(client.captureId)
+                capture.addEvent(CaptureEvent::Close, client.captureId);
 
-                                    addMsg(sendBufs[i], Cmd::Chat, msg);
-                                }
-                            }
-                        }
-                        else
-                        {
-                            client.status = ClientStatus::PlayerRename;
-                            addMsg(sendBuf, Cmd::Name);
-                        }
+            client = clients.back();
 
-                        break;
-                    }
+            const int lastIdx = clients.size() - 1;
+            moveHotClient(hot, i, lastIdx);
+            sendBufs[i].swap(sendBufs[lastIdx]);
+            recvBufs[i].swap(recvBufs[lastIdx]);
+            recvBufsNumUsed[i] = recvBufsNumUsed[lastIdx];
+            sendBufsNumWire[i] = sendBufsNumWire[lastIdx];
+            prioBufs[i].swap(prioBufs[lastIdx]);
+            pendingStateBufs[i].swap(pendingStateBufs[lastIdx]);
+            sessionLogs[i].swap(sessionLogs[lastIdx]);
+            udpRecvBufs[i].swap(udpRecvBufs[lastIdx]);
+            udpSendBufs[i].swap(udpSendBufs[lastIdx]);
+            udpAssemblers[i].swap(udpAssemblers[lastIdx]);
 
-                    case Cmd::Chat:
-                        for(int i = 0; i < clients.size(); ++i)
-                        {
-                            if(clients[i].status == ClientStatus::Player)
-                            {
-                                char msg[512];
-                                snprintf(msg, sizeof(msg), "%s: %s", client.name, begin);
-                                addMsg(sendBufs[i], Cmd::Chat, msg);
-                            }
-                        }
-                        break;
-                }
-            }
+            clients.popBack();
 
-            const int numToFree = end - recvBuf.data();
-            memmove(recvBuf.data(), recvBuf.data() + numToFree, recvBufNumUsed - numToFree);
-            recvBufNumUsed -= numToFree;
+            // the last client has taken the index
+            removeIdx = findNextEither(hot.remove, hot.closeAfterSend, i);
         }
 
-        // inform players if someone will leave the game
-        for(const Client& client: clients)
+        // one write() per iteration, before a hot upgrade process appends to the file
+        PROFILE_PHASE(profiler, "capture");
+        metrics.captureBytes += capture.flush();
+        // the switch to a compacted journal
+        journal.poll();
+
+        // hot upgrade, hand everything over to a new process and exit
+        if(upgrading)
         {
-            if(client.remove && client.status == ClientStatus::Player)
+            gUpgrade = false;
+            // durable before the new process replays it
+            journal.close();
+            pid_t pid;
+            const int upgradefd = spawnUpgrade(argc, argv, pid);
+            bool ok = upgradefd != -1;
+
+            if(ok)
             {
-                char buf[64];
-                snprintf(buf, sizeof(buf), "'%s' has left", client.name);
+                int numRooms = 0;
+                for(const Room& room: rooms)
+                    numRooms += room.used;
 
-                for(int i = 0; i < clients.size(); ++i)
+                const HandoffHeader header = {handoffVersion, nextCaptureId, numRooms,
+                                              clients.size(), config.mapSize, timer,
+                                              udpfd != -1, unixfd != -1};
+                ok = sendWithFd(upgradefd, &header, sizeof(header), sockfd);
+
+                if(ok && header.udp)
                 {
-                    if(clients[i].status == ClientStatus::Player && !clients[i].remove)
-                    {
-                        addMsg(sendBufs[i], Cmd::Chat, buf);
-                    }
+                    const char byte = 1;
+                    ok = sendWithFd(upgradefd, &byte, 1, udpfd);
                 }
-            }
-        }
 
-        // send
-        for(int i = 0; i < clients.size(); ++i)
-        {
-            if(clients[i].remove)
-                continue;
+                if(ok && header.unixListener)
+                {
+                    const char byte = 1;
+                    ok = sendWithFd(upgradefd, &byte, 1, unixfd);
+                }
 
-            Array<char>& buf = sendBufs[i];
-            if(buf.size())
-            {
-                const int rc = send(clients[i].sockfd, buf.data(), buf.size(), 0);
+                for(int r = 0; ok && r < maxRooms; ++r)
+                {
+                    if(rooms[r].used)
+                        ok = sendRoomState(upgradefd, r, rooms[r], histories[r]);
+                }
 
-                if(rc == -1)
+                ok = ok && sendMapState(upgradefd, sim.map);
+
+                for(int i = 0; ok && i < clients.size(); ++i)
                 {
-                    perror("send() failed");
-                    clients[i].remove = true;
+                    ok = sendClientState(upgradefd, clients[i], hot, i, sendBufs[i],
+                                         sendBufsNumWire[i], recvBufs[i], recvBufsNumUsed[i],
+                                         prioBufs[i], pendingStateBufs[i], sessionLogs[i]);
                 }
-                else
-                    buf.erase(0, rc);
+
+                char ack;
+                ok = ok && recvAll(upgradefd, &ack, 1);
+                close(upgradefd);
             }
-        }
 
-        // remove some clients
-        for(int i = 0; i < clients.size(); ++i)
-        {
-            Client& client = clients[i];
-            if(client.remove || client.status == ClientStatus::Browser)
+            // the new process owns the sockets now, closing our descriptors is fine
+            if(ok)
             {
-                printf("removing client '%s' (%s)\n", client.name,
-                       getStatusStr(client.status));
+                printf("handed over %d clients to process %d\n", clients.size(), int(pid));
+                handedOver = true;
+                break;
+            }
 
-                close(client.sockfd);
+            printf("hot upgrade failed, continuing\n");
+            startSim(sim);
+
+            if(pid > 0)
+            {
+                kill(pid, SIGKILL);
+                waitpid(pid, nullptr, 0);
+            }
 
-                client = clients.back();
+            if(config.journalFile && !journal.open(config.journalFile, journalState))
+                printf("the journal is off\n");
+        }
 
-                const int lastIdx = clients.size() - 1;
-                sendBufs[i].swap(sendBufs[lastIdx]);
-                recvBufs[i].swap(recvBufs[lastIdx]);
-                recvBufsNumUsed[i] = recvBufsNumUsed[lastIdx];
+        PROFILE_END_PHASE(profiler);
 
-                clients.popBack();
-                --i;
-            }
+        if(gWriteTrace)
+        {
+            gWriteTrace = false;
+            if(writeTraceFile(config.traceFile, profiler))
+                printf("trace written to '%s'\n", config.traceFile);
+        }
+
+        {
+            const long long loopUs = getTimeUs() - loopStartUs;
+            metrics.loops += 1;
+            metrics.loopBusyUs += loopUs;
+
+            if(loopUs > metrics.loopMaxUs)
+                metrics.loopMaxUs = loopUs;
         }
 
         // sleep for 10 ms
         usleep(10000);
     }
-    
-    for(Client& client: clients)
-        close(client.sockfd);
 
+    // already stopped after a hot upgrade
+    if(sim.thread.joinable())
+        stopSim(sim);
+
+    for(int i = 0; i < clients.size(); ++i)
+    {
+        // the players can resume their sessions after a restart (closed by the hot upgrade)
+        if(journal.isOpen() && hot.statuses[i] == ClientStatus::Player)
+            journalLeave(journal, journalState, clients[i], config);
+
+        if(hot.sockfds[i] != -1)
+            close(hot.sockfds[i]);
+    }
+
+    journal.close();
     close(sockfd);
+
+    if(udpfd != -1)
+        close(udpfd);
+
+    if(unixfd != -1)
+    {
+        close(unixfd);
+
+        // the socket file belongs to the new process
+        if(!handedOver)
+            unlink(config.unixPath);
+    }
+
+    delete[] sendBufs;
+    delete[] recvBufs;
+    delete[] recvBufsNumUsed;
+    delete[] sendBufsNumWire;
+    delete[] prioBufs;
+    delete[] pendingStateBufs;
+    delete[] sessionLogs;
+    delete[] udpRecvBufs;
+    delete[] udpSendBufs;
+    delete[] udpAssemblers;
+    freeHotClients(hot);
+    delete[] histories;
+    delete[] broadcastBufs;
+    delete[] broadcastBufsLz;
+    delete[] broadcastBufsWs;
+
+    printf("sent %lld bytes, compression saved %lld bytes\n", metrics.bytesSent,
+           metrics.lzBytesIn - metrics.lzBytesOut);
     printf("end of the main function\n");
     return 0;
 }